@@ -13,14 +13,129 @@
 
 #include <lua.h>
 #include <lauxlib.h>
+#include <lualib.h>
+
+// Lua 5.1's private Table struct, to read how tables are laid out; see the
+// section on table internals.
+#if LUA_VERSION_NUM == 501
+#include "lua_src/lobject.h"
+#endif
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#define states_table_key      "ApiDemo.SavedStates"
+#define demo_state_metatable  "ApiDemo.LuaState"
+#define demo_buffer_metatable "ApiDemo.Buffer"
+#define typed_array_metatable "ApiDemo.TypedArray"
+#define async_job_metatable   "ApiDemo.AsyncJob"
+#define async_host_key        "ApiDemo.AsyncHost"
+#define alloc_stats_key       "ApiDemo.AllocStats"
+#define gc_sentinel_metatable "ApiDemo.GcSentinel"
+#define table_shapes_key      "ApiDemo.TableShapes"
+#define demo_tables_key       "ApiDemo.DemoTables"
+#define table_versions_key    "ApiDemo.TableVersions"
+#define chunk_cache_key       "ApiDemo.ChunkCache"
+#define chunk_cache_dir_key   "ApiDemo.ChunkCacheDir"
+#define observer_key          "ApiDemo.Observer"
+#define observer_events_key   "ApiDemo.ObserverEvents"
+#define pool_key              "ApiDemo.Pool"
+
+// The first bytes of a flight recorder file. The last one is bumped whenever
+// FlightHeader, FlightEntry or FlightValue change.
+#define flight_magic "apidemo2"
+
+// The most worker threads started for async chunks, however many cores there
+// are.
+#define max_async_workers 64
+
+// The number of calls a flight recorder keeps, unless told otherwise.
+#define flight_default_entries 1024
+
+// A flight recorder file has room for this many function names, and each
+// entry keeps this many arguments, with the first flight_text_len bytes of any
+// that are strings.
+#define flight_max_names 512
+#define flight_max_args  4
+#define flight_text_len  16
+
+// A flight recorder entry's call while a thread is filling it in. It matches
+// no call, so flightdump skips the entry, and no other thread will write to
+// it until it's published.
+#define flight_busy UINT64_MAX
+
+// apidemo.pool warms all its states before it returns, so it can't be asked
+// for more than this many.
+#define max_pool_size 1024
+
+// Each client of the socket stream has a buffer this big for lines it hasn't
+// read yet, and there can be this many clients at once.
+#define stream_buffer_size (64 * 1024)
+#define max_stream_clients 8
+
+// Writes to the socket stream mustn't block, or raise SIGPIPE if the client
+// has gone; where MSG_NOSIGNAL is missing, SO_NOSIGPIPE is set instead.
+#ifdef MSG_NOSIGNAL
+#define stream_send_flags (MSG_DONTWAIT | MSG_NOSIGNAL)
+#else
+#define stream_send_flags MSG_DONTWAIT
+#endif
+
+// The number of leading elements shown when printing a typed array.
+#define array_preview_len 3
+
+// Every checkpoint_period steps, a demo state's history holds a full copy of
+// its stack, unless replaying the changes since the last copy is cheaper than
+// copying the stack. See save_checkpoint.
+#define checkpoint_period 64
+
+// The compiled-chunk cache keeps at most this many bytes of bytecode and keys
+// in memory, dropping the chunks used least recently to make room.
+#define max_chunk_cache_bytes (16 << 20)
+
+// load_state moves a saved stack onto the host stack this many items at a time.
+#define load_chunk_size 1024
+
+// Tables nested deeper than this are printed as pointers.
+#define max_print_depth 32
+
+// While a stack is printed with a time limit, the clock is read once every
+// this many checks of the limits, as reading it costs more than printing an
+// item.
+#define render_clock_period 64
+
+// Code with an instruction or time budget is checked at least this often, in
+// VM instructions.
+#define budget_period 1000
 
-#define states_table_key     "ApiDemo.SavedStates"
-#define demo_state_metatable "ApiDemo.LuaState"
+// The module's globals are kept per thread, so that separate host states can
+// use apidemo from separate threads at the same time.
+#ifdef _MSC_VER
+#define per_thread __declspec(thread)
+#else
+#define per_thread __thread
+#endif
 
 
 // # The help string.
@@ -30,11 +145,12 @@ const char *help_string =
   "-- writing values to the stack ----------------------------------------- \n"
   "                                                                         \n"
   "     lua_pushboolean(L, int)                                [-0 +1 -]    \n"
-  " --- lua_pushfstring(L, str, ...)                           [-0 +1 m]    \n"
+  "     lua_pushfstring(L, str, ...)                           [-0 +1 m]    \n"
   " --- lua_pushinteger(L, lua_Integer)                        [-0 +1 -]    \n"
   "     lua_pushlstring(L, str, size_t)                        [-0 +1 m]    \n"
   "     lua_pushnil(L)                                         [-0 +1 -]    \n"
   "     lua_pushnumber(L, lua_Number)                          [-0 +1 -]    \n"
+  " ptr lua_newuserdata(L, size_t)                             [-0 +1 m]    \n"
   "     lua_pushstring(L, str)                                 [-0 +1 m]    \n"
   "                                                                         \n"
   "                                                                         \n"
@@ -58,14 +174,14 @@ const char *help_string =
   " int lua_isnumber(L, int i)           is stack[i] a number? [-0 +0 -]    \n"
   " int lua_isstring(L, int i)           is stack[i] a string? [-0 +0 -]    \n"
   " int lua_istable(L, int i)            is stack[i] a table?  [-0 +0 -]    \n"
-  " --- lua_isuserdata(L, int i)         is stack[i] a udata?  [-0 +0 -]    \n"
+  " int lua_isuserdata(L, int i)         is stack[i] a udata?  [-0 +0 -]    \n"
   "                                                                         \n"
   " int lua_toboolean(L, int i)          bool(stack[i])        [-0 +0 -]    \n"
   " l_I lua_tointeger(L, int i)          lua_Integer(stack[i]) [-0 +0 -]    \n"
   " str lua_tolstring(L, int, size_t *)  mem is owned by Lua   [-0 +0 -]    \n"
   " l_N lua_tonumber(L, int i)           lua_Number(stack[i])  [-0 +0 -]    \n"
   " str lua_tostring(L, int i)           mem is owned by Lua   [-0 +0 -]    \n"
-  " --- lua_touserdata(L, int i)         returns void *        [-0 +0 -]    \n"
+  " ptr lua_touserdata(L, int i)         returns void *        [-0 +0 -]    \n"
   "                                                                         \n"
   " int lua_type(L, int i)               LUA_T{NIL,TABLE,etc}  [-0 +0 -]    \n"
   " str lua_typename(L, int tp)          LUA_T{NIL,etc}->name  [-0 +0 -]    \n"
@@ -81,7 +197,7 @@ const char *help_string =
   "-- table operations ---------------------------------------------------- \n"
   "                                                                         \n"
   "     lua_newtable(L)                  pushes {}             [-0 +1 m]    \n"
-  " --- lua_createtable(L, int m, int n) m,n=arr,rec capacity  [-0 +1 m]    \n"
+  "     lua_createtable(L, int m, int n) m,n=arr,rec capacity  [-0 +1 m]    \n"
   "                                                                         \n"
   "     lua_settable(L, int i)           pops k,v; stk[i][k]=v [-2 +0 e]    \n"
   "     lua_setfield(L, int i, str k)    pops v; stk[i][k]=v   [-1 +0 e]    \n"
@@ -114,6 +230,24 @@ const char *help_string =
   " int lua_rawequal(L, int i, int j)    equal?; no metacalls  [-0 +0 -]    \n"
   "                                                                         \n"
   "                                                                         \n"
+  "-- string buffers ------------------------------------------------------ \n"
+  "                                                                         \n"
+  "     luaL_buffinit(L, luaL_Buffer *B) start building a str  [-0 +? -]    \n"
+  "     luaL_addlstring(B, str, size_t)  append str to B       [-? +? m]    \n"
+  "     luaL_addvalue(B)                 pop v; append v to B  [-1 +? m]    \n"
+  "     luaL_pushresult(B)               push B's final str    [-? +1 m]    \n"
+  "                                                                         \n"
+  "   In this demo, declare a buffer as: B = luaL_Buffer()                  \n"
+  "                                                                         \n"
+  "                                                                         \n"
+  "-- garbage collection -------------------------------------------------- \n"
+  "                                                                         \n"
+  " int lua_gc(L, int what, int d, ...)  LUA_GC{COLLECT,etc}   [-0 +0 e]    \n"
+  "                                                                         \n"
+  "   what = STOP, RESTART, COLLECT, COUNT, COUNTB, STEP, SETPAUSE,         \n"
+  "          SETSTEPMUL; ISRUNNING (5.2+); GEN, INC (5.2 and 5.4)           \n"
+  "                                                                         \n"
+  "                                                                         \n"
   "-- function calls ------------------------------------------------------ \n"
   "                                                                         \n"
   " --- lua_atpanic(L, lua_CFunciton f)  set panic fn; ret old [-0 +0 -]    \n"
@@ -124,6 +258,19 @@ const char *help_string =
   " int luaL_callmeta(L, int o, str s)   mt(stk[o])[s] if any  [-0 +0|1 e]  \n"
   "                                                                         \n"
   "                                                                         \n"
+  "-- coroutines ---------------------------------------------------------- \n"
+  "                                                                         \n"
+  "  L1 lua_newthread(L)                 push a new thread     [-0 +1 m]    \n"
+  " int lua_resume(L1, int n)            run L1 with n args    [-? +? -]    \n"
+  " int lua_yield(L1, int n)             from L1: yield top n  [-? +? -]    \n"
+  " int lua_status(L)                    0, LUA_YIELD or err   [-0 +0 -]    \n"
+  "     lua_xmove(from, to, int n)       pop n; push onto to   [-? +? -]    \n"
+  "                                                                         \n"
+  "   L1's stack is shared by its body and whoever resumes it. The first    \n"
+  "   resume pops a function and n args; later ones pop only n args, which  \n"
+  "   the body gets as lua_yield's return values.                           \n"
+  "                                                                         \n"
+  "                                                                         \n"
   "-- error handling ------------------------------------------------------ \n"
   "                                                                         \n"
   " int lua_error(L)                     pop errmsg; throw it  [-1 +0 v]    \n"
@@ -152,6 +299,17 @@ const char *help_string =
   " int luaL_dostring(L, str code)       load and run code     [-0 +? m]    \n"
   "                                                                         \n"
   "                                                                         \n"
+  "-- typed arrays (an apidemo extension, not in Lua's C API) ------------- \n"
+  "                                                                         \n"
+  "     apidemo.newarray(L, str k, n)    push k[n]; k=f64|i32  [-0 +1 m]    \n"
+  "     apidemo.array_fill(L, i, l_N x)  stk[i][*] = x         [-0 +0 -]    \n"
+  "     apidemo.array_scale(L, i, l_N x) stk[i][*] *= x        [-0 +0 -]    \n"
+  " l_N apidemo.array_sum(L, int i)      sum of stk[i]         [-0 +0 -]    \n"
+  " l_N apidemo.array_dot(L, int i, j)   stk[i] dot stk[j]     [-0 +0 -]    \n"
+  "                                                                         \n"
+  "   From Lua code, arrays also support a[k], a[k] = x, and #a.            \n"
+  "                                                                         \n"
+  "                                                                         \n"
   "-- key ----------------------------------------------------------------- \n"
   "                                                                         \n"
   " Notation [-a +b X] means: 1st pops last a values, then pushes b values  \n"
@@ -168,813 +326,7349 @@ const char *help_string =
   "   str = const char *                              szt = size_t          \n"
   "   l_I = lua_Integer (often int32 or int64)        stk = stack           \n"
   "   l_N = lua_Number  (often double)                 tp = type            \n"
+  "   ptr = void *                                                          \n"
   "                                                                         \n";
 
 
 // # Internal typedefs.
 
+typedef struct DemoBuffer DemoBuffer;
+typedef struct AsyncJob   AsyncJob;
+
+// Memory counters. Bytes and counts only ever go up; live values are found by
+// subtracting freed from allocated.
+typedef struct {
+  size_t allocated;       // Bytes.
+  size_t freed;           // Bytes, whether freed by the collector or not.
+  size_t allocs;          // Number of new blocks.
+  size_t frees;           // Number of released blocks.
+  size_t gc_cycles;       // Collection cycles completed.
+  double lua_gc_seconds;  // CPU time spent in lua_gc calls on demo states.
+} MemStats;
+
+// How the code run by lua_call, lua_pcall, luaL_dostring and luaL_dofile on a
+// demo state is watched; see apidemo.profile and apidemo.budget.
 typedef struct {
+  int    profile_period;    // If positive, sample every this many instructions.
+  long   max_instructions;  // Each limit is 0 when there's none.
+  size_t max_bytes;
+  double max_seconds;
+} RunSettings;
+
+typedef struct FakeLuaState FakeLuaState;
+
+struct FakeLuaState {
   int ref;
-} FakeLuaState;
+  DemoBuffer *buffer;  // The in-progress luaL_Buffer, if any.
+  AsyncJob   *job;     // The async chunk being run for this state, if any.
+  MemStats mem;        // Totals over all calls made on this state.
+  MemStats last_call;  // What the most recent call allocated and freed.
+
+  // These are set for states made by lua_newthread. Such a state has a saved
+  // stack like any other, which is shared by the coroutine's body and by
+  // whoever resumes it; the real coroutine only holds values while they're in
+  // transit to or from the body.
+  lua_State *thread;     // The real coroutine.
+  FakeLuaState *parent;  // The state that made this one.
+  int is_started;        // Whether the body has been given to the coroutine.
+
+  RunSettings settings;
+
+  // The stack height lua_checkstack has made room for. As in C, the room
+  // lasts from then on, so load_state makes at least this much each call.
+  int checked_top;
+
+  // The untracked_epoch and table_writes as of print_diff's last check of
+  // this state's tables.
+  unsigned long diff_untracked;
+  unsigned long diff_writes;
+
+  // States made for apidemo.pool have the pool_generation they were made for,
+  // and go back to the pool on lua_close, rewound to pool_step, the step init
+  // left them at, and with the pool_settings init left them with. A state put
+  // in the pool by lua_close is given its copy of init's stack only when it's
+  // taken out again, and until then has is_copy_due set.
+  unsigned long pool_generation;
+  int           pool_step;
+  RunSettings   pool_settings;
+  int           is_copy_due;
+
+  // The history of calls on this state, for undo and redo. Step 0 is the new
+  // state; step k is the state after k calls. See save_items.
+  int step;
+  int num_steps;   // Steps past step can be redone.
+  int first_step;  // Steps before it were dropped, to keep max_history.
+
+  // How many calls on this state may have run Lua code, which can change
+  // tables without note_table_write seeing it.
+  unsigned long code_runs;
+
+  // How much of data.fingerprints is up to date: the hashes of the first
+  // fingerprint_valid items, as of table_writes fingerprint_writes and
+  // code_runs fingerprint_code_runs. The lowest of those items that's a
+  // table is fingerprint_table_slot, or 0. See update_fingerprint.
+  int           fingerprint_valid;
+  int           fingerprint_table_slot;
+  unsigned long fingerprint_writes;
+  unsigned long fingerprint_code_runs;
+
+  // Whether a call has loaded this state and not yet saved it, and the fields
+  // a call may change before save_state as they were when it was loaded, so
+  // run_protected can put them back if the call raises an error in between.
+  int is_loaded;
+  struct {
+    DemoBuffer *buffer;
+    int         is_started;
+    int         checked_top;
+  } at_load;
+};
+
+// A luaL_Buffer lives in C memory and keeps part of its contents on the stack
+// of the state it was initialized on. We remember where that part begins so
+// print_stack can render those slots as a single in-progress buffer.
+struct DemoBuffer {
+  luaL_Buffer b;
+  int state_ref;   // Registry ref to the owning demo state; LUA_NOREF if idle.
+  int buffer_ref;  // Registry ref to this buffer, held while it's in progress.
+  int base;        // The stack size when luaL_buffinit was called.
+};
+
+// Typed arrays are userdata holding a contiguous buffer of numbers, so that
+// hot numeric loops can run in C instead of over Lua tables.
+typedef enum {
+  array_f64,
+  array_i32
+} ArrayKind;
+
+// What a wrapped call can change besides its stack, which decides what cached
+// hashes and text of tables run_protected has to distrust.
+typedef enum {
+  call_may_run_code,   // Anything, as by running Lua code.
+  call_stack_only,     // Nothing: it only moves values around on the stack.
+  call_writes_table,   // The table it writes to, seen by note_table_write.
+  call_reads_table     // Nothing, unless what it reads has a metatable; the
+                       // wrapper checks with note_table_read.
+} CallKind;
+
+typedef struct {
+  ArrayKind kind;
+  size_t len;
+  void *data;  // Points just past this header, in the same userdata block.
+} TypedArray;
+
+
+// This wraps the host state's allocator so we can see every allocation. It
+// lives in a userdata in the registry whose __gc puts the original allocator
+// back when the host state is closed.
+typedef struct {
+  lua_Alloc f;     // The allocator being wrapped.
+  void *ud;
+  MemStats total;  // Everything the host state has done since we were loaded.
+} AllocStats;
+
+// What start_running set up for the Lua code run by lua_call, lua_pcall,
+// luaL_dostring or luaL_dofile. It's kept in one struct so run_protected can
+// save and restore it around calls made by that code.
+typedef struct {
+  int        is_running;
+  int        is_hooked;         // Whether run_hook is installed.
+  lua_Hook   old_hook;          // What stop_running puts back.
+  int        old_mask;
+  int        old_count;
+  int        period;            // Instructions between calls to run_hook.
+  int        counts_ref;        // The profile's samples, or LUA_NOREF.
+  lua_State *thread;            // The state running the code.
+  int        profile_base_depth;
+  int        profile_period;
+  int        profile_left;      // Instructions until the next sample.
+  long       instructions;      // Run so far, counted a period at a time.
+  long       max_instructions;  // Each limit is 0 when there's none.
+  double     max_seconds;
+  double     deadline;          // In wall_seconds' terms.
+  size_t     max_bytes;
+  FakeLuaState *state;          // The demo state whose code is running.
+  double     live_base;         // The host's live bytes when it started.
+  double     excluded;          // What calls on other demo states added.
+  double     known_live;        // What it had added at the last full GC.
+  int        gc_due;            // Whether run_hook should collect and check.
+  int        bytes_refused;     // Whether counting_alloc has said no.
+  const char *over_msg;         // The error for a limit gone over, if any.
+  lua_Number  over_limit;
+} RunState;
+
+// Settings changed from Lua via apidemo.set_options.
+typedef struct {
+  int show_memory;  // Print memory use after each stack.
+  int show_gc;      // Print collector work after each stack.
+  int show_tables;  // Print the layout of each table written to.
+  int diff_only;    // Print only what each call changed on the stack.
+  int cache_tables; // Reuse the printed text of unchanged demo-made tables.
+  int cache_chunks; // Keep compiled code for luaL_load* and luaL_do*.
+  int lint;         // Warn about slow patterns of calls.
+  int record_calls; // Keep each call's arguments, for apidemo.export_c.
+  int max_history;  // Steps of history kept per demo state; 0 keeps them all.
+
+  // Limits on printing each stack; 0 means no limit. See is_over_budget.
+  int    max_bytes;    // Output bytes.
+  int    max_items;    // Values printed, including those inside tables.
+  int    max_depth;    // Levels of nested tables.
+  int    max_width;    // Entries printed per table.
+  int    window;       // Stack slots printed, counting down from the top.
+  double max_seconds;  // Wall-clock time.
+} Options;
+
+// A flight recorder file is a FlightHeader followed by num_entries entries,
+// used as a ring; call k is kept in entry (k - 1) % num_entries until it's
+// overwritten. Entries hold values as they are, not as text, so recording a
+// call is cheap; flightdump.c, which has its own copy of these structs,
+// formats them.
+typedef struct {
+  char     magic[8];     // flight_magic, without its terminating zero.
+  uint32_t entry_size;   // sizeof(FlightEntry), as a check on the layout.
+  uint32_t num_entries;
+  uint64_t num_calls;    // Calls started so far.
+  uint32_t num_names;
+  uint32_t unused;
+  char     names[flight_max_names][32];  // Function k's name is names[k].
+} FlightHeader;
+
+typedef struct {
+  int32_t  type;  // Its LUA_T* type, or LUA_TNONE if unset.
+  uint32_t len;   // A string's length, which may be more than is kept.
+  union {
+    double   number;  // For numbers and booleans.
+    uint64_t address; // For tables, functions, userdata and threads.
+    char     text[flight_text_len];  // A string's first bytes.
+  } as;
+} FlightValue;
+
+typedef struct {
+  uint64_t    call;          // The call's number, from 1; see flight_busy.
+  int32_t     depth_before;  // The stack sizes around the call; both are -1 if
+  int32_t     depth_after;   // it never saved one, as when it raised an error.
+  uint32_t    name;          // The index of its name in FlightHeader.names.
+  uint32_t    num_args;      // Its arguments, of which the first few are kept.
+  FlightValue args[flight_max_args];
+  FlightValue top;           // The top value after the call.
+} FlightEntry;
+
+// A client connected to the socket stream, and the lines it's yet to be sent.
+typedef struct {
+  int           fd;
+  char         *buffer;   // stream_buffer_size bytes.
+  size_t        len;      // The bytes in buffer waiting to be sent.
+  unsigned long dropped;  // Events dropped since the client was last told.
+} StreamClient;
+
+// How a table's keys are split between its array and hash parts.
+typedef struct {
+  int array_size;
+  int hash_size;
+  int hash_used;         // The number of keys in the hash part.
+  int int_keys_in_hash;  // Positive integer keys that aren't in the array.
+  int rehashes;          // The number seen since apidemo started tracking it.
+  int is_estimated;      // Whether the sizes are a guess; see measure_table.
+  int is_exact;          // Whether they were read from the table itself.
+} TableShape;
 
 
 // # Internal globals, besides the help string.
 
-static FakeLuaState *current_state;
+static per_thread FakeLuaState *current_state;
+
+static per_thread Options options;
+
+// Printed stacks go to this stream; NULL means stdout. Nothing is printed
+// while is_quiet is set, as it is while apidemo.pool runs init, or after
+// apidemo.set_options{quiet = true}.
+static per_thread FILE *output;
+static per_thread int   is_quiet;
+
+// While an item is printed for the render cache, output is collected in
+// capture instead; see print_slot.
+static per_thread char  *capture;
+static per_thread size_t capture_len;
+static per_thread size_t capture_size;
+static per_thread int    is_capturing;
+static per_thread int    is_cacheable;  // Whether the captured text can be kept.
+// The stack index of the list of tables the captured text shows, or 0, and
+// how many are in it.
+static per_thread int    capture_tables;
+static per_thread int    num_captured;
+
+// The work done so far printing the current stack, and why it was cut off, if
+// it was; see is_over_budget. Budgets only apply while is_rendering is set.
+static per_thread int         is_rendering;
+static per_thread size_t      render_bytes;
+static per_thread int         render_items;
+static per_thread int         render_checks;
+static per_thread double      render_start;  // In wall_seconds' terms.
+static per_thread const char *render_cut;  // NULL until a budget runs out.
+
+// untracked_epoch counts calls that may have changed tables without
+// note_table_write seeing it, as by running Lua code, and table_writes counts
+// the writes it did see. Each table's count at its last write is kept in the
+// weak table at table_versions_key. The render cache and print_diff use these
+// to tell which tables may have changed. Fingerprints use each state's own
+// code_runs instead of untracked_epoch.
+static per_thread unsigned long untracked_epoch;
+static per_thread unsigned long table_writes;
+
+// The CallKind of the innermost call run_protected is running.
+static per_thread CallKind running_kind;
+
+// print_diff finds how many items at the bottom of the stack are unchanged,
+// and save_state needs the same count right after, for the same state and
+// stack, so it's kept here; unchanged_n is -1 when there's none.
+static per_thread FakeLuaState *unchanged_state;
+static per_thread int           unchanged_n = -1;
+static per_thread int           unchanged_count;
+
+// Per-call memory measurement; see start_measuring and stop_measuring.
+static per_thread MemStats call_start;
+static per_thread int      is_measuring;
+
+// When we can't install our allocator (for example, LuaJIT doesn't support
+// lua_setallocf), these counters are built up from lua_gc(LUA_GCCOUNT) deltas.
+// They only see net changes, so allocation counts stay at zero.
+static per_thread MemStats gc_count_stats;
+static per_thread size_t   gc_count_last;
+
+// The table written to by the current call, if any, for options.show_tables.
+static per_thread TableShape table_write;
+static per_thread int        has_table_write;
+static per_thread int        did_rehash;
+
+// A registry ref to the record of the call being run, {name = name, n = n,
+// <args>}, which save_items keeps in data.calls for apidemo.export_c. It's
+// LUA_NOREF unless options.record_calls is on.
+static per_thread int call_record_ref = LUA_NOREF;
+
+// The current call's name and second argument, recorded by run_protected for
+// the performance lint, and the shape of a demo-made table it rehashed.
+static per_thread const char *lint_fn;
+static per_thread lua_Number  lint_arg;
+static per_thread char        lint_arg_str[64];
+static per_thread TableShape  lint_rehash;
+static per_thread int         has_lint_rehash;
+
+// The mapped flight recorder file, if this thread is recording, and the number
+// of the call whose entry is being filled in; see flight_begin.
+static per_thread FlightHeader *flight;
+static per_thread uint64_t      flight_call;
+
+// The socket stream's listening socket, or -1, and its clients. Each event is
+// written as a line of JSON into stream_line before it's queued for them.
+static per_thread int           stream_fd = -1;
+static per_thread char          stream_path[108];
+static per_thread StreamClient  stream_clients[max_stream_clients];
+static per_thread int           num_stream_clients;
+static per_thread unsigned long stream_events;
+static per_thread unsigned long stream_bytes_sent;
+static per_thread unsigned long stream_dropped;
+static per_thread unsigned long stream_unsent;
+static per_thread char         *stream_line;
+static per_thread size_t        stream_line_len;
+static per_thread size_t        stream_line_size;
+
+// Whether apidemo.observe has set an observer, how many observed calls are
+// running, one inside another, and whether the observer itself is running.
+static per_thread int has_observer;
+static per_thread int observe_level;
+static per_thread int is_observing;
+
+// Completed collection cycles, as seen by the GC sentinel, and the time spent
+// in the lua_gc wrapper.
+static per_thread size_t gc_cycles;
+static per_thread double lua_gc_seconds;
+
+// How the compiled-chunk cache has done; see apidemo.chunk_cache. The last
+// lookup's result is noted after the stack of the call that made it.
+static per_thread long        chunk_hits;
+static per_thread long        chunk_misses;
+static per_thread long        chunk_disk_hits;
+static per_thread long        chunk_disk_writes;
+static per_thread const char *chunk_note;
+
+// The warm pool of demo states; see apidemo.pool. The states that are ready to
+// hand out are kept in the registry table at pool_key.
+static per_thread int           pool_size;
+static per_thread int           pool_ready;
+static per_thread unsigned long pool_generation;
+static per_thread long          pool_hits;
+static per_thread long          pool_misses;
+
+// The profiler and budgets of the Lua code being run by the current call,
+// which mean nothing unless run.is_running; see start_running.
+static per_thread RunState      run;
+static per_thread unsigned long run_starts;
 
 
 // # Internal functions.
 
-// ## Functions used to print the stack.
+// ## Output.
 
-static void print_item(lua_State *L, int i, int as_key);
+// All stack printing goes through out and out_bytes so that it can be sent
+// somewhere other than stdout by changing the output global, captured for the
+// render cache, or cut short by options.max_bytes.
 
-static int is_identifier(const char *s) {
-  while (*s) {
-    if (!isalnum(*s) && *s != '_') return 0;
-    ++s;
-  }
-  return 1;
+// This makes room for len more bytes, plus a terminating zero, in capture.
+static void grow_capture(size_t len) {
+  if (capture_len + len + 1 <= capture_size) return;
+  size_t size = capture_size ? capture_size : 256;
+  while (size < capture_len + len + 1) size *= 2;
+  char *new_capture = (char *)realloc(capture, size);
+  if (new_capture == NULL) return;
+  capture      = new_capture;
+  capture_size = size;
 }
 
-static int is_seq(lua_State *L, int i) {
-      // stack = [..]
-  lua_pushnil(L);
-      // stack = [.., nil]
-  int keynum = 1;
-  while (lua_next(L, i)) {
-      // stack = [.., key, value]
-    lua_rawgeti(L, i, keynum);
-      // stack = [.., key, value, t[keynum]]
-    if (lua_isnil(L, -1)) {
-      lua_pop(L, 3);
-      // stack = [..]
-      return 0;
+static void out_bytes(const char *s, size_t len) {
+  if (is_quiet) return;
+  if (is_rendering && options.max_bytes) {
+    size_t used = render_bytes + (is_capturing ? capture_len : 0);
+    size_t max  = (size_t)options.max_bytes;
+    if (used + len > max) {
+      len = (used < max) ? max - used : 0;
+      if (!render_cut) render_cut = "byte";
     }
-    lua_pop(L, 2);
-      // stack = [.., key]
-    keynum++;
   }
-      // stack = [..]
-  return 1;
+  if (is_capturing) {
+    grow_capture(len);
+    if (capture_len + len < capture_size) {
+      memcpy(capture + capture_len, s, len);
+      capture_len += len;
+    }
+  } else {
+    fwrite(s, 1, len, output ? output : stdout);
+    if (is_rendering) render_bytes += len;
+  }
 }
 
-static void print_seq(lua_State *L, int i) {
-  printf("{");
-
-  int k;
-  for (k = 1;; ++k) {
-        // stack = [..]
-    lua_rawgeti(L, i, k);
-        // stack = [.., t[k]]
-    if (lua_isnil(L, -1)) break;
-    if (k > 1) printf(", ");
-    print_item(L, -1, 0);  // 0 --> as_key
-    lua_pop(L, 1);
-        // stack = [..]
+static void out(const char *fmt, ...) {
+  char text[256];
+  va_list args, args_copy;
+  va_start(args, fmt);
+  va_copy(args_copy, args);
+  int len = vsnprintf(text, sizeof(text), fmt, args);
+  if (len >= (int)sizeof(text)) {
+    char *long_text = (char *)malloc(len + 1);
+    if (long_text) {
+      vsnprintf(long_text, len + 1, fmt, args_copy);
+      out_bytes(long_text, len);
+      free(long_text);
+    }
+  } else if (len > 0) {
+    out_bytes(text, len);
   }
-        // stack = [.., nil]
-  lua_pop(L, 1);
-        // stack = [..]
-
-  printf("}");
+  va_end(args_copy);
+  va_end(args);
 }
 
-static void print_table(lua_State *L, int i) {
-  // Ensure i is an absolute index as we'll be pushing/popping things after it.
-  if (i < 0) i = lua_gettop(L) + i + 1;
+// ## Memory accounting.
 
-  const char *prefix = "{";
-  if (is_seq(L, i)) {
-    print_seq(L, i);  // This case includes all empty tables.
+static void go_over_budget(const char *msg, lua_Number limit);
+static void run_hook(lua_State *L, lua_Debug *hook_ar);
+
+// Code with a memory budget is limited in what it adds to the host's live
+// bytes, but the allocator can't tell live bytes from garbage, and can't
+// collect garbage itself. So counting_alloc only refuses a request that
+// wouldn't fit even if everything allocated since the last full collection
+// were garbage. Once the bytes added, garbage included, pass the budget, it
+// has run_hook make a full collection at the next instruction and raise an
+// error if what's left is still over. Lua turns a refusal into a "not enough
+// memory" error, which stop_running then rewords.
+static void *counting_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+  AllocStats *stats = (AllocStats *)ud;
+  // When ptr is NULL, Lua 5.2+ passes a type tag in osize, not a size.
+  size_t old_size = (ptr ? osize : 0);
+  int is_budgeted = (run.is_running && run.max_bytes && nsize > old_size &&
+                     current_state == run.state);
+  if (is_budgeted &&
+      run.known_live + (double)(nsize - old_size) > (double)run.max_bytes) {
+    run.bytes_refused = 1;
+    go_over_budget("memory budget of %f bytes exceeded",
+                   (lua_Number)run.max_bytes);
+    return NULL;
+  }
+  void *new_ptr = stats->f(stats->ud, ptr, osize, nsize);
+  if (nsize > 0 && new_ptr == NULL) return NULL;  // Failed; nothing changed.
+  if (nsize > old_size) {
+    stats->total.allocated += nsize - old_size;
   } else {
-        // stack = [..]
-    lua_pushnil(L);
-        // stack = [.., nil]
-    while (lua_next(L, i)) {
-      printf("%s", prefix);
-        // stack = [.., key, value]
-      print_item(L, -2, 1);  // 1 --> as_key
-      printf(" = ");
-      print_item(L, -1, 0);  // 0 --> as_key
-      lua_pop(L, 1);  // So the last-used key is on top.
-        // stack = [.., key]
-      prefix = ", ";
-    }
-        // stack = [..]
-    printf("}");
+    stats->total.freed += old_size - nsize;
+  }
+  if (ptr == NULL && nsize > 0) stats->total.allocs++;
+  if (ptr != NULL && nsize == 0) stats->total.frees++;
+  if (is_budgeted && !run.gc_due &&
+      (double)(stats->total.allocated - stats->total.freed) - run.live_base -
+      run.excluded > (double)run.max_bytes) {
+    run.gc_due = 1;
+    lua_sethook(run.thread, run_hook, LUA_MASKCOUNT, 1);
+    run.is_hooked = 1;
   }
+  return new_ptr;
 }
 
-static char *get_fn_string(lua_State *L, int i) {
-  static char fn_name[1024];
+static int restore_alloc(lua_State *L) {
+  AllocStats *stats = (AllocStats *)lua_touserdata(L, 1);
+  void *ud;
+  if (lua_getallocf(L, &ud) == counting_alloc && ud == stats) {
+    lua_setallocf(L, stats->f, stats->ud);
+  }
+  return 0;
+}
 
-  // Ensure i is an absolute index as we'll be pushing/popping things after it.
-  if (i < 0) i = lua_gettop(L) + i + 1;
+// This installs counting_alloc on the host state, unless it's already there.
+static void install_alloc(lua_State *L) {
+      // stack = [..]
+  lua_getfield(L, LUA_REGISTRYINDEX, alloc_stats_key);
+      // stack = [.., stats | nil]
+  int is_installed = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+      // stack = [..]
+  if (is_installed) return;
 
-  // Check to see if the function has a global name.
+  AllocStats *stats = (AllocStats *)lua_newuserdata(L, sizeof(AllocStats));
+      // stack = [.., stats]
+  memset(stats, 0, sizeof(AllocStats));
+  stats->f = lua_getallocf(L, &stats->ud);
+  lua_newtable(L);
+      // stack = [.., stats, mt]
+  lua_pushcfunction(L, restore_alloc);
+  lua_setfield(L, -2, "__gc");
+  lua_setmetatable(L, -2);
+      // stack = [.., stats]
+  lua_setfield(L, LUA_REGISTRYINDEX, alloc_stats_key);
       // stack = [..]
-  lua_getglobal(L, "_G");
-      // stack = [.., _G]
-  lua_pushnil(L);
-      // stack = [.., _G, nil]
-  while (lua_next(L, -2)) {
-      // stack = [.., _G, key, value]
-    if (lua_rawequal(L, i, -1)) {
-      snprintf(fn_name, 1024, "function:%s", lua_tostring(L, -2));
-      lua_pop(L, 3);
+  lua_setallocf(L, counting_alloc, stats);
+}
+
+// Stock Lua has no hook for when the collector runs, so we count completed
+// cycles with a sentinel: an unreferenced userdata whose finalizer counts a
+// cycle and leaves a new sentinel behind for the next one.
+static void arm_gc_sentinel(lua_State *L) {
       // stack = [..]
-      return fn_name;
-    }
-      // stack = [.., _G, key, value]
-    lua_pop(L, 1);
-      // stack = [.., _G, key]
-  }
-  // If we get here, the function didn't have a global name; print a pointer.
-      // stack = [.., _G]
+  lua_newuserdata(L, 1);
+      // stack = [.., sentinel]
+  luaL_getmetatable(L, gc_sentinel_metatable);
+      // stack = [.., sentinel, mt]
+  lua_setmetatable(L, -2);
   lua_pop(L, 1);
       // stack = [..]
-  snprintf(fn_name, 1024, "function:%p", lua_topointer(L, i));
-  return fn_name;
 }
 
-static void print_item(lua_State *L, int i, int as_key) {
-  int ltype = lua_type(L, i);
-  // Set up first, last and start and end delimiters.
-  const char *first = (as_key ? "[" : "");
-  const char *last  = (as_key ? "]" : "");
-  switch(ltype) {
+static int on_gc_cycle(lua_State *L) {
+  gc_cycles++;
+  arm_gc_sentinel(L);
+  return 0;
+}
 
-    case LUA_TNIL:
-      printf("nil");  // This can't be a key, so we can ignore as_key here.
-      return;
+// This reads the host state's running totals into *out.
+static void read_mem_stats(lua_State *L, MemStats *out) {
+  void *ud;
+  if (lua_getallocf(L, &ud) == counting_alloc) {
+    *out = ((AllocStats *)ud)->total;
+    out->gc_cycles      = gc_cycles;
+    out->lua_gc_seconds = lua_gc_seconds;
+    return;
+  }
+  size_t now = (size_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024 +
+               (size_t)lua_gc(L, LUA_GCCOUNTB, 0);
+  if (now > gc_count_last) {
+    gc_count_stats.allocated += now - gc_count_last;
+  } else {
+    gc_count_stats.freed += gc_count_last - now;
+  }
+  gc_count_last = now;
+  *out = gc_count_stats;
+  out->gc_cycles      = gc_cycles;
+  out->lua_gc_seconds = lua_gc_seconds;
+}
 
-    case LUA_TNUMBER:
-      printf("%s%g%s", first, lua_tonumber(L, i), last);
-      return;
+static void add_mem_stats(MemStats *sum, MemStats *delta) {
+  sum->allocated += delta->allocated;
+  sum->freed     += delta->freed;
+  sum->allocs    += delta->allocs;
+  sum->frees     += delta->frees;
+  sum->gc_cycles      += delta->gc_cycles;
+  sum->lua_gc_seconds += delta->lua_gc_seconds;
+}
 
-    case LUA_TBOOLEAN:
-      printf("%s%s%s", first, lua_toboolean(L, i) ? "true" : "false", last);
-      return;
+// A call is measured from the end of load_state up to when its stack is
+// printed or saved, so that the demo's own bookkeeping isn't counted.
 
-    case LUA_TSTRING:
-      {
-        const char *s = lua_tostring(L, i);
-        if (is_identifier(s) && as_key) {
-          printf("%s", s);
-        } else {
-          printf("%s'%s'%s", first, s, last);
-        }
-      }
-      return;
+static void start_measuring(lua_State *L) {
+  read_mem_stats(L, &call_start);
+  is_measuring = 1;
+}
 
-    case LUA_TTABLE:
-      printf("%s", first);
-      print_table(L, i);
-      printf("%s", last);
-      return;
+static void stop_measuring(lua_State *L) {
+  if (!is_measuring) return;
+  is_measuring = 0;
+  MemStats now, *delta = &current_state->last_call;
+  read_mem_stats(L, &now);
+  delta->allocated = now.allocated - call_start.allocated;
+  delta->freed     = now.freed     - call_start.freed;
+  delta->allocs    = now.allocs    - call_start.allocs;
+  delta->frees     = now.frees     - call_start.frees;
+  delta->gc_cycles      = now.gc_cycles      - call_start.gc_cycles;
+  delta->lua_gc_seconds = now.lua_gc_seconds - call_start.lua_gc_seconds;
+  add_mem_stats(&current_state->mem, delta);
+}
 
-    case LUA_TFUNCTION:
-      printf("%s%s%s", first, get_fn_string(L, i), last);
-      return;
+// This prints, for example, " [mem +48B -0B 1 alloc 0 frees; owns 96B/2]".
+static void print_mem_stats(FakeLuaState *demo_state) {
+  MemStats *last = &demo_state->last_call, *mem = &demo_state->mem;
+  out("  [mem +%luB -%luB %lu alloc%s %lu free%s; owns %ldB/%ld]",
+      (unsigned long)last->allocated, (unsigned long)last->freed,
+      (unsigned long)last->allocs, last->allocs == 1 ? "" : "s",
+      (unsigned long)last->frees,  last->frees  == 1 ? "" : "s",
+      (long)(mem->allocated - mem->freed), (long)(mem->allocs - mem->frees));
+}
 
-    case LUA_TUSERDATA:
-    case LUA_TLIGHTUSERDATA:
-      printf("%suserdata:", first);
-      break;
+// This prints, for example, " [gc 1 cycle ended; 12.5KB freed; lua_gc
+// 0.250ms]". The bytes are everything freed during the call, by the collector
+// or not, and the time is only what calls to lua_gc took, as stock Lua has no
+// hook that could time the collector's incremental steps.
+static void print_gc_stats(FakeLuaState *demo_state) {
+  MemStats *last = &demo_state->last_call;
+  out("  [gc %lu cycle%s ended; %.1fKB freed; lua_gc %.3fms]",
+      (unsigned long)last->gc_cycles, last->gc_cycles == 1 ? "" : "s",
+      last->freed / 1024.0, last->lua_gc_seconds * 1000);
+}
 
-    case LUA_TTHREAD:
-      printf("%sthread:", first);
-      break;
+// ## Table internals.
 
-    default:
-      printf("<internal_error_in_print_stack_item!>");
-      return;
-  }
+// Lua's C API doesn't say how a table is laid out. With Lua 5.1, apidemo reads
+// the array and hash part sizes from Lua's own Table struct, in the copy of
+// lobject.h in lua_src. That struct is private, and other Lua versions and
+// LuaJIT lay tables out differently, so luaopen_apidemo first checks that
+// tables it makes read back with the sizes it asked for; see
+// check_table_layout. Everywhere else, the sizes are estimated.
+//
+// Raw table writes allocate memory only when they rehash the table, so a write
+// that makes the host allocate is counted as a rehash. To estimate, a rehash
+// resizes both parts to fit the keys the table holds at that point, using the
+// rule in compute_array_size, which is Lua's own computesizes.
+//
+// Sizes are kept as {array_size, hash_size, rehashes} in a weak-keyed table in
+// the registry. When they're estimated, a table apidemo hasn't tracked from
+// its creation gets sizes guessed as if it had just been rehashed, as do all
+// tables when rehashes can't be seen because counting_alloc isn't installed.
+// Tables filled by Lua code may differ from such guesses: keys added out of
+// order can leave integer keys in the hash part that a rehash would move.
 
-  // If we reach here, then we've got a type that we print as a pointer.
-  printf("%p%s", lua_topointer(L, i), last);
-}
+// Lua won't put keys larger than this in the array part.
+#define max_array_size (1 << 26)
 
-static void print_stack(lua_State *L, int omit) {
-  int n = lua_gettop(L) - omit;
-  printf("stack:");
-  int i;
-  for (i = 1; i <= n; ++i) {
-    printf(" ");
-    print_item(L, i, 0);  // 0 --> as_key
-  }
-  if (n == 0) printf(" <empty>");
-  printf("\n");
+// This returns the smallest k with 2^k >= x, for x > 0.
+static int ceil_log2(unsigned int x) {
+  int k = 0;
+  while ((1u << k) < x) ++k;
+  return k;
 }
 
+// This returns k if stack[i] is an integer key k that can go in the array
+// part, or 0 otherwise.
+static int array_key(lua_State *L, int i) {
+  if (lua_type(L, i) != LUA_TNUMBER) return 0;
+  lua_Number n = lua_tonumber(L, i);
+  int k = (int)n;
+  return (k == n && k >= 1 && k <= max_array_size) ? k : 0;
+}
 
-// ## Functions for loading and saving demo Lua states.
-
-// This loads the states table onto the top of the stack.
-// It creates the table and sets it in the registry if it doesn't exist yet.
-static void load_states_table(lua_State *L) {
-  // The states table is stored in the registry with key states_table_key.
-  // The registory is a table located at the pseudo-index LUA_REGISTRYINDEX.
+// This counts the keys of the table at stack[t]. nums[i] is set to the number
+// of integer keys k with 2^(i-1) < k <= 2^i.
+static void count_keys(lua_State *L, int t, int nums[], int *num_int,
+                       int *num_keys) {
+  memset(nums, 0, (ceil_log2(max_array_size) + 1) * sizeof(int));
+  *num_int = *num_keys = 0;
       // stack = [..]
-  lua_getfield(L, LUA_REGISTRYINDEX, states_table_key);
-      // stack = [.., states_table | nil]
-  if (lua_isnil(L, -1)) {  // The table doesn't exist yet, so let's create it.
-      // stack = [.., nil]
+  lua_pushnil(L);
+  while (lua_next(L, t)) {
+      // stack = [.., key, value]
+    int k = array_key(L, -2);
+    if (k) {
+      nums[ceil_log2(k)]++;
+      (*num_int)++;
+    }
+    (*num_keys)++;
     lua_pop(L, 1);
-      // stack = [..]
-    lua_newtable(L);
-      // stack = [.., states_table = {}]
-    lua_pushvalue(L, -1);
-      // stack = [.., states_table, states_table]
-    lua_setfield(L, LUA_REGISTRYINDEX, states_table_key);
   }
-      // stack = [.., states_table]
+      // stack = [..]
 }
 
-static void load_state(lua_State *L, FakeLuaState *demo_state) {
+// This returns the array size that a rehash would choose: the largest power of
+// two n such that more than half of the slots 1..n would be in use.
+static int compute_array_size(int nums[], int num_int) {
+  int i, two_to_i, a = 0, n = 0;
+  for (i = 0, two_to_i = 1; two_to_i / 2 < num_int; ++i, two_to_i *= 2) {
+    a += nums[i];
+    if (a > two_to_i / 2) n = two_to_i;
+    if (a == num_int) break;
+  }
+  return n;
+}
 
-  // We expect every load_state to be paired by a following save_state call.
-  // If that expectation is not met, this assert may be triggered.
-  assert(current_state == NULL);
+// This sets the sizes a rehash of the table at stack[t] would choose.
+static void rehash_sizes(lua_State *L, int t, TableShape *shape) {
+  int nums[32], num_int, num_keys;
+  count_keys(L, t, nums, &num_int, &num_keys);
+  shape->array_size = compute_array_size(nums, num_int);
+  int num_in_array = 0, i;
+  for (i = 0; (1 << i) <= shape->array_size; ++i) num_in_array += nums[i];
+  int num_in_hash = num_keys - num_in_array;
+  shape->hash_size = num_in_hash ? 1 << ceil_log2(num_in_hash) : 0;
+}
 
-  // Clear the stack and load the states table.
-  lua_settop(L, 0);
-      // stack = []
-  load_states_table(L);
-      // stack = [states_table]
+// This returns stack[i]'s index counted from the bottom, so that it stays valid
+// when a write pops values above it.
+static int abs_index(lua_State *L, int i) {
+  return (i < 0 && i > LUA_REGISTRYINDEX) ? lua_gettop(L) + i + 1 : i;
+}
 
-  // Load the table for this demo_state.
-  lua_rawgeti(L, 1, demo_state->ref);
-      // stack = [states_table, demo_state_data]
-  lua_remove(L, 1);
-      // stack = [demo_state_data]
+// This makes the table on top of the stack hold its keys weakly.
+static void make_weak_keyed(lua_State *L) {
+      // stack = [.., t]
+  lua_newtable(L);
+  lua_pushliteral(L, "k");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+      // stack = [.., t]
+}
 
-  // Load the state.
-  lua_getfield(L, 1, "num_items");
-      // stack = [demo_state_data, num_items]
-  assert(lua_isnumber(L, 2));
-  int num_items = lua_tointeger(L, 2);
-  lua_pop(L, 1);
-  int k;
-  for (k = 1; k <= num_items; ++k) {
-      // stack = [demo_state_data, <first k-1 items of saved stack>]
-    lua_rawgeti(L, 1, k);
-      // stack = [demo_state_data, <first k-1 items of saved stack>, item[k]]
+// This pushes the weak-keyed table stored in the registry at key, creating it
+// if needed.
+static void push_weak_table(lua_State *L, const char *key) {
+      // stack = [..]
+  lua_getfield(L, LUA_REGISTRYINDEX, key);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+        // stack = [.., weak_table]
+    make_weak_keyed(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, key);
   }
-      // stack = [demo_state_data, <loaded state>]
-  lua_remove(L, 1);
-      // stack = [<loaded state>]
+      // stack = [.., weak_table]
+}
 
-  // Set the current_state for later use.
-  current_state = demo_state;
+// This returns true if the table at stack[t] was made by a demo call.
+static int is_demo_table(lua_State *L, int t) {
+  t = abs_index(L, t);
+      // stack = [..]
+  push_weak_table(L, demo_tables_key);
+  lua_pushvalue(L, t);
+  lua_rawget(L, -2);
+  int is_demo = lua_toboolean(L, -1);
+  lua_pop(L, 2);
+      // stack = [..]
+  return is_demo;
 }
 
-// This function uses the global current_state as a save location.
-// This can work because Lua is single threaded.
-static void save_state(lua_State *L, int omit) {
+// This records the sizes and rehash count of the table at stack[t].
+static void save_shape(lua_State *L, int t, TableShape *shape) {
+  t = abs_index(L, t);
+      // stack = [..]
+  push_weak_table(L, table_shapes_key);
+  lua_pushvalue(L, t);
+  lua_createtable(L, 3, 0);
+      // stack = [.., shapes, t, {array_size, hash_size, rehashes}]
+  lua_pushinteger(L, shape->array_size);
+  lua_rawseti(L, -2, 1);
+  lua_pushinteger(L, shape->hash_size);
+  lua_rawseti(L, -2, 2);
+  lua_pushinteger(L, shape->rehashes);
+  lua_rawseti(L, -2, 3);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+      // stack = [..]
+}
 
-  // Load the states table.
-      // stack = [<state_to_save>]
-  load_states_table(L);
-      // stack = [<state_to_save>, states_table]
+#if LUA_VERSION_NUM == 501
 
-  // Load the table for this demo_state (in current_state).
-  lua_rawgeti(L, -1, current_state->ref);
-      // stack = [<state_to_save>, states_table, demo_state_data]
-  lua_remove(L, -2);
-      // stack = [<state_to_save>, demo_state_data]
+// Whether Table structs can be read, and the node array that tables with an
+// empty hash part all share. Both are set by check_table_layout.
+static per_thread int         is_table_layout_known;
+static per_thread const Node *empty_node;
 
-  // Save num_items using the key "num_items".
-  int num_items = lua_gettop(L) - 1 - omit;
-  assert(num_items + omit >= 0);
-  if (num_items < 0) num_items = 0;  // The omit value may have been high.
-  lua_pushnumber(L, num_items);
-      // stack = [<state_to_save>, demo_state_data, num_items]
-  lua_setfield(L, -2, "num_items");
-      // stack = [<state_to_save>, demo_state_data]
+// This reads the sizes of the table at stack[t] into *shape, and returns 1, or
+// returns 0 if the host's tables can't be read.
+static int read_table_sizes(lua_State *L, int t, TableShape *shape) {
+  if (!is_table_layout_known) return 0;
+  const Table *table = (const Table *)lua_topointer(L, t);
+  shape->array_size = table->sizearray;
+  shape->hash_size  = (table->node == empty_node) ? 0 : sizenode(table);
+  shape->is_exact   = 1;
+  return 1;
+}
 
-  // Set each item by int keys, counting up from 1.
-  int k;
-  for (k = 1; k <= num_items; ++k) {
-      // stack = [<state_to_save>, demo_state_data]
-    lua_pushvalue(L, k);
-      // stack = [<state_to_save>, demo_state_data, item[k]]
-    lua_rawseti(L, -2, k);
+// This sets is_table_layout_known if the host is Lua 5.1 rather than LuaJIT,
+// and tables made with known sizes read back with those sizes.
+static void check_table_layout(lua_State *L) {
+      // stack = [..]
+  is_table_layout_known = 0;
+  // LuaJIT has a jit module loaded from the start.
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+  int is_luajit = 0;
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "jit");
+    is_luajit = !lua_isnil(L, -1);
+    lua_pop(L, 1);
   }
-      // stack = [<state_to_save>, demo_state_data]
   lua_pop(L, 1);
-      // stack = [<state_to_save>]
-
-  // Clear current_state.
-  current_state = NULL;
+  if (is_luajit) return;
+  lua_createtable(L, 0, 0);
+  lua_createtable(L, 5, 3);
+      // stack = [.., empty, t]
+  const Table *empty = (const Table *)lua_topointer(L, -2);
+  const Table *table = (const Table *)lua_topointer(L, -1);
+  is_table_layout_known =
+      empty->sizearray == 0 && empty->lsizenode == 0 &&
+      table->sizearray == 5 && table->lsizenode == 2 &&
+      table->node != empty->node && table->metatable == NULL;
+  empty_node = empty->node;
+  lua_pop(L, 2);
+      // stack = [..]
 }
 
-// ## Functions that simulate the C API.
+#else
 
-static int demo_luaL_newstate(lua_State *L) {
-      // stack = []
-  FakeLuaState *demo_state =
-      (FakeLuaState *)lua_newuserdata(L, sizeof(FakeLuaState));
-      // stack = [demo_L]
-  luaL_getmetatable(L, demo_state_metatable);
-      // stack = [demo_L, mt]
-  lua_setmetatable(L, 1);
-      // stack = [demo_L]
-  load_states_table(L);
-      // stack = [demo_L, states_table]
-  lua_newtable(L);
-      // stack = [demo_L, states_table, demo_state_data = {}]
-  lua_pushnumber(L, 0);
-      // stack = [demo_L, states_table, demo_state_data, 0]
-  lua_setfield(L, 3, "num_items");  // TODO Drop magic string.
-      // stack = [demo_L, states_table, demo_state_data]
-  demo_state->ref = luaL_ref(L, 2);  // Set states_table[ref] = demo_state_data.
-      // stack = [demo_L, states_table]
-  lua_pop(L, 1);
-      // stack = [demo_L]
-  return 1;  // Number of values to return that are on the stack.
+static int read_table_sizes(lua_State *L, int t, TableShape *shape) {
+  (void)L;
+  (void)t;
+  (void)shape;
+  return 0;
 }
 
-// ### Macros to work with luaL_checkint and luaL_optint in Lua 5.3.
+static void check_table_layout(lua_State *L) {
+  (void)L;
+}
 
-#if LUA_VERSION_NUM == 503
-#define luaL_checkint(L, arg) (int)(luaL_checkinteger(L, arg))
-#define luaL_optint(L, arg, d) (int)(luaL_optinteger(L, arg, d))
 #endif
 
-// ### Macros that make it easy to wrap Lua C API functions.
+// This fills in *shape for the table at stack[t]: its sizes as read from the
+// table, or else as estimated.
+static void measure_table(lua_State *L, int t, TableShape *shape) {
+  t = abs_index(L, t);
+  memset(shape, 0, sizeof(TableShape));
+      // stack = [..]
+  push_weak_table(L, table_shapes_key);
+  lua_pushvalue(L, t);
+  lua_rawget(L, -2);
+      // stack = [.., shapes, sizes | nil]
+  int is_tracked = lua_istable(L, -1);
+  if (is_tracked) {
+    int *fields[] = {&shape->array_size, &shape->hash_size, &shape->rehashes};
+    int k;
+    for (k = 0; k < 3; ++k) {
+      lua_rawgeti(L, -1, k + 1);
+      *fields[k] = lua_tointeger(L, -1);
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 2);
+      // stack = [..]
+  if (!read_table_sizes(L, t, shape)) {
+    if (!is_tracked) rehash_sizes(L, t, shape);
+    void *ud;
+    if (!is_tracked || lua_getallocf(L, &ud) != counting_alloc) {
+      shape->is_estimated = 1;
+    }
+  }
 
-// A typical wrapper function will look something like this pseudocode:
-//
-// static int demo_lua_dosomething(lua_State *L) {
-//  FakeLuaState *demo_state =
-//      (FakeLuaState *)luaL_checkudata(L, 1, demo_state_metatable);
-//  intype1 arg1 = luaL_checktype1(L, 2);
-//  intype2 arg2 = luaL_checktype2(L, 3);
-//  load_state(L, demo_state);
-//  outtype out = lua_dosomething(L, arg1, arg2);
-//  print_stack(L, 0);  // 0 --> omit 0 tail values
-//  save_stack(L, 0);   // 0 --> omit 0 tail values
-//  lua_pushouttype(L, out);
-//  return 1;
-// }
-//
-// In more natural language, the process works like this:
-// 1. Extract inputs from L.
-// 2. Load demo Lua state.
-// 3. Run the API function.
-// 4. Print the stack.
-// 5. Save the demo Lua state.
-// 6. Return any output values.
-//
-// Most of that code is identical for most API functions. The major differences
-// are the types and numbers of the inputs and outputs. The macros below help
-// simplify the creation of these wrapper functions. As an example, the API
-// functions lua_pushstring can be wrapped with this simple macro call:
-//
-// fn_string_in(lua_pushstring);
-//
-// In general, the final macros take the format:
-//
-// fn_<intype1>_<intype2>_in[_<outtype>_out] (lua_fn_name);
-//
+  lua_pushnil(L);
+  while (lua_next(L, t)) {
+      // stack = [.., key, value]
+    int k = array_key(L, -2);
+    if (k == 0 || k > shape->array_size) {
+      shape->hash_used++;
+      if (k) shape->int_keys_in_hash++;
+    }
+    lua_pop(L, 1);
+  }
+      // stack = [..]
+}
 
-#define fn_start(lua_fn_name)                                             \
-  static int demo_ ## lua_fn_name(lua_State *L) {                         \
-    FakeLuaState *demo_state =                                            \
-        (FakeLuaState *)luaL_checkudata(L, 1, demo_state_metatable);
+// This returns the number of bytes the host state has allocated so far.
+static size_t bytes_allocated(lua_State *L) {
+  MemStats stats;
+  read_mem_stats(L, &stats);
+  return stats.allocated;
+}
 
-#define fn_end                        \
-    print_stack(L, 0);                \
-    save_state(L, 0);                 \
-    return 0;                         \
+// This is called when the call on current_state may have run Lua code, which
+// can change any table without note_table_write seeing it.
+static void note_code_may_run(void) {
+  untracked_epoch++;
+  if (current_state) current_state->code_runs++;
+}
+
+// This is called after a write to the table at stack[t]. If the write made the
+// host allocate memory, it was a rehash, and the table's sizes are updated. A
+// non-raw write to a table with a metatable may have run a metamethod, so its
+// allocations aren't taken as a rehash.
+static void note_table_write(lua_State *L, int t, size_t allocated_before,
+                             int is_raw) {
+  stop_measuring(L);  // Keep our bookkeeping out of the call's memory use.
+  if (t > lua_gettop(L) || !lua_istable(L, t)) return;
+  int has_mt = !is_raw && lua_getmetatable(L, t);
+  if (has_mt) lua_pop(L, 1);
+  if (has_mt) note_code_may_run();  // A metamethod may have written anywhere.
+  // This comes before the bookkeeping below, which allocates too.
+  did_rehash = (!has_mt && bytes_allocated(L) > allocated_before);
+      // stack = [..]
+  push_weak_table(L, table_versions_key);
+  lua_pushvalue(L, t);
+  lua_pushnumber(L, (lua_Number)++table_writes);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+      // stack = [..]
+  if (did_rehash) {
+    TableShape shape;
+    measure_table(L, t, &shape);
+    if (!shape.is_exact) rehash_sizes(L, t, &shape);
+    shape.rehashes++;
+    save_shape(L, t, &shape);
+    has_lint_rehash = options.lint && is_demo_table(L, t);
+    lint_rehash = shape;
+  }
+  if (options.show_tables) {
+    measure_table(L, t, &table_write);
+    has_table_write = 1;
   }
+}
 
-#define fn_end_number_out             \
-    print_stack(L, 0);                \
-    save_state(L, 0);                 \
-    lua_pushnumber(L, out1);          \
-    return 1;                         \
+// This is called before a read from the value at stack[i] that isn't raw. If
+// the value has a metatable, an __index metamethod may run Lua code that
+// changes any table.
+static void note_table_read(lua_State *L, int i) {
+  if (lua_getmetatable(L, i)) {
+    lua_pop(L, 1);
+    note_code_may_run();
   }
+}
 
-#define fn_end_string_out             \
-    print_stack(L, 0);                \
-    save_state(L, 0);                 \
-    if (out1) {                       \
-      lua_pushstring(L, out1);        \
-    } else {                          \
-      lua_pushnumber(L, 0);           \
-    }                                 \
-    return 1;                         \
+// This starts tracking the new table on top of the stack, made with room for
+// narr array items and nrec other keys.
+static void track_new_table(lua_State *L, int narr, int nrec) {
+  stop_measuring(L);
+  TableShape shape;
+  memset(&shape, 0, sizeof(TableShape));
+  shape.array_size = (narr > 0) ? narr : 0;
+  shape.hash_size  = (nrec > 0) ? 1 << ceil_log2(nrec) : 0;
+  save_shape(L, -1, &shape);
+      // stack = [.., t]
+  push_weak_table(L, demo_tables_key);
+  lua_pushvalue(L, -2);
+  lua_pushboolean(L, 1);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+      // stack = [.., t]
+  did_rehash = 0;
+  if (options.show_tables) {
+    measure_table(L, -1, &table_write);
+    has_table_write = 1;
   }
+}
 
-#define fn_end_0_arg(lua_fn_name)     \
-    load_state(L, demo_state);        \
-    lua_fn_name(L);                   \
-    fn_end
+// This prints, for example, "  [table array 4, hash 1/2; rehash #3]". Sizes
+// that weren't read from the table are marked "est.", and those that are only
+// a guess, as explained at measure_table, also have a "~".
+static void print_table_write(void) {
+  TableShape *shape = &table_write;
+  const char *approx = shape->is_estimated ? "~" : "";
+  out("  [%stable array %s%d, hash %d/%s%d", shape->is_exact ? "" : "est. ",
+      approx, shape->array_size, shape->hash_used, approx, shape->hash_size);
+  if (shape->int_keys_in_hash) {
+    out(", %d int key%s in hash", shape->int_keys_in_hash,
+        shape->int_keys_in_hash == 1 ? "" : "s");
+  }
+  if (did_rehash) out("; rehash #%d", shape->rehashes);
+  out("]");
+  has_table_write = 0;
+}
 
-#define fn_end_1_arg(lua_fn_name)     \
-    load_state(L, demo_state);        \
-    lua_fn_name(L, arg1);             \
-    fn_end
 
-#define fn_end_2_arg(lua_fn_name)     \
-    load_state(L, demo_state);        \
-    lua_fn_name(L, arg1, arg2);       \
-    fn_end
+// ## Functions used to print the stack.
 
-#define fn_end_1_arg_1_out(lua_fn_name)     \
-    load_state(L, demo_state);              \
-    int out1 = lua_fn_name(L, arg1);        \
-    fn_end_number_out
+static void print_item(lua_State *L, int i, int as_key);
+static void print_saved_stack(lua_State *L, FakeLuaState *demo_state);
+static void load_states_table(lua_State *L);
+static void push_data_table(lua_State *L, int data, const char *name);
+static void push_weak_data_table(lua_State *L, int data, const char *name);
+static int  count_unchanged(lua_State *L, int data, int n);
+static uint64_t hash_one_value(lua_State *L, int i, int reached, int slot);
+static void lint_call(lua_State *L, int n);
+static TypedArray *to_array(lua_State *L, int i);
+static double wall_seconds(void);
 
-#define fn_end_2_arg_1_out(lua_fn_name)     \
-    load_state(L, demo_state);              \
-    int out1 = lua_fn_name(L, arg1, arg2);  \
-    fn_end_number_out
+// ### Rendering budgets.
 
-#define fn_end_1_arg_double_out(lua_fn_name)    \
-    load_state(L, demo_state);                  \
-    double out1 = lua_fn_name(L, arg1);         \
-    fn_end_number_out
+// This starts the budgets in options for printing a stack.
+static void begin_render(void) {
+  is_rendering = 1;
+  render_bytes = 0;
+  render_items  = 0;
+  render_checks = 0;
+  render_start  = wall_seconds();
+  render_cut   = NULL;
+}
 
-#define fn_end_1_arg_str_out(lua_fn_name)       \
-    load_state(L, demo_state);                  \
-    const char *out1 = lua_fn_name(L, arg1);    \
-    fn_end_string_out
+// This returns true once any budget has run out, after which printing stops.
+static int is_over_budget(void) {
+  if (!is_rendering || render_cut) return render_cut != NULL;
+  if (options.max_items && render_items >= options.max_items) {
+    render_cut = "item";
+  } else if (options.max_seconds > 0 &&
+             ++render_checks % render_clock_period == 0 &&
+             wall_seconds() - render_start > options.max_seconds) {
+    render_cut = "time";
+  }
+  return render_cut != NULL;
+}
 
-#define fn_end_0_arg_1_out(lua_fn_name)     \
-    load_state(L, demo_state);              \
-    int out1 = lua_fn_name(L);              \
-    fn_end_number_out
+// This ends the budgets, and marks where printing stopped if one ran out.
+static void end_render(void) {
+  is_rendering = 0;
+  if (render_cut) out(" \xe2\x80\xa6 (%s limit)", render_cut);  // "…".
+}
 
-#define fn_nothing_in(lua_fn_name)       \
-    fn_start(lua_fn_name);               \
-    fn_end_0_arg(lua_fn_name)
+// This prints n with commas between groups of three digits, as in 9,940.
+static void print_count(int n) {
+  if (n >= 1000) {
+    print_count(n / 1000);
+    out(",%03d", n % 1000);
+  } else {
+    out("%d", n);
+  }
+}
 
-#define fn_nothing_in_int_out(lua_fn_name)     \
-    fn_start(lua_fn_name);                     \
-    fn_end_0_arg_1_out(lua_fn_name)
+// ### Printing items.
 
-#define fn_int_in(lua_fn_name)       \
-    fn_start(lua_fn_name);           \
-    int arg1 = luaL_checkint(L, 2);  \
-    fn_end_1_arg(lua_fn_name)
+static int is_identifier(const char *s) {
+  while (*s) {
+    if (!isalnum(*s) && *s != '_') return 0;
+    ++s;
+  }
+  return 1;
+}
 
-#define fn_string_in(lua_fn_name)                \
-    fn_start(lua_fn_name);                       \
-    const char *arg1 = luaL_checkstring(L, 2);   \
+// This returns whether the table at stack[i] holds only the keys 1..n. With
+// options.max_width set, only as many entries are looked at as can be printed,
+// plus one, since print_seq stops there anyway.
+static int is_seq(lua_State *L, int i) {
+      // stack = [..]
+  lua_pushnil(L);
+      // stack = [.., nil]
+  int keynum = 1;
+  while (lua_next(L, i)) {
+      // stack = [.., key, value]
+    lua_rawgeti(L, i, keynum);
+      // stack = [.., key, value, t[keynum]]
+    if (lua_isnil(L, -1) || is_over_budget()) {
+      lua_pop(L, 3);
+      // stack = [..]
+      return 0;
+    }
+    lua_pop(L, 2);
+      // stack = [.., key]
+    keynum++;
+    if (options.max_width && keynum > options.max_width + 1) {
+      lua_pop(L, 1);
+      return 1;
+    }
+  }
+      // stack = [..]
+  return 1;
+}
+
+static void print_seq(lua_State *L, int i) {
+  out("{");
+
+  int k;
+  for (k = 1;; ++k) {
+        // stack = [..]
+    lua_rawgeti(L, i, k);
+        // stack = [.., t[k]]
+    if (lua_isnil(L, -1)) break;
+    if (k > 1) out(", ");
+    if (is_over_budget() || (options.max_width && k > options.max_width)) {
+      out("\xe2\x80\xa6");  // UTF-8 "…".
+      break;
+    }
+    print_item(L, -1, 0);  // 0 --> as_key
+    lua_pop(L, 1);
+        // stack = [..]
+  }
+        // stack = [.., nil]
+  lua_pop(L, 1);
+        // stack = [..]
+
+  out("}");
+}
+
+static void print_table(lua_State *L, int i) {
+  // Ensure i is an absolute index as we'll be pushing/popping things after it.
+  if (i < 0) i = lua_gettop(L) + i + 1;
+
+  // A table that contains itself, such as _G, is printed as a pointer the
+  // second time it's reached. So are tables nested too deeply to track, or
+  // too deeply for the stack to have room to print them.
+  static per_thread const void *open_tables[max_print_depth];
+  static per_thread int num_open;
+  const void *t = lua_topointer(L, i);
+  int k;
+  for (k = 0; k < num_open && open_tables[k] != t; ++k);
+  if (k < num_open || num_open == max_print_depth || !lua_checkstack(L, 4)) {
+    out("table:%p", t);
+    return;
+  }
+  if (options.max_depth && num_open >= options.max_depth) {
+    out("{\xe2\x80\xa6}");  // UTF-8 "{…}".
+    return;
+  }
+  open_tables[num_open++] = t;
+  if (is_capturing && is_cacheable) is_cacheable = is_demo_table(L, i);
+  if (is_capturing && is_cacheable && capture_tables) {
+    lua_pushvalue(L, i);
+    lua_rawseti(L, capture_tables, 5 + num_captured++);
+  }
+
+  const char *prefix = "{";
+  if (is_seq(L, i)) {
+    print_seq(L, i);  // This case includes all empty tables.
+  } else {
+        // stack = [..]
+    int num_printed = 0;
+    lua_pushnil(L);
+        // stack = [.., nil]
+    while (lua_next(L, i)) {
+        // stack = [.., key, value]
+      out("%s", prefix);
+      if (is_over_budget() ||
+          (options.max_width && num_printed++ == options.max_width)) {
+        out("\xe2\x80\xa6");  // UTF-8 "…".
+        lua_pop(L, 2);
+        break;
+      }
+      print_item(L, -2, 1);  // 1 --> as_key
+      out(" = ");
+      print_item(L, -1, 0);  // 0 --> as_key
+      lua_pop(L, 1);  // So the last-used key is on top.
+        // stack = [.., key]
+      prefix = ", ";
+    }
+        // stack = [..]
+    out("}");
+  }
+  num_open--;
+}
+
+static char *get_fn_string(lua_State *L, int i) {
+  static per_thread char fn_name[1024];
+
+  // Ensure i is an absolute index as we'll be pushing/popping things after it.
+  if (i < 0) i = lua_gettop(L) + i + 1;
+
+  // Check to see if the function has a global name.
+      // stack = [..]
+  lua_getglobal(L, "_G");
+      // stack = [.., _G]
+  lua_pushnil(L);
+      // stack = [.., _G, nil]
+  while (lua_next(L, -2)) {
+      // stack = [.., _G, key, value]
+    if (lua_rawequal(L, i, -1)) {
+      snprintf(fn_name, 1024, "function:%s", lua_tostring(L, -2));
+      lua_pop(L, 3);
+      // stack = [..]
+      return fn_name;
+    }
+      // stack = [.., _G, key, value]
+    lua_pop(L, 1);
+      // stack = [.., _G, key]
+  }
+  // If we get here, the function didn't have a global name; print a pointer.
+      // stack = [.., _G]
+  lua_pop(L, 1);
+      // stack = [..]
+  snprintf(fn_name, 1024, "function:%p", lua_topointer(L, i));
+  return fn_name;
+}
+
+static void print_array(TypedArray *array) {
+  static const char *kind_names[] = {"f64", "i32"};
+  out("%s[%lu]{", kind_names[array->kind], (unsigned long)array->len);
+  size_t k;
+  for (k = 0; k < array->len && k < array_preview_len; ++k) {
+    if (k > 0) out(",");
+    if (array->kind == array_f64) {
+      out("%g", ((double *)array->data)[k]);
+    } else {
+      out("%d", (int)((int32_t *)array->data)[k]);
+    }
+  }
+  if (array->len > array_preview_len) out(",\xe2\x80\xa6");  // UTF-8 "…".
+  out("}");
+}
+
+static void print_item(lua_State *L, int i, int as_key) {
+  if (is_rendering) render_items++;
+  int ltype = lua_type(L, i);
+  // Set up first, last and start and end delimiters.
+  const char *first = (as_key ? "[" : "");
+  const char *last  = (as_key ? "]" : "");
+  switch(ltype) {
+
+    case LUA_TNIL:
+      out("nil");  // This can't be a key, so we can ignore as_key here.
+      return;
+
+    case LUA_TNUMBER:
+      out("%s%g%s", first, lua_tonumber(L, i), last);
+      return;
+
+    case LUA_TBOOLEAN:
+      out("%s%s%s", first, lua_toboolean(L, i) ? "true" : "false", last);
+      return;
+
+    case LUA_TSTRING:
+      {
+        const char *s = lua_tostring(L, i);
+        if (is_identifier(s) && as_key) {
+          out("%s", s);
+        } else {
+          out("%s'%s'%s", first, s, last);
+        }
+      }
+      return;
+
+    case LUA_TTABLE:
+      out("%s", first);
+      print_table(L, i);
+      out("%s", last);
+      return;
+
+    case LUA_TFUNCTION:
+      is_cacheable = 0;  // Its name comes from _G, which may change.
+      out("%s%s%s", first, get_fn_string(L, i), last);
+      return;
+
+    case LUA_TUSERDATA:
+      {
+        TypedArray *array = to_array(L, i);
+        if (array) {
+          is_cacheable = 0;  // Lua code can change it directly.
+          out("%s", first);
+          print_array(array);
+          out("%s", last);
+          return;
+        }
+      }
+      // Fall through.
+    case LUA_TLIGHTUSERDATA:
+      out("%suserdata:", first);
+      break;
+
+    case LUA_TTHREAD:
+      out("%sthread:", first);
+      break;
+
+    default:
+      out("<internal_error_in_print_stack_item!>");
+      return;
+  }
+
+  // If we reach here, then we've got a type that we print as a pointer.
+  out("%p%s", lua_topointer(L, i), last);
+}
+
+// ### The render cache.
+
+// With options.cache_tables set, each demo state's data has a render_cache
+// table. Its entry for slot i of the stack is {table, text, epoch, writes,
+// <tables>}: the table last printed in that slot, the text printed for it, the
+// untracked_epoch and table_writes it was printed at, and every table its text
+// shows, itself included. The text is reused while no call has run code that
+// could change tables unseen, and none of those tables has been written to
+// since. Slots whose text can't be reused have no entry. Entry n is the number
+// of slots covered.
+//
+// Only tables made by demo calls, and holding no functions, arrays or other
+// tables not made by demo calls, are cached. Lua code run outside of demo
+// calls can still change them, which the cache can't see; that's why it's an
+// option. Other values are cheaper to print again than to look up.
+
+// This pushes the render cache of the demo state with the given ref.
+static void push_render_cache(lua_State *L, FakeLuaState *demo_state) {
+      // stack = [..]
+  load_states_table(L);
+  lua_rawgeti(L, -1, demo_state->ref);
+  lua_remove(L, -2);
+      // stack = [.., demo_state_data]
+  push_data_table(L, lua_gettop(L), "render_cache");
+  lua_remove(L, -2);
+      // stack = [.., render_cache]
+}
+
+// This drops the cache's entries for slots above n, so the values in them can
+// be collected, and pops the cache.
+static void pop_render_cache(lua_State *L, int cache, int n) {
+  lua_getfield(L, cache, "n");
+  int old_n = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  int k;
+  for (k = n + 1; k <= old_n; ++k) {
+    lua_pushnil(L);
+    lua_rawseti(L, cache, k);
+  }
+  if (old_n != n) {
+    lua_pushinteger(L, n);
+    lua_setfield(L, cache, "n");
+  }
+  lua_remove(L, cache);
+}
+
+// This returns whether the cache entry on top of the stack holds up-to-date
+// text for stack[i].
+static int is_cache_hit(lua_State *L, int i) {
+      // stack = [.., entry]
+  lua_rawgeti(L, -1, 1);
+  lua_rawgeti(L, -2, 3);
+  lua_rawgeti(L, -3, 4);
+      // stack = [.., entry, value, epoch, writes]
+  int is_hit = lua_rawequal(L, -3, i) &&
+               (unsigned long)lua_tonumber(L, -2) == untracked_epoch;
+  lua_Number writes = lua_tonumber(L, -1);
+  lua_pop(L, 3);
+  if (!is_hit) return 0;
+  push_weak_table(L, table_versions_key);
+  int k;
+  for (k = 5; is_hit; ++k) {
+    lua_rawgeti(L, -2, k);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      break;
+    }
+    lua_rawget(L, -2);
+        // stack = [.., entry, versions, version | nil]
+    is_hit = (lua_tonumber(L, -1) <= writes);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+      // stack = [.., entry]
+  return is_hit;
+}
+
+// This prints stack[i], which is in the given slot of the demo stack, using
+// the text in the render cache at stack[cache] if the slot holds a table that
+// hasn't changed since it was printed. A cache of 0 means there's none.
+static void print_slot(lua_State *L, int cache, int i, int slot) {
+  i = abs_index(L, i);
+  if (cache == 0 || !lua_istable(L, i)) {
+    if (cache) {
+      lua_pushnil(L);
+      lua_rawseti(L, cache, slot);
+    }
+    print_item(L, i, 0);  // 0 --> as_key
+    return;
+  }
+      // stack = [..]
+  lua_rawgeti(L, cache, slot);
+      // stack = [.., entry | nil]
+  if (lua_istable(L, -1) && is_cache_hit(L, i)) {
+    size_t len;
+    lua_rawgeti(L, -1, 2);
+    const char *text = lua_tolstring(L, -1, &len);
+    out_bytes(text, len);
+    lua_pop(L, 2);
+        // stack = [..]
+    return;
+  }
+  lua_pop(L, 1);
+
+  lua_createtable(L, 5, 0);
+      // stack = [.., entry]
+  is_cacheable   = 1;
+  is_capturing   = 1;
+  capture_len    = 0;
+  capture_tables = lua_gettop(L);
+  num_captured   = 0;
+  print_item(L, i, 0);  // 0 --> as_key
+  is_capturing   = 0;
+  capture_tables = 0;
+  if (render_cut) is_cacheable = 0;  // The text was cut short.
+  out_bytes(capture, capture_len);
+
+  if (is_cacheable) {
+    lua_pushvalue(L, i);
+    lua_rawseti(L, -2, 1);
+    lua_pushlstring(L, capture, capture_len);
+    lua_rawseti(L, -2, 2);
+    lua_pushnumber(L, (lua_Number)untracked_epoch);
+    lua_rawseti(L, -2, 3);
+    lua_pushnumber(L, (lua_Number)table_writes);
+    lua_rawseti(L, -2, 4);
+  } else {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+  }
+      // stack = [.., entry | nil]
+  lua_rawseti(L, cache, slot);
+      // stack = [..]
+}
+
+// ### Printing whole stacks.
+
+// This returns the number of stack slots used by an in-progress buffer.
+static int buffer_slots(DemoBuffer *buffer) {
+#if LUA_VERSION_NUM == 501
+  return buffer->b.lvl;  // The number of string pieces pushed so far.
+#elif LUA_VERSION_NUM <= 503
+  return buffer->b.b != buffer->b.initb;  // A box userdata, once it grows.
+#else
+  return 1;  // A placeholder, or a box userdata once it grows.
+#endif
+}
+
+// This prints an in-progress buffer as a single item, as if it were a string.
+static void print_buffer(lua_State *L, DemoBuffer *buffer) {
+  out("luaL_Buffer:'");
+#if LUA_VERSION_NUM == 501
+  // In Lua 5.1, the contents are the string pieces on the stack followed by
+  // the bytes still pending in the C-side array.
+  int i;
+  for (i = buffer->base + 1; i <= buffer->base + buffer->b.lvl; ++i) {
+    size_t len;
+    const char *s = lua_tolstring(L, i, &len);
+    out_bytes(s, len);
+  }
+  out_bytes(buffer->b.buffer, buffer->b.p - buffer->b.buffer);
+#else
+  out_bytes(buffer->b.b, buffer->b.n);
+#endif
+  out("'");
+}
+
+// This prints "stack:" followed by the n items of demo_state's stack, which
+// are at stack[1..n] when the state is loaded. They may also have been pushed
+// higher up, above a loaded state; in that case they start at stack[first].
+static void print_items(lua_State *L, FakeLuaState *demo_state,
+                        int first, int n) {
+  DemoBuffer *buffer = demo_state->buffer;
+  // If the buffer's slots were popped out from under it, print the raw stack.
+  if (buffer && buffer->base + buffer_slots(buffer) > n) buffer = NULL;
+  int cache = 0;
+  if (options.cache_tables) {
+    push_render_cache(L, demo_state);
+    cache = lua_gettop(L);
+  }
+  out("stack:");
+  begin_render();
+  int i = 1;
+  if (options.window && n > options.window) {
+    i = n - options.window + 1;
+    if (buffer && i > buffer->base + 1) i = buffer->base + 1;
+    if (i > 1) {
+      out(" \xe2\x80\xa6 ");  // UTF-8 "…".
+      print_count(i - 1);
+      out(" more \xe2\x80\xa6");
+    }
+  }
+  for (; i <= n && !is_over_budget(); ++i) {
+    if (buffer && i == buffer->base + 1) {
+      out(" ");
+      print_buffer(L, buffer);
+      i += buffer_slots(buffer);
+      buffer = NULL;
+      if (i > n) break;
+    }
+    out(" ");
+    print_slot(L, cache, first + i - 1, i);
+  }
+  if (buffer && !is_over_budget()) {  // The buffer is on top, with no slots.
+    out(" ");
+    print_buffer(L, buffer);
+  } else if (n == 0) {
+    out(" <empty>");
+  }
+  end_render();
+  if (cache) pop_render_cache(L, cache, n);
+}
+
+// The table at stack[reached] maps each table hashed for some state's stack to
+// the lowest slot it was reached from; see hash_value. This returns the lowest
+// slot that reached a table written to since table_writes was at writes, or
+// INT_MAX if there's none. Entries for slots above n are dropped, since those
+// slots are hashed again anyway.
+static int lowest_written_slot(lua_State *L, int reached, int n,
+                               unsigned long writes) {
+  int lowest = INT_MAX;
+  push_weak_table(L, table_versions_key);
+  lua_pushnil(L);
+  while (lua_next(L, reached)) {
+        // stack = [.., versions, table, slot]
+    int slot = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (slot > n) {
+      lua_pushvalue(L, -1);
+      lua_pushnil(L);
+      lua_rawset(L, reached);  // Clearing a field is fine while traversing.
+      continue;
+    }
+    if (slot >= lowest) continue;
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+        // stack = [.., versions, table, version | nil]
+    if ((unsigned long)lua_tonumber(L, -1) > writes) lowest = slot;
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+      // stack = [..]
+  return lowest;
+}
+
+// This prints how stack[1..n] differs from the saved stack of the currently
+// loaded state, such as "diff: ~[2] 7 +[3] 'x'" or "diff: -[3..4]": items
+// that were replaced (~) or pushed (+), and the range that was popped (-).
+// Only slots from the first changed one up are compared, and only changed
+// items are printed, so the output grows with the change, not the stack.
+//
+// A table changed in place is still the same value in the same slot, so
+// data.diff_tables keeps, for each slot holding a table, {table, hash}, with
+// the hash from hash_one_value as an 8-byte string, and data.diff_reached
+// maps every table those hashes reached to its slot. Lower slots are hashed
+// again only from the lowest one that reached a table written to since the
+// last diff, or from slot 1 after a call that may have run Lua code. A table
+// whose hash has changed is shown as replaced too. Hashing counts against the
+// print budgets, and a table whose hash is cut short keeps no hash, so it's
+// only compared again once it has been hashed whole.
+static void print_diff(lua_State *L, int n) {
+      // stack = [..]
+  load_states_table(L);
+  lua_rawgeti(L, -1, current_state->ref);
+  lua_remove(L, -2);
+      // stack = [.., demo_state_data]
+  int data = lua_gettop(L);
+  lua_getfield(L, data, "num_items");
+  int old_n = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  int keep = count_unchanged(L, data, n);
+  unchanged_state = current_state;
+  unchanged_n     = n;
+  unchanged_count = keep;
+  push_data_table(L, data, "diff_tables");
+  int tables = lua_gettop(L);
+  push_weak_data_table(L, data, "diff_reached");
+  int reached = lua_gettop(L), cache = 0;
+  int first = keep + 1;  // The lowest slot to look at.
+  if (current_state->diff_untracked != untracked_epoch) {
+    first = 1;
+  } else if (current_state->diff_writes != table_writes) {
+    int lowest = lowest_written_slot(L, reached, keep,
+                                     current_state->diff_writes);
+    if (lowest < first) first = lowest;
+  }
+  if (options.cache_tables) {
+    push_render_cache(L, current_state);
+    cache = lua_gettop(L);
+  }
+      // stack = [.., demo_state_data, diff_tables, diff_reached, render_cache?]
+  out("diff:");
+  begin_render();
+  int num_changes = 0;
+  int i;
+  for (i = first; i <= n && !is_over_budget(); ++i) {
+    int is_same = (i <= keep);
+    if (!is_same && i <= old_n) {
+      lua_rawgeti(L, data, i);
+      is_same = lua_rawequal(L, -1, i);
+      lua_pop(L, 1);
+    }
+    if (lua_istable(L, i)) {
+      uint64_t hash = hash_one_value(L, i, reached, i);
+      if (render_cut) {  // The hash is only partial, so it isn't kept.
+        lua_pushnil(L);
+        lua_rawseti(L, tables, i);
+        break;
+      }
+      lua_rawgeti(L, tables, i);
+          // stack = [.., entry | nil]
+      if (is_same && lua_istable(L, -1)) {
+        lua_rawgeti(L, -1, 1);
+        lua_rawgeti(L, -2, 2);
+            // stack = [.., entry, table, hash]
+        if (lua_rawequal(L, -2, i) &&
+            memcmp(lua_tostring(L, -1), &hash, sizeof(hash)) != 0) {
+          is_same = 0;  // The same table, changed in place.
+        }
+        lua_pop(L, 2);
+      }
+      lua_pop(L, 1);
+      lua_createtable(L, 2, 0);
+      lua_pushvalue(L, i);
+      lua_rawseti(L, -2, 1);
+      lua_pushlstring(L, (const char *)&hash, sizeof(hash));
+      lua_rawseti(L, -2, 2);
+      lua_rawseti(L, tables, i);
+    } else if (!is_same) {
+      lua_pushnil(L);
+      lua_rawseti(L, tables, i);
+    }
+    if (is_same) continue;
+    out(" %s[%d] ", (i <= old_n) ? "~" : "+", i);
+    print_slot(L, cache, i, i);
+    num_changes++;
+  }
+  end_render();
+  current_state->diff_untracked = untracked_epoch;
+  current_state->diff_writes    = table_writes;
+  if (cache) pop_render_cache(L, cache, n);
+  for (i = n + 1; i <= old_n; ++i) {
+    lua_pushnil(L);
+    lua_rawseti(L, tables, i);
+  }
+  lua_pop(L, 3);
+      // stack = [..]
+  if (old_n == n + 1) out(" -[%d]", old_n);
+  if (old_n > n + 1)  out(" -[%d..%d]", n + 1, old_n);
+  if (num_changes == 0 && old_n <= n) out(" <none>");
+}
+
+// This prints the stack of the currently loaded state. A coroutine's stack is
+// printed below its parent's, indented and labeled with the coroutine.
+static void print_stack(lua_State *L, int omit) {
+  stop_measuring(L);
+  luaL_checkstack(L, LUA_MINSTACK, "demo stack too big to print");
+  // String buffers span several slots, so stacks with one are printed whole.
+  int is_diff = options.diff_only && !current_state->buffer;
+  if (current_state->parent) {
+    // The parent may have been closed since.
+    if (!is_diff && current_state->parent->ref != LUA_NOREF) {
+      print_saved_stack(L, current_state->parent);
+    }
+    out("%sthread:%p ", is_diff ? "" : "  ", (void *)current_state->thread);
+  }
+  if (is_diff) {
+    print_diff(L, lua_gettop(L) - omit);
+  } else {
+    print_items(L, current_state, 1, lua_gettop(L) - omit);
+    // Tables pushed now have no hashes, so the next diff hashes them all.
+    current_state->diff_untracked = ~untracked_epoch;
+  }
+  if (options.show_memory) print_mem_stats(current_state);
+  if (options.show_gc)     print_gc_stats(current_state);
+  if (has_table_write)     print_table_write();
+  if (chunk_note)          out("  [chunk cache %s]", chunk_note);
+  chunk_note = NULL;
+  out("\n");
+  if (options.lint) lint_call(L, lua_gettop(L) - omit);
+}
+
+
+// ## Performance lint.
+
+// With options.lint set, each call on a demo state is checked against
+// patterns of calls that are slow, or unsafe, in real C code. Each pattern is
+// reported once per state, as a "lint:" line after the stack of the call that
+// set it off, with a rough cost. They're also kept in data.lint.warnings for
+// apidemo.lint.
+//
+// Counts are kept in data.lint: per-name lua_getglobal counts in globals, and
+// the fields below.
+//   concats        The length of the current chain of lua_concat calls, each
+//                  joining the last one's result to more pieces.
+//   concat_bytes   The bytes the chain's calls copied into their results.
+//   last_concat    The last lua_concat result, to spot the next in a chain.
+//   is_chained     Whether the call being run continues the chain.
+//   int_gets       The number of lua_gettable calls with integer keys.
+//   checked_top    The stack height lua_checkstack last made room for.
+//   warned         The set of patterns already reported.
+
+// These are how many times a pattern has to be seen to be worth a warning.
+#define lint_min_concats    4
+#define lint_min_int_gets   3
+#define lint_min_getglobals 3
+#define lint_min_rehashes   4
+
+// This pushes data.lint for the currently loaded state.
+static void push_lint_table(lua_State *L) {
+      // stack = [..]
+  load_states_table(L);
+  lua_rawgeti(L, -1, current_state->ref);
+  lua_remove(L, -2);
+  push_data_table(L, lua_gettop(L), "lint");
+  lua_remove(L, -2);
+      // stack = [.., lint]
+}
+
+// This adds n to lint[field] and returns the new value.
+static int add_to_count(lua_State *L, int lint, const char *field, int n) {
+  lua_getfield(L, lint, field);
+  n += lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  lua_pushinteger(L, n);
+  lua_setfield(L, lint, field);
+  return n;
+}
+
+// This reports a warning for pattern, unless it's been reported for this
+// state before. The message is formatted as by lua_pushfstring.
+static void lint_warn(lua_State *L, int lint, const char *pattern,
+                      const char *fmt, ...) {
+      // stack = [..]
+  push_data_table(L, lint, "warned");
+  lua_getfield(L, -1, pattern);
+  int was_warned = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  if (was_warned) {
+    lua_pop(L, 1);
+    return;
+  }
+  lua_pushboolean(L, 1);
+  lua_setfield(L, -2, pattern);
+  lua_pop(L, 1);
+
+  va_list args;
+  va_start(args, fmt);
+  const char *msg = lua_pushvfstring(L, fmt, args);
+  va_end(args);
+      // stack = [.., msg]
+  out("lint: %s\n", msg);
+  int k = add_to_count(L, lint, "num_warnings", 1);
+  push_data_table(L, lint, "warnings");
+  lua_insert(L, -2);
+      // stack = [.., warnings, msg]
+  lua_rawseti(L, -2, k);
+  lua_pop(L, 1);
+      // stack = [..]
+}
+
+// This returns whether x is a whole number that fits in an int, which it must
+// be before it's cast to one.
+static int is_int_value(lua_Number x) {
+  return x >= INT_MIN && x <= INT_MAX && x == (int)x;
+}
+
+// This notes whether the lua_concat about to run joins the last one's result,
+// at the bottom of the values it's given, to more pieces.
+static void lint_before_concat(lua_State *L) {
+  int n = (int)lint_arg;
+  int first = lua_gettop(L) - n + 1;
+      // stack = [..]
+  push_lint_table(L);
+  lua_getfield(L, -1, "last_concat");
+  int is_chained = (n >= 2 && first >= 1 &&
+                    lua_type(L, first) == LUA_TSTRING &&
+                    lua_rawequal(L, first, -1));
+  lua_pop(L, 1);
+  lua_pushboolean(L, is_chained);
+  lua_setfield(L, -2, "is_chained");
+  lua_pop(L, 1);
+      // stack = [..]
+}
+
+// This is called before a call runs, with its stack at stack[1..].
+static void lint_before_call(lua_State *L) {
+  if (!options.lint || lint_fn == NULL || !is_int_value(lint_arg)) return;
+  if (strcmp(lint_fn, "lua_concat") == 0) {
+    lint_before_concat(L);
+    return;
+  }
+  int t = (int)lint_arg;
+  if (strcmp(lint_fn, "lua_gettable") != 0) return;
+  if (t < 0 && t > LUA_REGISTRYINDEX) t = lua_gettop(L) + t + 1;
+  if (lua_type(L, -1) != LUA_TNUMBER || !lua_istable(L, t)) return;
+  if (!is_int_value(lua_tonumber(L, -1))) return;
+  if (lua_getmetatable(L, t)) {  // It may need __index, so it can't be raw.
+    lua_pop(L, 1);
+    return;
+  }
+      // stack = [..]
+  push_lint_table(L);
+  int lint = lua_gettop(L);
+  int n = add_to_count(L, lint, "int_gets", 1);
+  if (n >= lint_min_int_gets) {
+    lint_warn(L, lint, "int_gets",
+              "%d lua_gettable calls with integer keys on a table with no "
+              "metatable; lua_rawgeti(L, i, n) would save a push of the key "
+              "and a metatable check in each", n);
+  }
+  lua_pop(L, 1);
+      // stack = [..]
+}
+
+// This is called after a call runs, with the n items of its stack at
+// stack[1..n].
+static void lint_call(lua_State *L, int n) {
+  if (lint_fn == NULL) return;
+      // stack = [..]
+  push_lint_table(L);
+  int lint = lua_gettop(L);
+
+  if (strcmp(lint_fn, "lua_getglobal") == 0) {
+    push_data_table(L, lint, "globals");
+    lua_getfield(L, -1, lint_arg_str);
+    int count = lua_tointeger(L, -1) + 1;
+    lua_pop(L, 1);
+    lua_pushinteger(L, count);
+    lua_setfield(L, -2, lint_arg_str);
+    lua_pop(L, 1);
+    if (count >= lint_min_getglobals) {
+      lua_pushfstring(L, "getglobal %s", lint_arg_str);
+      lint_warn(L, lint, lua_tostring(L, -1),
+                "lua_getglobal(L, \"%s\") has looked up the same global %d "
+                "times; each is a hash lookup in the globals table, while a "
+                "copy kept on the stack or in an upvalue is a slot copy",
+                lint_arg_str, count);
+      lua_pop(L, 1);
+    }
+  }
+
+  if (strcmp(lint_fn, "lua_concat") == 0 && n > 0 &&
+      lua_type(L, n) == LUA_TSTRING) {
+    size_t len;
+    lua_tolstring(L, n, &len);
+    lua_getfield(L, lint, "is_chained");
+    int is_chained = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    if (!is_chained) {  // This call starts a new chain.
+      lua_pushinteger(L, 0);
+      lua_setfield(L, lint, "concats");
+      lua_pushinteger(L, 0);
+      lua_setfield(L, lint, "concat_bytes");
+    }
+    lua_pushvalue(L, n);
+    lua_setfield(L, lint, "last_concat");
+    int num_concats = add_to_count(L, lint, "concats", 1);
+    int copied = add_to_count(L, lint, "concat_bytes", (int)len);
+    if (num_concats >= lint_min_concats && copied > 2 * (int)len) {
+      lint_warn(L, lint, "concats",
+                "%d chained lua_concat calls have copied %d bytes to build a "
+                "%d-byte string; a luaL_Buffer would copy about %d",
+                num_concats, copied, (int)len, (int)len);
+    }
+  }
+
+  if (has_lint_rehash && lint_rehash.rehashes >= lint_min_rehashes) {
+    int slots = lint_rehash.array_size + lint_rehash.hash_size;
+    lint_warn(L, lint, "rehashes",
+              "a table has been rehashed %d times while being filled, copying "
+              "about %d slots so far; lua_createtable(L, %d, %d) or larger "
+              "makes room up front",
+              lint_rehash.rehashes, slots, lint_rehash.array_size,
+              lint_rehash.hash_size);
+  }
+  has_lint_rehash = 0;
+
+  lua_getfield(L, lint, "checked_top");
+  int checked_top = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  if ((strcmp(lint_fn, "lua_checkstack") == 0 ||
+       strcmp(lint_fn, "luaL_checkstack") == 0) && is_int_value(lint_arg)) {
+    lua_pushnumber(L, n + lint_arg);
+    lua_setfield(L, lint, "checked_top");
+  } else if (n > LUA_MINSTACK && n > checked_top) {
+    lint_warn(L, lint, "checkstack",
+              "the stack grew to %d slots without lua_checkstack; a C "
+              "function is only promised LUA_MINSTACK (%d) free slots, and "
+              "pushing past them is undefined behavior", n, LUA_MINSTACK);
+  }
+
+  lua_pop(L, 1);
+      // stack = [..]
+}
+
+
+// ## The flight recorder.
+
+// With options set by apidemo.set_options{flight_recorder = path}, or with
+// APIDEMO_FLIGHT_RECORDER set in the environment when apidemo is loaded, each
+// wrapper call is written to a ring of fixed-size entries in a memory-mapped
+// file. An entry is filled in with plain stores, in two parts: the function
+// and arguments when the call starts, and the stack sizes and top value when
+// it saves its stack. There is no stdio buffering in between, so if the
+// process dies, the file holds the last calls up to and including the one that
+// was running. flightdump.c prints such a file.
+//
+// The file is mapped once per process and shared by every thread that records
+// to the same path; the first to open it starts a new recording, and the last
+// to close it unmaps it. Each wrapper knows its function's index in the
+// process's list of names, which is copied into the file.
+
+// The shared recording, its path and the number of threads writing to it, and
+// the names of the functions wrapped so far, kept under flight_lock.
+#ifndef _WIN32
+static pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static FlightHeader *flight_file;
+static char          flight_path[1024];
+static int           flight_users;
+static const char   *flight_names[flight_max_names];
+static int           num_flight_names = 1;  // Index 0 is for unknown names.
+
+// This returns the index of name in flight_names, adding it if it's new, and
+// 0 if there's no room. The name must outlive the module, as a literal does.
+static int flight_name_id(const char *name) {
+#ifdef _WIN32
+  return 0;  // There's no flight recorder to name calls for.
+#else
+  pthread_mutex_lock(&flight_lock);
+  int id;
+  for (id = 1; id < num_flight_names; ++id) {
+    if (strcmp(flight_names[id], name) == 0) break;
+  }
+  if (id == num_flight_names) {
+    if (id < flight_max_names) {
+      flight_names[num_flight_names++] = name;
+      if (flight_file) {
+        snprintf(flight_file->names[id], 32, "%s", name);
+        flight_file->num_names = num_flight_names;
+      }
+    } else {
+      id = 0;
+    }
+  }
+  pthread_mutex_unlock(&flight_lock);
+  return id;
+#endif
+}
+
+// This returns whether stack[i] has the metatable registered under name.
+static int has_metatable(lua_State *L, int i, const char *name) {
+  if (!lua_getmetatable(L, i)) return 0;
+  luaL_getmetatable(L, name);
+  int is_match = lua_rawequal(L, -1, -2);
+  lua_pop(L, 2);
+  return is_match;
+}
+
+// This stores stack[i] in value without formatting it: numbers and booleans
+// by value, strings by their first bytes, and other values by address.
+static void flight_value(lua_State *L, int i, FlightValue *value) {
+  size_t len;
+  const char *s;
+  value->type = lua_type(L, i);
+  value->len  = 0;
+  switch (value->type) {
+    case LUA_TNUMBER:
+      value->as.number = (double)lua_tonumber(L, i);
+      break;
+    case LUA_TBOOLEAN:
+      value->as.number = lua_toboolean(L, i);
+      break;
+    case LUA_TSTRING:
+      s = lua_tolstring(L, i, &len);
+      value->len = (uint32_t)len;
+      memcpy(value->as.text, s, len < flight_text_len ? len : flight_text_len);
+      break;
+    default:
+      value->as.address = (uint64_t)(uintptr_t)lua_topointer(L, i);
+  }
+}
+
+// This returns the entry for call, which may since have been reused.
+static FlightEntry *flight_slot(uint64_t call) {
+  return (FlightEntry *)(flight + 1) + (call - 1) % flight->num_entries;
+}
+
+// This stops this thread recording, and unmaps the file if no other thread is.
+static void flight_close(void) {
+  if (flight == NULL) return;
+#ifndef _WIN32
+  pthread_mutex_lock(&flight_lock);
+  if (--flight_users == 0) {
+    munmap(flight_file, sizeof(FlightHeader) +
+                        (size_t)flight_file->num_entries * sizeof(FlightEntry));
+    flight_file = NULL;
+  }
+  pthread_mutex_unlock(&flight_lock);
+#endif
+  flight = NULL;
+  flight_call = 0;
+}
+
+// This starts this thread recording to the file at path, if it isn't already.
+// If no thread is recording yet, the file is replaced by a new recording of
+// num_entries calls; otherwise this thread joins the recording that's going
+// on, which must be to the same path.
+static void flight_open(lua_State *L, const char *path, int num_entries) {
+  // The path can't change while this thread holds the file open.
+  if (flight && strcmp(flight_path, path) == 0) return;
+  flight_close();
+#ifdef _WIN32
+  luaL_error(L, "the flight recorder needs mmap, which isn't available here");
+#else
+  pthread_mutex_lock(&flight_lock);
+  if (flight_file) {
+    int is_same = (strcmp(flight_path, path) == 0);
+    if (is_same) {
+      flight_users++;
+      flight = flight_file;
+    }
+    pthread_mutex_unlock(&flight_lock);
+    if (!is_same) {
+      luaL_error(L, "another thread is recording to %s; only one flight "
+                    "recorder file can be open at a time", flight_path);
+    }
+    return;
+  }
+  size_t size = sizeof(FlightHeader) +
+                (size_t)num_entries * sizeof(FlightEntry);
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  void *p = MAP_FAILED;
+  // Truncating first zeroes every entry, so unused slots read as empty.
+  if (fd >= 0 && ftruncate(fd, 0) == 0 && ftruncate(fd, (off_t)size) == 0) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (fd >= 0) close(fd);
+  if (p == MAP_FAILED) {
+    pthread_mutex_unlock(&flight_lock);
+    if (fd < 0) luaL_error(L, "can't open %s for writing", path);
+    luaL_error(L, "can't map %s into memory", path);
+  }
+  flight_file = (FlightHeader *)p;
+  memcpy(flight_file->magic, flight_magic, sizeof(flight_file->magic));
+  flight_file->entry_size  = sizeof(FlightEntry);
+  flight_file->num_entries = num_entries;
+  int k;
+  for (k = 1; k < num_flight_names; ++k) {
+    snprintf(flight_file->names[k], 32, "%s", flight_names[k]);
+  }
+  flight_file->num_names = num_flight_names;
+  snprintf(flight_path, sizeof(flight_path), "%s", path);
+  flight_users = 1;
+  flight = flight_file;
+  pthread_mutex_unlock(&flight_lock);
+#endif
+}
+
+// This marks entry as busy, so this thread is the only one writing to it, and
+// returns the call it held. It's flight_busy if another thread is writing
+// to the entry, which happens only if the ring comes all the way round during
+// one call; then the entry is left to that thread.
+static uint64_t flight_claim(FlightEntry *entry) {
+#ifdef _MSC_VER
+  uint64_t old = entry->call;
+  entry->call = flight_busy;
+  return old;
+#else
+  return __atomic_exchange_n(&entry->call, flight_busy, __ATOMIC_ACQUIRE);
+#endif
+}
+
+// This marks entry as busy if it still holds call, and returns whether it did.
+static int flight_claim_call(FlightEntry *entry, uint64_t call) {
+#ifdef _MSC_VER
+  if (entry->call != call) return 0;
+  entry->call = flight_busy;
+  return 1;
+#else
+  return __atomic_compare_exchange_n(&entry->call, &call, flight_busy, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+#endif
+}
+
+// This ends a claim, giving entry to call. The release store keeps the
+// entry's other fields from being written after it, so a reader, or a file
+// left by a crash, never sees call with half of its fields.
+static void flight_publish(FlightEntry *entry, uint64_t call) {
+#ifdef _MSC_VER
+  entry->call = call;
+#else
+  __atomic_store_n(&entry->call, call, __ATOMIC_RELEASE);
+#endif
+}
+
+// This records the start of the call, to function name_id, whose arguments
+// are at stack[1..]. Threads may share a file, so each takes its slot with an
+// atomic increment, and claims the entry before writing to it.
+static void flight_begin(lua_State *L, int name_id) {
+#ifdef _MSC_VER
+  uint64_t call = ++flight->num_calls;
+#else
+  uint64_t call = __atomic_add_fetch(&flight->num_calls, 1, __ATOMIC_RELAXED);
+#endif
+  FlightEntry *entry = flight_slot(call);
+  flight_call = 0;
+  if (flight_claim(entry) == flight_busy) return;
+  entry->depth_before = entry->depth_after = -1;
+  entry->name = name_id;
+  int n = lua_gettop(L), k;
+  entry->num_args = n;
+  for (k = 1; k <= n && k <= flight_max_args; ++k) {
+    flight_value(L, k, &entry->args[k - 1]);
+  }
+  entry->top.type = LUA_TNONE;
+  flight_publish(entry, call);
+  flight_call = call;
+}
+
+// This records the stack saved by the current call: its sizes before and
+// after, and its top value, which is either the last of the n new values at
+// stack[first..] or, if there are none, the last of the keep items that
+// stayed in the demo state's data at stack[data].
+static void flight_end(lua_State *L, int data, int depth_before, int keep,
+                       int first, int n) {
+  FlightEntry *entry = flight_slot(flight_call);
+  // The ring may have come round, giving the entry to a later call.
+  if (!flight_claim_call(entry, flight_call)) return;
+  if (n > 0) {
+    flight_value(L, first + n - 1, &entry->top);
+  } else if (keep > 0) {
+    lua_rawgeti(L, data, keep);
+    flight_value(L, -1, &entry->top);
+    lua_pop(L, 1);
+  }
+  entry->depth_before = depth_before;
+  entry->depth_after  = keep + n;
+  flight_publish(entry, flight_call);
+}
+
+// ## Streaming events over a socket.
+
+// With apidemo.set_options{stream = path}, apidemo listens on a Unix domain
+// socket at path and sends each connected client one JSON object per line
+// for every wrapper call, made from the same event table apidemo.observe
+// gets. Nothing here blocks: clients are accepted and written to with
+// non-blocking calls as events are made, and each client has a buffer of
+// stream_buffer_size bytes for what it hasn't read yet. An event that doesn't
+// fit is dropped for that client, and the next one it gets is preceded by
+// {"dropped":k}, so a slow viewer loses events instead of stalling Lua.
+// streamcat.c is a small client for trying this out.
+
+// This appends len bytes to stream_line, growing it as needed.
+static void line_bytes(const char *s, size_t len) {
+  if (stream_line_len + len > stream_line_size) {
+    size_t size = stream_line_size ? stream_line_size : 1024;
+    while (size < stream_line_len + len) size *= 2;
+    char *new_line = (char *)realloc(stream_line, size);
+    if (new_line == NULL) return;
+    stream_line      = new_line;
+    stream_line_size = size;
+  }
+  memcpy(stream_line + stream_line_len, s, len);
+  stream_line_len += len;
+}
+
+static void line_add(const char *fmt, ...) {
+  char text[128];
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(text, sizeof(text), fmt, args);
+  va_end(args);
+  if (len >= (int)sizeof(text)) len = sizeof(text) - 1;  // Only short text.
+  if (len > 0) line_bytes(text, len);
+}
+
+static void line_add_json_string(const char *s, size_t len) {
+  line_bytes("\"", 1);
+  size_t k, start = 0;
+  for (k = 0; k < len; ++k) {
+    unsigned char c = (unsigned char)s[k];
+    if (c >= 32 && c != '"' && c != '\\') continue;
+    line_bytes(s + start, k - start);
+    if (c == '"' || c == '\\') {
+      line_add("\\%c", c);
+    } else {
+      line_add("\\u%04x", c);
+    }
+    start = k + 1;
+  }
+  line_bytes(s + start, len - start);
+  line_bytes("\"", 1);
+}
+
+// This appends stack[i] as JSON. Values JSON has no form for, such as tables,
+// are sent as strings like "table: 0x55d0c8e4a2b0".
+static void line_add_json_value(lua_State *L, int i) {
+  size_t len;
+  const char *s;
+  lua_Number n;
+  switch (lua_type(L, i)) {
+    case LUA_TNIL:
+      line_add("null");
+      break;
+    case LUA_TBOOLEAN:
+      line_add(lua_toboolean(L, i) ? "true" : "false");
+      break;
+    case LUA_TNUMBER:
+      n = lua_tonumber(L, i);
+      if (n != n || n - n != 0) {
+        line_add("null");  // NaN and infinities.
+      } else {
+        line_add("%.17g", (double)n);
+      }
+      break;
+    case LUA_TSTRING:
+      s = lua_tolstring(L, i, &len);
+      line_add_json_string(s, len);
+      break;
+    default:
+      line_add("\"%s: %p\"", luaL_typename(L, i), lua_topointer(L, i));
+  }
+}
+
+// This appends ,"name":[..] for the list event[name].
+static void line_add_json_list(lua_State *L, int event, const char *name) {
+  lua_getfield(L, event, name);
+  int list = lua_gettop(L);
+  lua_getfield(L, list, "n");
+  int n = lua_tointeger(L, -1), k;
+  lua_pop(L, 1);
+  line_add(",\"%s\":[", name);
+  for (k = 1; k <= n; ++k) {
+    if (k > 1) line_bytes(",", 1);
+    lua_rawgeti(L, list, k);
+    line_add_json_value(L, -1);
+    lua_pop(L, 1);
+  }
+  line_bytes("]", 1);
+  lua_pop(L, 1);
+}
+
+// This appends ,"name":value for event[name].
+static void line_add_json_field(lua_State *L, int event, const char *name) {
+  lua_getfield(L, event, name);
+  line_add(",\"%s\":", name);
+  line_add_json_value(L, -1);
+  lua_pop(L, 1);
+}
+
+#ifndef _WIN32
+
+static void close_stream_client(int k) {
+  close(stream_clients[k].fd);
+  free(stream_clients[k].buffer);
+  stream_clients[k] = stream_clients[--num_stream_clients];
+}
+
+// This sends what it can of client k's buffer without blocking, and returns
+// whether the client is still connected.
+static int flush_stream_client(int k) {
+  StreamClient *client = &stream_clients[k];
+  size_t sent = 0;
+  while (sent < client->len) {
+    ssize_t n = send(client->fd, client->buffer + sent, client->len - sent,
+                     stream_send_flags);
+    if (n > 0) {
+      sent += n;
+      stream_bytes_sent += n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else {
+      close_stream_client(k);
+      return 0;
+    }
+  }
+  memmove(client->buffer, client->buffer + sent, client->len - sent);
+  client->len -= sent;
+  return 1;
+}
+
+// This adds the bytes at s to client's buffer, if they fit, and returns
+// whether they did.
+static int queue_for_client(StreamClient *client, const char *s, size_t len) {
+  if (client->len + len > stream_buffer_size) return 0;
+  memcpy(client->buffer + client->len, s, len);
+  client->len += len;
+  return 1;
+}
+
+// This accepts any clients waiting to connect.
+static void accept_stream_clients(void) {
+  while (num_stream_clients < max_stream_clients) {
+    int fd = accept(stream_fd, NULL, NULL);
+    if (fd < 0) return;  // Usually EAGAIN: nobody is waiting.
+    char *buffer = (char *)malloc(stream_buffer_size);
+    if (buffer == NULL || fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+      free(buffer);
+      close(fd);
+      continue;
+    }
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    StreamClient *client = &stream_clients[num_stream_clients++];
+    client->fd      = fd;
+    client->buffer  = buffer;
+    client->len     = 0;
+    client->dropped = 0;
+  }
+}
+
+// This sends the event table at stack[event] to each client.
+static void stream_event(lua_State *L, int event) {
+  accept_stream_clients();
+  if (num_stream_clients == 0) return;
+  luaL_checkstack(L, 3, "stack too big to stream");
+  stream_line_len = 0;
+  line_add("{\"call\":%lu", ++stream_events);
+  line_add_json_field(L, event, "name");
+  line_add_json_list (L, event, "args");
+  line_add_json_field(L, event, "ok");
+  line_add_json_list (L, event, "results");
+  line_add_json_field(L, event, "error");
+  line_add_json_field(L, event, "depth_before");
+  line_add_json_field(L, event, "depth_after");
+  line_add_json_list (L, event, "pushed");
+  line_add_json_list (L, event, "popped");
+  line_add_json_field(L, event, "seconds");
+  line_bytes("}\n", 2);
+
+  int k;
+  for (k = num_stream_clients - 1; k >= 0; --k) {
+    StreamClient *client = &stream_clients[k];
+    if (client->dropped) {
+      char notice[64];
+      int len = snprintf(notice, sizeof(notice), "{\"dropped\":%lu}\n",
+                         client->dropped);
+      if (client->len + len + stream_line_len <= stream_buffer_size) {
+        queue_for_client(client, notice, len);
+        client->dropped = 0;
+      }
+    }
+    if (client->dropped || !queue_for_client(client, stream_line,
+                                             stream_line_len)) {
+      client->dropped++;
+      stream_dropped++;
+    }
+    flush_stream_client(k);
+  }
+}
+
+// This removes the file at path if it's a socket, and returns whether path is
+// now free. Anything else at path is left alone.
+static int remove_socket_file(const char *path) {
+  struct stat st;
+  if (lstat(path, &st) < 0) return errno == ENOENT;
+  return S_ISSOCK(st.st_mode) && unlink(path) == 0;
+}
+
+// This stops streaming, disconnecting any clients. Each is sent what it can be
+// without blocking first; whatever's left is counted in stream_unsent.
+static void stream_close(void) {
+  if (stream_fd < 0) return;
+  int k;
+  for (k = num_stream_clients - 1; k >= 0; --k) {
+    if (flush_stream_client(k)) {
+      stream_unsent += stream_clients[k].len;
+      close_stream_client(k);
+    }
+  }
+  close(stream_fd);
+  remove_socket_file(stream_path);
+  stream_fd = -1;
+}
+
+// This starts listening for clients on a Unix domain socket at path. A socket
+// left at path by an earlier run is replaced, but any other kind of file there
+// is an error.
+static void stream_open(lua_State *L, const char *path) {
+  stream_close();
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    luaL_error(L, "socket path %s is too long", path);
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) luaL_error(L, "can't make a socket for %s", path);
+  if (!remove_socket_file(path)) {
+    close(fd);
+    luaL_error(L, "can't listen on %s, which is in use by a file that isn't "
+                  "a socket", path);
+  }
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(fd, max_stream_clients) < 0 ||
+      fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+    close(fd);
+    luaL_error(L, "can't listen on %s", path);
+  }
+  stream_fd = fd;
+  strcpy(stream_path, path);
+}
+
+#else
+
+static void stream_event(lua_State *L, int event) {}
+static void stream_close(void) {}
+
+static void stream_open(lua_State *L, const char *path) {
+  luaL_error(L, "streaming needs Unix domain sockets, which aren't available "
+                "here");
+}
+
+#endif
+
+// apidemo.stream_stats() returns a table of counts for the socket stream:
+// connected clients, events made while any were connected, bytes sent,
+// events dropped, counted once for each client that missed them, and bytes
+// left unsent when the stream was closed.
+static int stream_stats(lua_State *L) {
+  lua_newtable(L);
+      // stack = [t]
+  lua_pushinteger(L, num_stream_clients);
+  lua_setfield(L, -2, "clients");
+  lua_pushnumber(L, (lua_Number)stream_events);
+  lua_setfield(L, -2, "events");
+  lua_pushnumber(L, (lua_Number)stream_bytes_sent);
+  lua_setfield(L, -2, "bytes_sent");
+  lua_pushnumber(L, (lua_Number)stream_dropped);
+  lua_setfield(L, -2, "dropped");
+  lua_pushnumber(L, (lua_Number)stream_unsent);
+  lua_setfield(L, -2, "bytes_unsent");
+  return 1;
+}
+
+
+// ## Observers.
+
+// apidemo.observe(fn) calls fn(event) after each wrapper call, where event is
+// a table describing the call:
+//
+//   name          The function's name, such as "lua_pushnumber".
+//   args          The arguments, as a list with a field n.
+//   ok            Whether the call returned rather than raising an error.
+//   results       What the call returned to Lua, as a list with a field n.
+//   error         The error message, if ok is false.
+//   depth_before  The stack sizes around the call. These, pushed and popped
+//   depth_after   are nil for calls that didn't save a stack.
+//   pushed        The values that are new on the stack, as a list with n.
+//   popped        The values that were replaced or popped, as a list with n.
+//   seconds       The CPU time the call took.
+//
+// Event tables come from a pool, with one per level of nested calls, and are
+// refilled for each call rather than made anew, so observing many calls makes
+// little garbage. An observer that keeps an event must copy what it needs.
+// Calls the observer makes itself aren't observed.
+
+// This pushes the pooled event table for the given level of nesting.
+static void push_event(lua_State *L, int level) {
+  luaL_checkstack(L, 5, "stack too big to observe");
+      // stack = [..]
+  lua_getfield(L, LUA_REGISTRYINDEX, observer_events_key);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, observer_events_key);
+  }
+      // stack = [.., events]
+  lua_rawgeti(L, -1, level);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    const char *lists[] = {"args", "results", "pushed", "popped"};
+    int k;
+    for (k = 0; k < 4; ++k) {
+      lua_newtable(L);
+      lua_setfield(L, -2, lists[k]);
+    }
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, level);
+  }
+      // stack = [.., events, event]
+  lua_remove(L, -2);
+      // stack = [.., event]
+}
+
+// This sets the list event[name] to the n values at stack[first..], or at
+// src[first..] if src isn't 0, clearing any left from an earlier call.
+static void set_event_list(lua_State *L, int event, const char *name, int src,
+                           int first, int n) {
+  lua_getfield(L, event, name);
+      // stack = [.., list]
+  lua_getfield(L, -1, "n");
+  int old_n = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  int k;
+  for (k = 1; k <= n; ++k) {
+    if (src) {
+      lua_rawgeti(L, src, first + k - 1);
+    } else {
+      lua_pushvalue(L, first + k - 1);
+    }
+    lua_rawseti(L, -2, k);
+  }
+  for (; k <= old_n; ++k) {
+    lua_pushnil(L);
+    lua_rawseti(L, -2, k);
+  }
+  lua_pushinteger(L, n);
+  lua_setfield(L, -2, "n");
+  lua_pop(L, 1);
+      // stack = [..]
+}
+
+// This starts the event for the call whose arguments are at stack[1..].
+static void observe_begin(lua_State *L, int level) {
+  int n = lua_gettop(L);
+  push_event(L, level);
+  int event = lua_gettop(L);
+      // stack = [args, event]
+  lua_pushvalue(L, lua_upvalueindex(2));
+  lua_setfield(L, event, "name");
+  set_event_list(L, event, "args", 0, 1, n);
+  set_event_list(L, event, "pushed", 0, 1, 0);
+  set_event_list(L, event, "popped", 0, 1, 0);
+  const char *fields[] = {"depth_before", "depth_after", "error"};
+  int k;
+  for (k = 0; k < 3; ++k) {
+    lua_pushnil(L);
+    lua_setfield(L, event, fields[k]);
+  }
+  lua_pop(L, 1);
+      // stack = [args]
+}
+
+// This adds a saved stack to the current call's event: the keep items that
+// stayed in the demo state's data at stack[data], followed by the n new
+// values at stack[first..] in place of its other num_before items.
+static void observe_stack(lua_State *L, int data, int keep, int num_before,
+                          int first, int n) {
+  push_event(L, observe_level);
+  int event = lua_gettop(L);
+      // stack = [.., event]
+  lua_pushinteger(L, keep + num_before);
+  lua_setfield(L, event, "depth_before");
+  lua_pushinteger(L, keep + n);
+  lua_setfield(L, event, "depth_after");
+  set_event_list(L, event, "pushed", 0, first, n);
+  set_event_list(L, event, "popped", data, keep + 1, num_before);
+  lua_pop(L, 1);
+      // stack = [..]
+}
+
+// This finishes the event at the given level and passes it to the socket
+// stream and the observer, whichever are set. The stack holds the call's
+// results, or its error message if status isn't 0.
+static void observe_end(lua_State *L, int level, int status, double seconds) {
+  int n = lua_gettop(L);
+  push_event(L, level);
+  int event = lua_gettop(L);
+      // stack = [results, event]
+  lua_pushboolean(L, status == 0);
+  lua_setfield(L, event, "ok");
+  if (status) {
+    lua_pushvalue(L, n);
+    lua_setfield(L, event, "error");
+  }
+  set_event_list(L, event, "results", 0, 1, status ? 0 : n);
+  lua_pushnumber(L, seconds);
+  lua_setfield(L, event, "seconds");
+  if (stream_fd >= 0) stream_event(L, event);
+  if (!has_observer) {
+    lua_settop(L, n);
+    return;
+  }
+  lua_getfield(L, LUA_REGISTRYINDEX, observer_key);
+  lua_insert(L, event);
+      // stack = [results, observer, event]
+  is_observing = 1;
+  int observer_status = lua_pcall(L, 1, 0, 0);
+  is_observing = 0;
+  if (observer_status) lua_error(L);
+      // stack = [results]
+}
+
+// apidemo.observe(fn) sets the function called after each wrapper call, and
+// apidemo.observe(nil) stops observing.
+static int observe(lua_State *L) {
+  if (!lua_isnoneornil(L, 1)) luaL_checktype(L, 1, LUA_TFUNCTION);
+  lua_settop(L, 1);
+      // stack = [fn]
+  has_observer = !lua_isnil(L, 1);
+  lua_setfield(L, LUA_REGISTRYINDEX, observer_key);
+  return 0;
+}
+
+
+// ## Demo state history, for undo and redo.
+
+// Each demo state's data table keeps its history in two tables:
+//
+//   history[k]     How step k changed the saved stack, or true if it didn't.
+//                  A change is {keep, num_before, num_after, num_moved,
+//                  <before>, <after>}: the first keep items and the top
+//                  num_moved items were left alone, and the num_before items
+//                  between them were replaced by num_after others, which
+//                  moves the top items if the two counts differ.
+//   checkpoints[c] A copy of the whole stack at step c * checkpoint_period,
+//                  with its size in field n, or {prev = p, work = w} if it was
+//                  cheaper to reach that step by replaying changes, of w
+//                  items in all, from the copy at checkpoints[p].
+//
+// So memory grows with what calls change, not with the depth of the stack:
+// removing an item from under a deep stack stores one value, not two stacks.
+
+// This pushes data[name], creating it as an empty table if needed.
+static void push_data_table(lua_State *L, int data, const char *name) {
+      // stack = [..]
+  lua_getfield(L, data, name);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, data, name);
+  }
+      // stack = [.., data[name]]
+}
+
+// This pushes data[name] as push_data_table does, but creates it with weak
+// keys.
+static void push_weak_data_table(lua_State *L, int data, const char *name) {
+      // stack = [..]
+  lua_getfield(L, data, name);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    make_weak_keyed(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, data, name);
+  }
+      // stack = [.., data[name]]
+}
+
+// This clears saved items after data[num_items], so that they don't keep their
+// old values from being collected, and sets data.num_items to match.
+static void set_num_items(lua_State *L, int data, int num_items) {
+  lua_getfield(L, data, "num_items");
+  int old_num_items = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  int k;
+  for (k = num_items + 1; k <= old_num_items; ++k) {
+    lua_pushnil(L);
+    lua_rawseti(L, data, k);
+  }
+  lua_pushnumber(L, num_items);
+  lua_setfield(L, data, "num_items");
+}
+
+// This replaces saved items data[from..num_items] with the n values at
+// stack[first..], and sets num_items to match.
+static void set_items(lua_State *L, int data, int from, int first, int n) {
+  int k;
+  for (k = 0; k < n; ++k) {
+    lua_pushvalue(L, first + k);
+    lua_rawseti(L, data, from + k);
+  }
+  set_num_items(L, data, from + n - 1);
+}
+
+// This is set_items for n values taken from src[first..], where src is the
+// stack index of a table. They're copied one at a time, so that restoring a
+// large stack doesn't need room for it on the host stack.
+static void copy_items(lua_State *L, int data, int from, int src, int first,
+                       int n) {
+  int k;
+  for (k = 0; k < n; ++k) {
+    lua_rawgeti(L, src, first + k);
+    lua_rawseti(L, data, from + k);
+  }
+  set_num_items(L, data, from + n - 1);
+}
+
+// This moves the n saved items at data[from..] to data[to..]. The ranges can
+// overlap, so they're copied starting from the end that's moving away.
+static void move_items(lua_State *L, int data, int from, int to, int n) {
+  if (from == to) return;
+  int k;
+  for (k = 0; k < n; ++k) {
+    int i = (to > from ? n - 1 - k : k);
+    lua_rawgeti(L, data, from + i);
+    lua_rawseti(L, data, to + i);
+  }
+}
+
+// This forgets the steps after demo_state->step, which can no longer be
+// redone once a new change has been made.
+static void drop_redo_steps(lua_State *L, FakeLuaState *demo_state, int data) {
+  if (demo_state->num_steps == demo_state->step) return;
+      // stack = [..]
+  push_data_table(L, data, "history");
+  push_data_table(L, data, "checkpoints");
+  push_data_table(L, data, "calls");
+      // stack = [.., history, checkpoints, calls]
+  int k;
+  for (k = demo_state->step + 1; k <= demo_state->num_steps; ++k) {
+    lua_pushnil(L);
+    lua_rawseti(L, -4, k);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, k);
+  }
+  for (k = demo_state->step / checkpoint_period + 1;
+       k <= demo_state->num_steps / checkpoint_period; ++k) {
+    lua_pushnil(L);
+    lua_rawseti(L, -3, k);
+  }
+  lua_pop(L, 3);
+      // stack = [..]
+  demo_state->num_steps = demo_state->step;
+}
+
+// This keeps the record of the current call as step's entry in data.calls,
+// noting the stack height it left.
+static void save_call_record(lua_State *L, int data, int step, int top) {
+  luaL_checkstack(L, 3, "stack too big to save");
+      // stack = [..]
+  push_data_table(L, data, "calls");
+  lua_rawgeti(L, LUA_REGISTRYINDEX, call_record_ref);
+      // stack = [.., calls, record]
+  lua_pushinteger(L, top);
+  lua_setfield(L, -2, "top");
+  lua_rawseti(L, -2, step);
+  lua_pop(L, 1);
+      // stack = [..]
+}
+
+// This returns the number of the full checkpoint, at or before checkpoints[c],
+// that step c * checkpoint_period is reached from, or -1 if it was dropped.
+// Step 0 counts as a checkpoint holding an empty stack. *work is set to the
+// number of items changed between the two.
+static int find_checkpoint(lua_State *L, FakeLuaState *demo_state, int data,
+                           int c, int *work) {
+  int base = -1;
+  *work = 0;
+      // stack = [..]
+  push_data_table(L, data, "checkpoints");
+  lua_rawgeti(L, -1, c);
+      // stack = [.., checkpoints, checkpoint]
+  if (c == 0) {
+    base = 0;
+  } else if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "n");
+    lua_getfield(L, -2, "prev");
+    lua_getfield(L, -3, "work");
+        // stack = [.., checkpoints, checkpoint, n, prev, work]
+    base  = (lua_isnil(L, -3) ? lua_tointeger(L, -2) : c);
+    *work = lua_tointeger(L, -1);
+    lua_pop(L, 3);
+  }
+  lua_pop(L, 2);
+      // stack = [..]
+  if (base * checkpoint_period < demo_state->first_step) return -1;
+  return base;
+}
+
+// This returns the number of items that replaying step k changes, counting
+// an unchanged stack as one.
+static int step_work(lua_State *L, int history, int k) {
+  int v[4] = {0, 0, 0, 0}, i;
+  lua_rawgeti(L, history, k);
+  if (lua_istable(L, -1)) {
+    for (i = 0; i < 4; ++i) {
+      lua_rawgeti(L, -1, i + 1);
+      v[i] = lua_tointeger(L, -1);
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+  return 1 + v[1] + v[2] + (v[1] != v[2] ? v[3] : 0);
+}
+
+// This is called at each step that's a multiple of checkpoint_period. It
+// copies the whole stack into checkpoints[c], unless the changes since the
+// last copy add up to fewer items than the stack holds, in which case it only
+// notes where that copy is.
+static void save_checkpoint(lua_State *L, FakeLuaState *demo_state, int data,
+                            int num_items) {
+  int c = demo_state->step / checkpoint_period;
+  int work, k;
+  int base = find_checkpoint(L, demo_state, data, c - 1, &work);
+      // stack = [..]
+  push_data_table(L, data, "history");
+  int history = lua_gettop(L);
+  if (base >= 0) {
+    for (k = (c - 1) * checkpoint_period + 1; k <= c * checkpoint_period; ++k) {
+      work += step_work(L, history, k);
+    }
+  }
+  push_data_table(L, data, "checkpoints");
+      // stack = [.., history, checkpoints]
+  if (base >= 0 && work < num_items) {
+    lua_createtable(L, 0, 2);
+    lua_pushinteger(L, base);
+    lua_setfield(L, -2, "prev");
+    lua_pushinteger(L, work);
+    lua_setfield(L, -2, "work");
+  } else {
+    lua_createtable(L, num_items, 1);
+    for (k = 1; k <= num_items; ++k) {
+      lua_rawgeti(L, data, k);
+      lua_rawseti(L, -2, k);
+    }
+    lua_pushnumber(L, num_items);
+    lua_setfield(L, -2, "n");
+  }
+      // stack = [.., history, checkpoints, checkpoint]
+  lua_rawseti(L, -2, c);
+  lua_pop(L, 2);
+      // stack = [..]
+}
+
+// This drops the oldest steps of demo_state's history, if needed to keep at
+// most options.max_history of them.
+static void drop_old_steps(lua_State *L, FakeLuaState *demo_state, int data) {
+  int new_first = demo_state->step - options.max_history;
+  if (options.max_history <= 0 || new_first <= demo_state->first_step) return;
+      // stack = [..]
+  push_data_table(L, data, "history");
+  push_data_table(L, data, "checkpoints");
+  push_data_table(L, data, "calls");
+      // stack = [.., history, checkpoints, calls]
+  int k;
+  for (k = demo_state->first_step + 1; k <= new_first; ++k) {
+    lua_pushnil(L);
+    lua_rawseti(L, -4, k);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, k);
+  }
+  for (k = demo_state->first_step / checkpoint_period;
+       k * checkpoint_period < new_first; ++k) {
+    lua_pushnil(L);
+    lua_rawseti(L, -3, k);
+  }
+  lua_pop(L, 3);
+      // stack = [..]
+  demo_state->first_step = new_first;
+}
+
+// This replaces the saved items after the first keep with the n values at
+// stack[first..], and records the change as the next step in the history.
+static void save_items(lua_State *L, FakeLuaState *demo_state, int data,
+                       int keep, int first, int n) {
+  drop_redo_steps(L, demo_state, data);
+  if (demo_state->fingerprint_valid > keep) {
+    demo_state->fingerprint_valid = keep;
+  }
+  int step = ++demo_state->step;
+  demo_state->num_steps = step;
+  if (call_record_ref != LUA_NOREF) save_call_record(L, data, step, keep + n);
+
+  lua_getfield(L, data, "num_items");
+  int num_before = lua_tointeger(L, -1) - keep;
+  lua_pop(L, 1);
+  luaL_checkstack(L, 4, "stack too big to save");
+  if (flight && flight_call) {
+    flight_end(L, data, keep + num_before, keep, first, n);
+  }
+  if (observe_level) observe_stack(L, data, keep, num_before, first, n);
+
+  // Find the top items that are the same before and after, such as all but
+  // one after lua_remove, so that they needn't be stored.
+  int moved = 0;
+  while (moved < num_before && moved < n) {
+    lua_rawgeti(L, data, keep + num_before - moved);
+    int is_same = lua_rawequal(L, -1, first + n - 1 - moved);
+    lua_pop(L, 1);
+    if (!is_same) break;
+    moved++;
+  }
+  int num_changed = num_before - moved, num_new = n - moved;
+      // stack = [..]
+  push_data_table(L, data, "history");
+      // stack = [.., history]
+  if (num_changed == 0 && num_new == 0) {
+    lua_pushboolean(L, 1);
+  } else {
+    lua_createtable(L, 4 + num_changed + num_new, 0);
+        // stack = [.., history, change]
+    lua_pushnumber(L, keep);
+    lua_rawseti(L, -2, 1);
+    lua_pushnumber(L, num_changed);
+    lua_rawseti(L, -2, 2);
+    lua_pushnumber(L, num_new);
+    lua_rawseti(L, -2, 3);
+    lua_pushnumber(L, moved);
+    lua_rawseti(L, -2, 4);
+    int k;
+    for (k = 1; k <= num_changed; ++k) {
+      lua_rawgeti(L, data, keep + k);
+      lua_rawseti(L, -2, 4 + k);
+    }
+    for (k = 1; k <= num_new; ++k) {
+      lua_pushvalue(L, first + k - 1);
+      lua_rawseti(L, -2, 4 + num_changed + k);
+    }
+  }
+      // stack = [.., history, change]
+  lua_rawseti(L, -2, step);
+  lua_pop(L, 1);
+      // stack = [..]
+  if (num_before == n) {
+    int k;
+    for (k = 0; k < num_new; ++k) {
+      lua_pushvalue(L, first + k);
+      lua_rawseti(L, data, keep + 1 + k);
+    }
+  } else {
+    set_items(L, data, keep + 1, first, n);
+  }
+
+  if (step % checkpoint_period == 0) {
+    save_checkpoint(L, demo_state, data, keep + n);
+  }
+  drop_old_steps(L, demo_state, data);
+}
+
+// This moves demo_state from its current step to the next one, if forward is
+// true, or to the previous one otherwise.
+static void apply_step(lua_State *L, FakeLuaState *demo_state, int data,
+                       int forward) {
+  int step = demo_state->step + (forward ? 1 : 0);
+  int top = lua_gettop(L);
+      // stack = [..]
+  push_data_table(L, data, "history");
+  lua_rawgeti(L, -1, step);
+  lua_remove(L, -2);
+      // stack = [.., change]
+  if (lua_istable(L, -1)) {
+    int change = lua_gettop(L);
+    int v[4], k;
+    for (k = 0; k < 4; ++k) {
+      lua_rawgeti(L, change, k + 1);
+      v[k] = lua_tointeger(L, -1);
+      lua_pop(L, 1);
+    }
+    int keep = v[0], num_before = v[1], num_after = v[2], moved = v[3];
+    int offset = 4 + (forward ? num_before : 0);
+    int n = (forward ? num_after : num_before);
+    int old_n = (forward ? num_before : num_after);
+    move_items(L, data, keep + old_n + 1, keep + n + 1, moved);
+    for (k = 1; k <= n; ++k) {
+      lua_rawgeti(L, change, offset + k);
+      lua_rawseti(L, data, keep + k);
+    }
+    set_num_items(L, data, keep + n + moved);
+    if (demo_state->fingerprint_valid > keep) {
+      demo_state->fingerprint_valid = keep;
+    }
+  }
+  lua_settop(L, top);
+      // stack = [..]
+  demo_state->step += (forward ? 1 : -1);
+}
+
+// This moves demo_state to the given step, which must be in its history. It
+// replays steps starting either from the current step or from the full
+// checkpoint that the target's checkpoint is reached from, whichever is closer.
+static void seek_step(lua_State *L, FakeLuaState *demo_state, int data,
+                      int target) {
+  int work;
+  int base = find_checkpoint(L, demo_state, data, target / checkpoint_period,
+                             &work);
+  int distance = target - demo_state->step;
+  if (distance < 0) distance = -distance;
+  if (base >= 0 && target - base * checkpoint_period < distance) {
+    int top = lua_gettop(L);
+        // stack = [..]
+    if (base == 0) {
+      set_num_items(L, data, 0);  // Step 0 is always an empty stack.
+    } else {
+      push_data_table(L, data, "checkpoints");
+      lua_rawgeti(L, -1, base);
+          // stack = [.., checkpoints, checkpoint]
+      lua_getfield(L, -1, "n");
+      int n = lua_tointeger(L, -1);
+      lua_pop(L, 1);
+      copy_items(L, data, 1, top + 2, 1, n);
+    }
+    lua_settop(L, top);
+        // stack = [..]
+    demo_state->step = base * checkpoint_period;
+    demo_state->fingerprint_valid = 0;
+  }
+  while (demo_state->step < target) apply_step(L, demo_state, data, 1);
+  while (demo_state->step > target) apply_step(L, demo_state, data, 0);
+}
+
+
+// ## Functions for loading and saving demo Lua states.
+
+// This loads the states table onto the top of the stack.
+// It creates the table and sets it in the registry if it doesn't exist yet.
+static void load_states_table(lua_State *L) {
+  // The states table is stored in the registry with key states_table_key.
+  // The registory is a table located at the pseudo-index LUA_REGISTRYINDEX.
+      // stack = [..]
+  lua_getfield(L, LUA_REGISTRYINDEX, states_table_key);
+      // stack = [.., states_table | nil]
+  if (lua_isnil(L, -1)) {  // The table doesn't exist yet, so let's create it.
+      // stack = [.., nil]
+    lua_pop(L, 1);
+      // stack = [..]
+    lua_newtable(L);
+      // stack = [.., states_table = {}]
+    lua_pushvalue(L, -1);
+      // stack = [.., states_table, states_table]
+    lua_setfield(L, LUA_REGISTRYINDEX, states_table_key);
+  }
+      // stack = [.., states_table]
+}
+
+// This prints the saved stack of a state that isn't currently loaded.
+static void print_saved_stack(lua_State *L, FakeLuaState *demo_state) {
+      // stack = [..]
+  load_states_table(L);
+      // stack = [.., states_table]
+  lua_rawgeti(L, -1, demo_state->ref);
+      // stack = [.., states_table, demo_state_data]
+  lua_remove(L, -2);
+      // stack = [.., demo_state_data]
+  lua_getfield(L, -1, "num_items");
+  int num_items = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  luaL_checkstack(L, num_items + LUA_MINSTACK, "stack too big to print");
+  int first = lua_gettop(L) + 1;
+  int k;
+  for (k = 1; k <= num_items; ++k) {
+    lua_rawgeti(L, first - 1, k);
+  }
+      // stack = [.., demo_state_data, <saved stack>]
+  print_items(L, demo_state, first, num_items);
+  out("\n");
+  lua_settop(L, first - 2);
+      // stack = [..]
+}
+
+// This returns how many of the items at stack[1..n] are the same as the saved
+// items in the table at stack[data], counting up from the bottom.
+static int count_unchanged(lua_State *L, int data, int n) {
+  lua_getfield(L, data, "num_items");
+  int num_items = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  int keep;
+  for (keep = 0; keep < n && keep < num_items; ++keep) {
+    lua_rawgeti(L, data, keep + 1);
+    int is_same = lua_rawequal(L, -1, keep + 1);
+    lua_pop(L, 1);
+    if (!is_same) break;
+  }
+  return keep;
+}
+
+// This is luaL_checkudata for demo states, which also makes sure the state
+// hasn't been closed.
+static FakeLuaState *check_demo_state(lua_State *L, int i) {
+  FakeLuaState *demo_state =
+      (FakeLuaState *)luaL_checkudata(L, i, demo_state_metatable);
+  if (demo_state->ref == LUA_NOREF) {
+    luaL_argerror(L, i, "this lua_State has been closed");
+  }
+  return demo_state;
+}
+
+// This raises an error if demo_state is waiting for an async chunk.
+static void check_not_busy(lua_State *L, FakeLuaState *demo_state) {
+  if (demo_state->job) {
+    luaL_error(L, "this state is running an async chunk; await it first");
+  }
+}
+
+static void load_state(lua_State *L, FakeLuaState *demo_state) {
+
+  check_not_busy(L, demo_state);
+
+  // Code run by a call on this state, such as the function given to lua_call,
+  // can't make calls on it too, as the outer call would save over them.
+  if (demo_state->is_loaded) {
+    luaL_error(L, "this lua_State is in use by a call that hasn't returned; "
+                  "code it runs can't make calls on it");
+  }
+
+  // We expect every load_state to be paired by a following save_state call.
+  // If that expectation is not met, this assert may be triggered.
+  assert(current_state == NULL);
+
+  // Clear the stack and load the states table.
+  lua_settop(L, 0);
+      // stack = []
+  load_states_table(L);
+      // stack = [states_table]
+
+  // Load the table for this demo_state.
+  lua_rawgeti(L, 1, demo_state->ref);
+      // stack = [states_table, demo_state_data]
+  lua_remove(L, 1);
+      // stack = [demo_state_data]
+
+  // Load the state.
+  lua_getfield(L, 1, "num_items");
+      // stack = [demo_state_data, num_items]
+  assert(lua_isnumber(L, 2));
+  int num_items = lua_tointeger(L, 2);
+  lua_pop(L, 1);
+  // Move the saved stack over load_chunk_size items at a time, making room for
+  // each chunk as we go, so that the host stack grows by doubling as a deep
+  // stack is loaded instead of by the whole stack's size at once. There must
+  // also be room for the LUA_MINSTACK free slots the C API promises each
+  // call. The host can't grow past LUAI_MAXCSTACK slots in Lua 5.1, or
+  // LUAI_MAXSTACK in later versions.
+  int k = 1;
+  while (k <= num_items) {
+      // stack = [demo_state_data, <first k-1 items of saved stack>]
+    int end = (num_items - k < load_chunk_size ? num_items
+                                               : k + load_chunk_size - 1);
+    if (!lua_checkstack(L, end - k + 1 + LUA_MINSTACK)) {
+      lua_settop(L, 0);
+      luaL_error(L, "stack overflow (demo stack too big to load)");
+    }
+    for (; k <= end; ++k) lua_rawgeti(L, 1, k);
+  }
+      // stack = [demo_state_data, <loaded state>]
+  int room = demo_state->checked_top - num_items;
+  if (room < LUA_MINSTACK) room = LUA_MINSTACK;
+  if (!lua_checkstack(L, room)) {
+    lua_settop(L, 0);
+    luaL_error(L, "stack overflow (demo stack too big to load)");
+  }
+  lua_remove(L, 1);
+      // stack = [<loaded state>]
+
+  // Set the current_state for later use.
+  current_state = demo_state;
+  unchanged_n   = -1;
+  demo_state->is_loaded           = 1;
+  demo_state->at_load.buffer      = demo_state->buffer;
+  demo_state->at_load.is_started  = demo_state->is_started;
+  demo_state->at_load.checked_top = demo_state->checked_top;
+  if (running_kind == call_may_run_code) demo_state->code_runs++;
+  lint_before_call(L);
+  start_measuring(L);
+}
+
+// This function uses the global current_state as a save location.
+// This can work because Lua is single threaded.
+static void save_state(lua_State *L, int omit) {
+
+  stop_measuring(L);
+
+  // Refuse a stack that load_state couldn't make room for again. This also
+  // gives the pushes below room, as the call may have used up the free slots.
+  luaL_checkstack(L, 1 + LUA_MINSTACK, "demo stack too big to save");
+
+  // Load the states table.
+      // stack = [<state_to_save>]
+  load_states_table(L);
+      // stack = [<state_to_save>, states_table]
+
+  // Load the table for this demo_state (in current_state).
+  lua_rawgeti(L, -1, current_state->ref);
+      // stack = [<state_to_save>, states_table, demo_state_data]
+  lua_remove(L, -2);
+      // stack = [<state_to_save>, demo_state_data]
+
+  int num_items = lua_gettop(L) - 1 - omit;
+  assert(num_items + omit >= 0);
+  if (num_items < 0) num_items = 0;  // The omit value may have been high.
+
+  // Find how many items at the bottom of the stack are unchanged, unless
+  // print_diff just did.
+  int data = lua_gettop(L);
+  int keep = (unchanged_state == current_state && unchanged_n == num_items)
+                 ? unchanged_count
+                 : count_unchanged(L, data, num_items);
+  unchanged_n = -1;
+  save_items(L, current_state, data, keep, keep + 1, num_items - keep);
+      // stack = [<state_to_save>, demo_state_data]
+  lua_pop(L, 1);
+      // stack = [<state_to_save>]
+
+  // Clear current_state.
+  current_state->is_loaded = 0;
+  current_state = NULL;
+}
+
+// ## Running Lua code: the profiler and budgets.
+
+// The code run by lua_call, lua_pcall, luaL_dostring and luaL_dofile on a demo
+// state can be profiled, and limited by a budget, with one count hook.
+
+// ### The sampling profiler.
+
+// While a profiled call runs, a count hook samples the Lua call stack. Each
+// sample is recorded as a folded stack -- frames from the root down, joined by
+// semicolons -- in the "profile" table of the demo state's data, mapping each
+// folded stack to its number of samples. This is the input format expected by
+// flame graph tools.
+
+// This appends a label for the function running at the given level.
+static void add_frame_label(lua_State *L, luaL_Buffer *b, int level) {
+  char label[LUA_IDSIZE + 64];
+  lua_Debug ar;
+  lua_getstack(L, level, &ar);
+  lua_getinfo(L, "Sln", &ar);
+  if (*ar.what == 'C') {
+    snprintf(label, sizeof(label), "%s [C]", ar.name ? ar.name : "?");
+  } else if (*ar.what == 't') {  // Lua 5.1 marks lost tail-call frames.
+    snprintf(label, sizeof(label), "(tail call)");
+  } else if (*ar.what == 'm') {
+    snprintf(label, sizeof(label), "main chunk (%s:%d)",
+             ar.short_src, ar.currentline);
+  } else {
+    snprintf(label, sizeof(label), "%s (%s:%d)",
+             ar.name ? ar.name : "?", ar.short_src, ar.currentline);
+  }
+  luaL_addstring(b, label);
+}
+
+static void profile_sample(lua_State *L) {
+  // Only sample frames that are inside the profiled call.
+  lua_Debug ar;
+  int depth = 0;
+  while (lua_getstack(L, depth, &ar)) ++depth;
+  if (L == run.thread) depth -= run.profile_base_depth;
+  if (depth <= 0) return;
+
+      // stack = [..]
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  int level;
+  for (level = depth - 1; level >= 0; --level) {
+    add_frame_label(L, &b, level);
+    if (level > 0) luaL_addchar(&b, ';');
+  }
+  luaL_pushresult(&b);
+      // stack = [.., folded_stack]
+  lua_rawgeti(L, LUA_REGISTRYINDEX, run.counts_ref);
+      // stack = [.., folded_stack, counts]
+  lua_pushvalue(L, -2);
+  lua_pushvalue(L, -1);
+      // stack = [.., folded_stack, counts, folded_stack, folded_stack]
+  lua_rawget(L, -3);
+      // stack = [.., folded_stack, counts, folded_stack, old_count]
+  lua_Number count = lua_tonumber(L, -1) + 1;
+  lua_pop(L, 1);
+  lua_pushnumber(L, count);
+  lua_rawset(L, -3);
+      // stack = [.., folded_stack, counts]
+  lua_pop(L, 2);
+      // stack = [..]
+}
+
+// ### Budgets.
+
+// A budget, set by apidemo.budget, limits the instructions, memory and wall
+// time of each call that runs Lua code. Instructions and time are checked by
+// run_hook, at most every budget_period instructions, and memory by
+// counting_alloc with run_hook's help. Going over raises an ordinary error,
+// so lua_pcall and the luaL_do* calls return it as a status like any other,
+// and the state is left as it would be after that error. The code can catch
+// the error with pcall, but from then on run_hook raises it again at every
+// instruction, so it can only get as far as the end of the call.
+
+// On Windows, clock() already measures wall time.
+static double wall_seconds(void) {
+#ifdef _WIN32
+  return (double)clock() / CLOCKS_PER_SEC;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+// This is run_hook's half of the memory budget described at counting_alloc:
+// it collects all garbage, measures what the running code has added to the
+// host's live bytes, and goes over budget if that's too much. Otherwise the
+// hook goes back to what it was before counting_alloc asked for this.
+static void check_live_bytes(lua_State *L) {
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  MemStats now;
+  read_mem_stats(L, &now);
+  run.gc_due = 0;
+  double growth = (double)(now.allocated - now.freed) - run.live_base -
+                  run.excluded;
+  run.known_live = (growth > 0 ? growth : 0);
+  if (growth > (double)run.max_bytes) {
+    go_over_budget("memory budget of %f bytes exceeded",
+                   (lua_Number)run.max_bytes);
+  } else if (run.period) {
+    lua_sethook(run.thread, run_hook, LUA_MASKCOUNT, run.period);
+  } else {
+    lua_sethook(run.thread, run.old_hook, run.old_mask, run.old_count);
+    run.is_hooked = 0;
+  }
+}
+
+static void run_hook(lua_State *L, lua_Debug *hook_ar) {
+  (void)hook_ar;
+  // Coroutines made by the code keep the hook after the call is over.
+  if (!run.is_running) return;
+
+  if (run.gc_due && run.over_msg == NULL) {
+    check_live_bytes(L);
+    if (run.over_msg == NULL) return;
+  }
+  if (run.over_msg == NULL) {
+    if (run.counts_ref != LUA_NOREF &&
+        (run.profile_left -= run.period) <= 0) {
+      run.profile_left += run.profile_period;
+      profile_sample(L);
+    }
+    run.instructions += run.period;
+    if (run.max_instructions && run.instructions >= run.max_instructions) {
+      go_over_budget("instruction budget of %f exceeded",
+                     (lua_Number)run.max_instructions);
+    } else if (run.deadline && wall_seconds() > run.deadline) {
+      go_over_budget("time budget of %f seconds exceeded", run.max_seconds);
+    }
+    if (run.over_msg == NULL) return;
+  }
+
+  // luaL_error's level 1 would be the caller of the running function, since a
+  // hook has no frame of its own.
+  luaL_where(L, 0);
+  lua_pushfstring(L, run.over_msg, run.over_limit);
+  lua_concat(L, 2);
+  lua_error(L);
+}
+
+// This notes that the running code has gone over a limit, and has run_hook
+// raise msg at every instruction from now on. It doesn't allocate, so
+// counting_alloc can call it.
+static void go_over_budget(const char *msg, lua_Number limit) {
+  if (run.over_msg) return;
+  run.over_msg   = msg;
+  run.over_limit = limit;
+  lua_sethook(run.thread, run_hook, LUA_MASKCOUNT, 1);
+  run.is_hooked  = 1;
+}
+
+// ### Starting and stopping.
+
+// This sets up the profiler and budget of current_state, if it has either,
+// for the code it's about to run. It remembers any hook already installed so
+// stop_running can put it back, even if only go_over_budget installs ours.
+static void start_running(lua_State *L) {
+  FakeLuaState *demo_state = current_state;
+  RunSettings  *settings   = &demo_state->settings;
+  if (settings->profile_period <= 0 && !settings->max_instructions &&
+      !settings->max_seconds && !settings->max_bytes) {
+    return;
+  }
+  run_starts++;
+  run.is_running       = 1;
+  run.is_hooked        = 0;
+  run.counts_ref       = LUA_NOREF;
+  run.instructions     = 0;
+  run.max_instructions = settings->max_instructions;
+  run.max_seconds      = settings->max_seconds;
+  run.deadline         = 0;
+  run.max_bytes        = settings->max_bytes;
+  run.state            = demo_state;
+  run.excluded         = 0;
+  run.known_live       = 0;
+  run.gc_due           = 0;
+  run.bytes_refused    = 0;
+  run.over_msg         = NULL;
+  run.period           = 0;
+  run.thread           = L;
+  run.old_hook         = lua_gethook(L);
+  run.old_mask         = lua_gethookmask(L);
+  run.old_count        = lua_gethookcount(L);
+
+  if (settings->profile_period > 0) {
+        // stack = [..]
+    load_states_table(L);
+    lua_rawgeti(L, -1, demo_state->ref);
+        // stack = [.., states_table, demo_state_data]
+    lua_getfield(L, -1, "profile");
+        // stack = [.., states_table, demo_state_data, counts]
+    run.counts_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 2);
+        // stack = [..]
+
+    lua_Debug ar;
+    run.profile_base_depth = 0;
+    while (lua_getstack(L, run.profile_base_depth, &ar)) {
+      ++run.profile_base_depth;
+    }
+    run.profile_period = settings->profile_period;
+    run.profile_left   = run.profile_period;
+    run.period         = run.profile_period;
+  }
+  if (run.max_instructions || run.max_seconds) {
+    int period = budget_period;
+    if (run.max_instructions && run.max_instructions < period) {
+      period = (int)run.max_instructions;
+    }
+    if (run.period == 0 || period < run.period) run.period = period;
+  }
+  if (run.max_seconds) run.deadline = wall_seconds() + run.max_seconds;
+  if (run.max_bytes) {
+    MemStats now;
+    read_mem_stats(L, &now);
+    run.live_base = (double)(now.allocated - now.freed);
+  }
+
+  if (run.period) {
+    lua_sethook(L, run_hook, LUA_MASKCOUNT, run.period);
+    run.is_hooked = 1;
+  }
+}
+
+// This undoes start_running. If the code failed, with status, because it went
+// over its memory budget, the error message at the top of the stack is
+// reworded to say so.
+static void stop_running(lua_State *L, int status) {
+  if (!run.is_running) return;
+  run.is_running     = 0;
+  if (run.is_hooked) lua_sethook(L, run.old_hook, run.old_mask, run.old_count);
+  if (run.counts_ref != LUA_NOREF) {
+    luaL_unref(L, LUA_REGISTRYINDEX, run.counts_ref);
+    run.counts_ref = LUA_NOREF;
+  }
+  const char *msg = status ? lua_tostring(L, -1) : NULL;
+  if (run.bytes_refused && msg && strcmp(msg, "not enough memory") == 0) {
+    lua_pop(L, 1);
+    lua_pushfstring(L, "memory budget of %f bytes exceeded",
+                    (lua_Number)run.max_bytes);
+  }
+}
+
+
+// ## The compiled-chunk cache.
+
+// With options.cache_chunks set, the luaL_load* and luaL_do* wrappers keep the
+// code they compile as lua_dump bytecode, so loading the same code again only
+// has to undump it rather than parse and compile it. Code strings are keyed by
+// their text -- Lua hashes it for us -- and files by their path, with a stamp
+// of the file's mtime, size and inode, and the Lua release, to notice edits.
+// The cache is the registry table {entries = {[key] = entry}, num_bytes = n,
+// clock = n}, where each entry is {bytecode = b, stamp = s, last_use = n}.
+//
+// If a directory is given with set_options{chunk_cache_dir = ...}, compiled
+// files are also written there, named by hashes of the path and the stamp, so
+// the cache survives between runs. Bytecode that won't load, such as a file
+// cut short, is dropped and the source compiled again.
+//
+// Lua doesn't verify bytecode, and loading a crafted chunk can crash the host
+// or worse, so the directory must belong to this process's user and be
+// writable by no one else, and only binary chunks are loaded from the cache.
+
+static int dump_writer(lua_State *L, const void *p, size_t size, void *ud) {
+  (void)L;
+  luaL_addlstring((luaL_Buffer *)ud, (const char *)p, size);
+  return 0;
+}
+
+// This pushes the bytecode for the function on top of the stack.
+static void push_bytecode(lua_State *L) {
+      // stack = [.., fn]
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+#if LUA_VERSION_NUM >= 503
+  lua_dump(L, dump_writer, &b, 0);  // 0 --> strip
+#else
+  lua_dump(L, dump_writer, &b);
+#endif
+  luaL_pushresult(&b);
+      // stack = [.., fn, bytecode]
+}
+
+// This returns the 64-bit FNV-1a hash of s.
+static uint64_t fnv1a(const char *s) {
+  uint64_t h = 14695981039346656037ULL;
+  for (; *s; ++s) h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+  return h;
+}
+
+// This returns whether dir is a directory that no user other than this
+// process's effective one can write to.
+static int is_private_dir(const char *dir) {
+  struct stat info;
+  if (stat(dir, &info) != 0 || !(info.st_mode & S_IFDIR)) return 0;
+#ifdef _WIN32
+  return 1;
+#else
+  return info.st_uid == geteuid() && !(info.st_mode & (S_IWGRP | S_IWOTH));
+#endif
+}
+
+// This fills path with the disk cache's file name for the file filename
+// with the given stamp, and returns false if there's no cache directory, or
+// it has stopped being private since it was set.
+static int get_disk_path(lua_State *L, const char *filename, const char *stamp,
+                         char *path, size_t path_size) {
+      // stack = [..]
+  lua_getfield(L, LUA_REGISTRYINDEX, chunk_cache_dir_key);
+  const char *dir = lua_tostring(L, -1);
+  if (dir && !is_private_dir(dir)) dir = NULL;
+  if (dir) {
+    snprintf(path, path_size, "%s/%016llx-%016llx.luac", dir,
+             (unsigned long long)fnv1a(filename),
+             (unsigned long long)fnv1a(stamp));
+  }
+  lua_pop(L, 1);
+      // stack = [..]
+  return dir != NULL;
+}
+
+// This pushes the contents of the file at path, or returns false if it can't
+// be read.
+static int push_file_contents(lua_State *L, const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) return 0;
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  size_t n;
+  do {
+    char *p = luaL_prepbuffer(&b);
+    n = fread(p, 1, LUAL_BUFFERSIZE, f);
+    luaL_addsize(&b, n);
+  } while (n == LUAL_BUFFERSIZE);
+  int is_ok = !ferror(f);
+  fclose(f);
+  luaL_pushresult(&b);
+  if (!is_ok) lua_pop(L, 1);
+  return is_ok;
+}
+
+// This writes bytecode to the disk cache at path. It goes to a new file first,
+// which is then renamed, so that a run reading the cache, or a second writer,
+// never sees a partly written chunk.
+static void write_disk_chunk(const char *path, const char *bytecode,
+                             size_t len) {
+  char temp_path[1040];
+#ifdef _WIN32
+  snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, _getpid());
+  FILE *f = fopen(temp_path, "wb");
+#else
+  snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+  int fd = mkstemp(temp_path);
+  FILE *f = (fd < 0) ? NULL : fdopen(fd, "wb");
+  if (fd >= 0 && f == NULL) close(fd);
+  if (fd < 0) return;
+#endif
+  int is_ok = (f != NULL && fwrite(bytecode, 1, len, f) == len);
+  if (f && fclose(f) != 0) is_ok = 0;
+  if (is_ok && rename(temp_path, path) == 0) {
+    chunk_disk_writes++;
+  } else {
+    remove(temp_path);
+  }
+}
+
+// This pushes the cache table, creating it if needed.
+static void push_chunk_cache(lua_State *L) {
+      // stack = [..]
+  lua_getfield(L, LUA_REGISTRYINDEX, chunk_cache_key);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_createtable(L, 0, 3);
+    lua_newtable(L);
+    lua_setfield(L, -2, "entries");
+    lua_pushnumber(L, 0);
+    lua_setfield(L, -2, "num_bytes");
+    lua_pushnumber(L, 0);
+    lua_setfield(L, -2, "clock");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, chunk_cache_key);
+  }
+      // stack = [.., cache]
+}
+
+// This adds delta to cache[name], where cache is at stack[cache], and returns
+// the new value.
+static lua_Number add_to_field(lua_State *L, int cache, const char *name,
+                               lua_Number delta) {
+  lua_getfield(L, cache, name);
+  lua_Number value = lua_tonumber(L, -1) + delta;
+  lua_pop(L, 1);
+  lua_pushnumber(L, value);
+  lua_setfield(L, cache, name);
+  return value;
+}
+
+// This drops the entry at the key on top of the stack, which it pops, from the
+// cache at stack[cache].
+static void drop_cached_chunk(lua_State *L, int cache) {
+      // stack = [.., key]
+  lua_getfield(L, cache, "entries");
+  lua_pushvalue(L, -2);
+  lua_rawget(L, -2);
+      // stack = [.., key, entries, entry | nil]
+  if (lua_istable(L, -1)) {
+    size_t len, key_len;
+    lua_getfield(L, -1, "bytecode");
+    lua_tolstring(L, -1, &len);
+    lua_tolstring(L, -4, &key_len);
+    add_to_field(L, cache, "num_bytes", -(lua_Number)(len + key_len));
+    lua_pop(L, 1);
+    lua_pushvalue(L, -3);
+    lua_pushnil(L);
+    lua_rawset(L, -4);
+  }
+  lua_pop(L, 3);
+      // stack = [..]
+}
+
+// This pushes the cached bytecode for key, if it's there with the given stamp,
+// and returns whether it did.
+static int push_cached_chunk(lua_State *L, const char *key,
+                             const char *stamp) {
+      // stack = [..]
+  push_chunk_cache(L);
+  lua_getfield(L, -1, "entries");
+  lua_getfield(L, -1, key);
+      // stack = [.., cache, entries, entry | nil]
+  int is_hit = 0;
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "stamp");
+    is_hit = (strcmp(lua_tostring(L, -1), stamp) == 0);
+    lua_pop(L, 1);
+  }
+  if (is_hit) {
+    lua_pushnumber(L, add_to_field(L, lua_gettop(L) - 2, "clock", 1));
+    lua_setfield(L, -2, "last_use");
+    lua_getfield(L, -1, "bytecode");
+    lua_replace(L, -4);
+    lua_pop(L, 2);
+        // stack = [.., bytecode]
+  } else {
+    lua_pop(L, 3);
+        // stack = [..]
+  }
+  return is_hit;
+}
+
+// This caches the bytecode on top of the stack under key. If that would take
+// the cache over max_chunk_cache_bytes, the older half of its chunks, by when
+// they were last used, is dropped first, so that a full cache isn't scanned on
+// every miss. Bytecode too big to ever fit isn't cached.
+static void save_cached_chunk(lua_State *L, const char *key,
+                              const char *stamp) {
+      // stack = [.., bytecode]
+  size_t len;
+  lua_tolstring(L, -1, &len);
+  len += strlen(key);
+  push_chunk_cache(L);
+  int cache = lua_gettop(L);
+  lua_pushstring(L, key);
+  drop_cached_chunk(L, cache);
+  if (len > max_chunk_cache_bytes) {
+    lua_pop(L, 1);
+    return;
+  }
+  lua_getfield(L, cache, "entries");
+      // stack = [.., bytecode, cache, entries]
+  lua_getfield(L, cache, "num_bytes");
+  lua_getfield(L, cache, "clock");
+  lua_Number num_bytes = lua_tonumber(L, -2), clock = lua_tonumber(L, -1);
+  lua_pop(L, 2);
+  while (num_bytes + len > max_chunk_cache_bytes && num_bytes > 0) {
+    lua_Number oldest = clock;
+    lua_pushnil(L);
+    while (lua_next(L, cache + 1)) {
+          // stack = [.., entries, key, entry]
+      lua_getfield(L, -1, "last_use");
+      if (lua_tonumber(L, -1) < oldest) oldest = lua_tonumber(L, -1);
+      lua_pop(L, 2);
+    }
+    lua_Number cutoff = oldest + (clock - oldest) / 2;
+    lua_pushnil(L);
+    while (lua_next(L, cache + 1)) {
+      lua_getfield(L, -1, "last_use");
+      int is_old = (lua_tonumber(L, -1) <= cutoff);
+      lua_pop(L, 2);
+          // stack = [.., entries, key]
+      if (is_old) {
+        lua_pushvalue(L, -1);
+        drop_cached_chunk(L, cache);  // Clearing a field is safe in lua_next.
+      }
+    }
+    lua_getfield(L, cache, "num_bytes");
+    num_bytes = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+  }
+  lua_createtable(L, 0, 3);
+      // stack = [.., bytecode, cache, entries, entry]
+  lua_pushvalue(L, cache - 1);
+  lua_setfield(L, -2, "bytecode");
+  lua_pushstring(L, stamp);
+  lua_setfield(L, -2, "stamp");
+  lua_pushnumber(L, add_to_field(L, cache, "clock", 1));
+  lua_setfield(L, -2, "last_use");
+  lua_setfield(L, -2, key);
+  add_to_field(L, cache, "num_bytes", (lua_Number)len);
+  lua_pop(L, 2);
+      // stack = [.., bytecode]
+}
+
+// This loads the bytecode on top of the stack, replacing it with the compiled
+// function, and returns true, or pops it and returns false if it won't load.
+// Anything but a binary chunk, such as source put in the disk cache, is
+// refused.
+static int load_bytecode(lua_State *L, const char *chunkname) {
+      // stack = [.., bytecode]
+  size_t len;
+  const char *bytecode = lua_tolstring(L, -1, &len);
+#if LUA_VERSION_NUM == 501
+  size_t sig_len = strlen(LUA_SIGNATURE);
+  if (len < sig_len || memcmp(bytecode, LUA_SIGNATURE, sig_len) != 0) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  int status = luaL_loadbuffer(L, bytecode, len, chunkname);
+#else
+  int status = luaL_loadbufferx(L, bytecode, len, chunkname, "b");
+#endif
+  lua_remove(L, -2);
+      // stack = [.., fn | errmsg]
+  if (status) lua_pop(L, 1);
+  return status == 0;
+}
+
+// This is luaL_loadstring, using the cache.
+static int load_cached_string(lua_State *L, const char *code) {
+  if (!options.cache_chunks) return luaL_loadstring(L, code);
+  if (push_cached_chunk(L, code, "")) {
+    if (load_bytecode(L, code)) {
+      chunk_hits++;
+      chunk_note = "hit";
+      return 0;
+    }
+    push_chunk_cache(L);
+    lua_pushstring(L, code);
+    drop_cached_chunk(L, lua_gettop(L) - 1);
+    lua_pop(L, 1);
+  }
+  chunk_misses++;
+  chunk_note = "miss";
+  int status = luaL_loadstring(L, code);
+  if (status) return status;
+      // stack = [.., fn]
+  push_bytecode(L);
+  save_cached_chunk(L, code, "");
+  lua_pop(L, 1);
+      // stack = [.., fn]
+  return status;
+}
+
+// This is luaL_loadfile, using the cache in memory and then any on disk.
+static int load_cached_file(lua_State *L, const char *filename) {
+  struct stat info;
+  if (!options.cache_chunks || stat(filename, &info) != 0) {
+    return luaL_loadfile(L, filename);
+  }
+  char stamp[128];
+  snprintf(stamp, sizeof(stamp), "%lld %lld %llu %s",
+           (long long)info.st_mtime, (long long)info.st_size,
+           (unsigned long long)info.st_ino, LUA_RELEASE);
+  lua_pushfstring(L, "@%s", filename);
+  const char *chunkname = lua_tostring(L, -1);
+      // stack = [.., chunkname]
+  char path[1024];
+  int has_disk = get_disk_path(L, filename, stamp, path, sizeof(path));
+  if (push_cached_chunk(L, chunkname, stamp)) {
+    if (load_bytecode(L, chunkname)) {
+      chunk_hits++;
+      chunk_note = "hit";
+      lua_remove(L, -2);
+      return 0;
+    }
+    push_chunk_cache(L);
+    lua_pushvalue(L, -2);
+    drop_cached_chunk(L, lua_gettop(L) - 1);
+    lua_pop(L, 1);
+  }
+      // stack = [.., chunkname]
+  if (has_disk && push_file_contents(L, path)) {
+    lua_pushvalue(L, -1);
+        // stack = [.., chunkname, bytecode, bytecode]
+    if (load_bytecode(L, chunkname)) {
+      chunk_disk_hits++;
+      chunk_note = "disk hit";
+      lua_insert(L, -2);
+      save_cached_chunk(L, chunkname, stamp);
+      lua_pop(L, 1);
+      lua_remove(L, -2);
+      return 0;
+    }
+    lua_pop(L, 1);
+    remove(path);
+  }
+  chunk_misses++;
+  chunk_note = "miss";
+  int status = luaL_loadfile(L, filename);
+  if (status == 0) {
+        // stack = [.., chunkname, fn]
+    push_bytecode(L);
+    save_cached_chunk(L, chunkname, stamp);
+    if (has_disk) {
+      size_t len;
+      const char *bytecode = lua_tolstring(L, -1, &len);
+      write_disk_chunk(path, bytecode, len);
+    }
+    lua_pop(L, 1);
+  }
+      // stack = [.., chunkname, fn | errmsg]
+  lua_remove(L, -2);
+  return status;
+}
+
+
+// ## The warm pool of demo states.
+
+// apidemo.pool{size = n, init = fn} keeps n demo states that have already had
+// init(L) run on them, so that luaL_newstate can hand one out rather than
+// waiting for init. After init, each state's stack is copied, to any depth,
+// into data.pool_snapshot. lua_close retires the state it's given -- later
+// calls on that handle raise an error -- and puts a new state in the pool,
+// which gets a fresh copy of the snapshot as its stack when luaL_newstate
+// takes it out. So nothing one user does to a state, or to a table on it,
+// reaches the next; lua_close stays cheap, and handing out a used state costs
+// as much as copying init's values, not as much as running init.
+//
+// The host state can only run one thing at a time, so there's no warming in
+// the background: the pool warms all its states up front, and a luaL_newstate
+// that finds it empty runs init there and then. That state joins the pool
+// when it's closed, so a pool that runs dry refills as states are returned.
+
+static FakeLuaState *push_new_state(lua_State *L);
+
+// This pushes a copy of the value at stack[i], with tables copied to any
+// depth. A table reached more than once, as through a cycle, is copied once:
+// the table at stack[seen] maps each original to its copy. Metatables,
+// functions and userdata are shared rather than copied.
+static void push_deep_copy(lua_State *L, int i, int seen) {
+  if (!lua_istable(L, i)) {
+    lua_pushvalue(L, i);
+    return;
+  }
+      // stack = [..]
+  lua_pushvalue(L, i);
+  lua_rawget(L, seen);
+  if (!lua_isnil(L, -1)) return;
+  lua_pop(L, 1);
+  luaL_checkstack(L, 4, "table too deep to copy");
+  lua_newtable(L);
+  int copy = lua_gettop(L);
+  lua_pushvalue(L, i);
+  lua_pushvalue(L, copy);
+  lua_rawset(L, seen);
+      // stack = [.., copy]
+  lua_pushnil(L);
+  while (lua_next(L, i)) {
+        // stack = [.., copy, key, value]
+    int value = lua_gettop(L);
+    push_deep_copy(L, value - 1, seen);
+    push_deep_copy(L, value, seen);
+    lua_rawset(L, copy);
+    lua_pop(L, 1);
+        // stack = [.., copy, key]
+  }
+  if (lua_getmetatable(L, i)) lua_setmetatable(L, copy);
+      // stack = [.., copy]
+}
+
+// This pushes a deep copy of the n values at stack[first..], or at
+// src[first..] if src is the stack index of a table, as a table with field n.
+static void push_items_copy(lua_State *L, int src, int first, int n) {
+      // stack = [..]
+  lua_newtable(L);
+  int seen = lua_gettop(L);
+  lua_createtable(L, n, 1);
+  int copy = seen + 1;
+      // stack = [.., seen, copy]
+  int k;
+  for (k = 0; k < n; ++k) {
+    if (src) {
+      lua_rawgeti(L, src, first + k);
+    } else {
+      lua_pushvalue(L, first + k);
+    }
+    push_deep_copy(L, copy + 1, seen);
+    lua_rawseti(L, copy, k + 1);
+    lua_pop(L, 1);
+  }
+  lua_pushinteger(L, n);
+  lua_setfield(L, copy, "n");
+  lua_remove(L, seen);
+      // stack = [.., copy]
+}
+
+// This pushes a new demo state for the pool, with init run on it quietly, and
+// keeps the snapshot of its stack.
+static void warm_state(lua_State *L) {
+      // stack = [..]
+  FakeLuaState *demo_state = push_new_state(L);
+  lua_getfield(L, LUA_REGISTRYINDEX, pool_key);
+  lua_getfield(L, -1, "init");
+  lua_remove(L, -2);
+      // stack = [.., demo_L, init | nil]
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+  } else {
+    lua_pushvalue(L, -2);
+        // stack = [.., demo_L, init, demo_L]
+    int was_quiet = is_quiet;
+    is_quiet = 1;
+    int status = lua_pcall(L, 1, 0, 0);
+    is_quiet = was_quiet;
+    if (status) {
+      luaL_error(L, "pool init failed: %s", lua_isstring(L, -1) ?
+                 lua_tostring(L, -1) : luaL_typename(L, -1));
+    }
+  }
+      // stack = [.., demo_L]
+  if (demo_state->buffer || demo_state->job) {
+    luaL_error(L, "init must finish its luaL_Buffer and async chunks");
+  }
+  demo_state->pool_generation = pool_generation;
+  demo_state->pool_step       = demo_state->step;
+  demo_state->pool_settings   = demo_state->settings;
+  load_states_table(L);
+  lua_rawgeti(L, -1, demo_state->ref);
+      // stack = [.., demo_L, states_table, demo_state_data]
+  int data = lua_gettop(L);
+  lua_getfield(L, data, "num_items");
+  int num_items = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  push_items_copy(L, data, 1, num_items);
+  lua_setfield(L, data, "pool_snapshot");
+  lua_pop(L, 2);
+      // stack = [.., demo_L]
+}
+
+// This gives demo_state, which return_to_pool made, a fresh copy of its
+// pool's snapshot as its stack. The copy is step 1 of the state's history,
+// made by no call.
+static void copy_pool_snapshot(lua_State *L, FakeLuaState *demo_state) {
+      // stack = [..]
+  int top = lua_gettop(L);
+  load_states_table(L);
+  lua_rawgeti(L, -1, demo_state->ref);
+      // stack = [.., states_table, data]
+  int data = lua_gettop(L);
+  lua_getfield(L, data, "pool_snapshot");
+      // stack = [.., states_table, data, snapshot]
+  lua_getfield(L, -1, "n");
+  int n = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  push_items_copy(L, data + 1, 1, n);
+  luaL_checkstack(L, n + LUA_MINSTACK, "stack too big to copy");
+  int first = lua_gettop(L) + 1, k;
+  for (k = 1; k <= n; ++k) lua_rawgeti(L, first - 1, k);
+      // stack = [.., data, snapshot, copy, <items>]
+
+  // The copy doesn't come from a call of its own, so it isn't recorded,
+  // flown or observed as part of this luaL_newstate.
+  int      record_ref = call_record_ref;
+  uint64_t call       = flight_call;
+  int      level      = observe_level;
+  call_record_ref = LUA_NOREF;
+  flight_call     = 0;
+  observe_level   = 0;
+  save_items(L, demo_state, data, 0, first, n);
+  call_record_ref = record_ref;
+  flight_call     = call;
+  observe_level   = level;
+  if (demo_state->settings.profile_period > 0) {
+    lua_newtable(L);
+    lua_setfield(L, data, "profile");
+  }
+  demo_state->is_copy_due = 0;
+  lua_settop(L, top);
+      // stack = [..]
+}
+
+// This pushes a state from the pool, for luaL_newstate.
+static void take_pooled_state(lua_State *L) {
+  if (pool_ready == 0) {
+    pool_misses++;
+    warm_state(L);
+    return;
+  }
+  pool_hits++;
+      // stack = [..]
+  lua_getfield(L, LUA_REGISTRYINDEX, pool_key);
+  lua_rawgeti(L, -1, pool_ready);
+      // stack = [.., pool, demo_L]
+  lua_pushnil(L);
+  lua_rawseti(L, -3, pool_ready--);
+  lua_remove(L, -2);
+      // stack = [.., demo_L]
+  FakeLuaState *demo_state = (FakeLuaState *)lua_touserdata(L, -1);
+  if (demo_state->is_copy_due) copy_pool_snapshot(L, demo_state);
+}
+
+// This puts a new state in the pool in place of demo_state, which lua_close is
+// about to retire. It shares demo_state's snapshot, and copies it only once
+// it's taken; see copy_pool_snapshot. This returns 0, and does nothing, if the
+// pool is full or demo_state was made for an earlier pool.
+static int return_to_pool(lua_State *L, FakeLuaState *demo_state) {
+  if (demo_state->pool_generation != pool_generation ||
+      pool_ready >= pool_size) {
+    return 0;
+  }
+      // stack = [..]
+  FakeLuaState *new_state = push_new_state(L);
+  new_state->settings        = demo_state->pool_settings;
+  new_state->pool_generation = demo_state->pool_generation;
+  new_state->pool_step       = 1;
+  new_state->pool_settings   = demo_state->pool_settings;
+  new_state->is_copy_due     = 1;
+  load_states_table(L);
+  lua_rawgeti(L, -1, new_state->ref);
+  lua_rawgeti(L, -2, demo_state->ref);
+      // stack = [.., new_L, states_table, new_data, old_data]
+  lua_getfield(L, -1, "pool_snapshot");
+  lua_setfield(L, -3, "pool_snapshot");
+  lua_pop(L, 3);
+      // stack = [.., new_L]
+  lua_getfield(L, LUA_REGISTRYINDEX, pool_key);
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, ++pool_ready);
+  lua_pop(L, 1);
+      // stack = [..]
+  return 1;
+}
+
+// apidemo.pool{size = n, init = fn} replaces any earlier pool with one of n
+// states, warmed by init, which may be left out. A size of 0 turns the pool
+// off. apidemo.pool() leaves the pool alone. Either way, this returns the
+// pool's counts: size, ready, hits and misses.
+static int pool(lua_State *L) {
+  if (!lua_isnoneornil(L, 1)) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    lua_getfield(L, 1, "size");
+    lua_getfield(L, 1, "init");
+        // stack = [opts, opts.size, opts.init]
+    luaL_argcheck(L, lua_isnumber(L, 2) && lua_tonumber(L, 2) >= 0 &&
+                     lua_tonumber(L, 2) <= max_pool_size, 1,
+                  "size must be a number from 0 to 1024");
+    luaL_argcheck(L, lua_isnil(L, 3) || lua_isfunction(L, 3), 1,
+                  "init must be a function");
+    int size = (int)lua_tointeger(L, 2);
+    lua_createtable(L, size, 1);
+    lua_pushvalue(L, 3);
+    lua_setfield(L, -2, "init");
+    lua_setfield(L, LUA_REGISTRYINDEX, pool_key);
+    lua_settop(L, 1);
+        // stack = [opts]
+    // The pool stays off while it's warmed, so that if init raises an error
+    // there's no pool left half built, and a luaL_newstate made by init
+    // doesn't look for a state in it.
+    pool_generation++;
+    pool_size   = 0;
+    pool_ready  = 0;
+    pool_hits   = 0;
+    pool_misses = 0;
+    int ready = 0;
+    while (ready < size) {
+      warm_state(L);
+      lua_getfield(L, LUA_REGISTRYINDEX, pool_key);
+      lua_insert(L, -2);
+          // stack = [opts, pool, demo_L]
+      lua_rawseti(L, -2, ++ready);
+      lua_pop(L, 1);
+          // stack = [opts]
+    }
+    pool_size  = size;
+    pool_ready = ready;
+  }
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, pool_size);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, pool_ready);
+  lua_setfield(L, -2, "ready");
+  lua_pushnumber(L, (lua_Number)pool_hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, (lua_Number)pool_misses);
+  lua_setfield(L, -2, "misses");
+  return 1;
+}
+
+
+// ## Functions that simulate the C API.
+
+// This pushes a new demo state with an empty stack.
+static FakeLuaState *push_new_state(lua_State *L) {
+      // stack = [..]
+  FakeLuaState *demo_state =
+      (FakeLuaState *)lua_newuserdata(L, sizeof(FakeLuaState));
+  memset(demo_state, 0, sizeof(FakeLuaState));
+      // stack = [.., demo_L]
+  luaL_getmetatable(L, demo_state_metatable);
+      // stack = [.., demo_L, mt]
+  lua_setmetatable(L, -2);
+      // stack = [.., demo_L]
+  load_states_table(L);
+      // stack = [.., demo_L, states_table]
+  lua_newtable(L);
+      // stack = [.., demo_L, states_table, demo_state_data = {}]
+  lua_pushnumber(L, 0);
+      // stack = [.., demo_L, states_table, demo_state_data, 0]
+  lua_setfield(L, -2, "num_items");  // TODO Drop magic string.
+      // stack = [.., demo_L, states_table, demo_state_data]
+  demo_state->ref = luaL_ref(L, -2);  // Set states_table[ref] = demo_state_data.
+      // stack = [.., demo_L, states_table]
+  lua_pop(L, 1);
+      // stack = [.., demo_L]
+  return demo_state;
+}
+
+static int demo_luaL_newstate(lua_State *L) {
+  if (pool_size > 0) {
+    take_pooled_state(L);
+  } else {
+    push_new_state(L);
+  }
+  return 1;  // Number of values to return that are on the stack.
+}
+
+// ### Macros to work with luaL_checkint and luaL_optint in Lua 5.3.
+
+#if LUA_VERSION_NUM == 503
+#define luaL_checkint(L, arg) (int)(luaL_checkinteger(L, arg))
+#define luaL_optint(L, arg, d) (int)(luaL_optinteger(L, arg, d))
+#endif
+
+// ### Macros that make it easy to wrap Lua C API functions.
+
+// A typical wrapper function will look something like this pseudocode:
+//
+// static int demo_lua_dosomething(lua_State *L) {
+//  FakeLuaState *demo_state = check_demo_state(L, 1);
+//  intype1 arg1 = luaL_checktype1(L, 2);
+//  intype2 arg2 = luaL_checktype2(L, 3);
+//  load_state(L, demo_state);
+//  outtype out = lua_dosomething(L, arg1, arg2);
+//  print_stack(L, 0);  // 0 --> omit 0 tail values
+//  save_stack(L, 0);   // 0 --> omit 0 tail values
+//  lua_pushouttype(L, out);
+//  return 1;
+// }
+//
+// In more natural language, the process works like this:
+// 1. Extract inputs from L.
+// 2. Load demo Lua state.
+// 3. Run the API function.
+// 4. Print the stack.
+// 5. Save the demo Lua state.
+// 6. Return any output values.
+//
+// Most of that code is identical for most API functions. The major differences
+// are the types and numbers of the inputs and outputs. The macros below help
+// simplify the creation of these wrapper functions. As an example, the API
+// functions lua_pushstring can be wrapped with this simple macro call:
+//
+// fn_string_in(lua_pushstring);
+//
+// In general, the final macros take the format:
+//
+// fn_<intype1>_<intype2>_in[_<outtype>_out] (lua_fn_name);
+//
+
+#define fn_start(lua_fn_name)                                             \
+  static int demo_ ## lua_fn_name(lua_State *L) {                         \
+    FakeLuaState *demo_state = check_demo_state(L, 1);
+
+#define fn_end                        \
+    print_stack(L, 0);                \
+    save_state(L, 0);                 \
+    return 0;                         \
+  }
+
+#define fn_end_number_out             \
+    print_stack(L, 0);                \
+    save_state(L, 0);                 \
+    lua_pushnumber(L, out1);          \
+    return 1;                         \
+  }
+
+#define fn_end_string_out             \
+    print_stack(L, 0);                \
+    save_state(L, 0);                 \
+    if (out1) {                       \
+      lua_pushstring(L, out1);        \
+    } else {                          \
+      lua_pushnumber(L, 0);           \
+    }                                 \
+    return 1;                         \
+  }
+
+#define fn_end_0_arg(lua_fn_name)     \
+    load_state(L, demo_state);        \
+    lua_fn_name(L);                   \
+    fn_end
+
+#define fn_end_1_arg(lua_fn_name)     \
+    load_state(L, demo_state);        \
+    lua_fn_name(L, arg1);             \
+    fn_end
+
+#define fn_end_2_arg(lua_fn_name)     \
+    load_state(L, demo_state);        \
+    lua_fn_name(L, arg1, arg2);       \
+    fn_end
+
+#define fn_end_1_arg_1_out(lua_fn_name)     \
+    load_state(L, demo_state);              \
+    int out1 = lua_fn_name(L, arg1);        \
+    fn_end_number_out
+
+#define fn_end_2_arg_1_out(lua_fn_name)     \
+    load_state(L, demo_state);              \
+    int out1 = lua_fn_name(L, arg1, arg2);  \
+    fn_end_number_out
+
+#define fn_end_1_arg_double_out(lua_fn_name)    \
+    load_state(L, demo_state);                  \
+    double out1 = lua_fn_name(L, arg1);         \
+    fn_end_number_out
+
+#define fn_end_1_arg_str_out(lua_fn_name)       \
+    load_state(L, demo_state);                  \
+    const char *out1 = lua_fn_name(L, arg1);    \
+    fn_end_string_out
+
+#define fn_end_0_arg_1_out(lua_fn_name)     \
+    load_state(L, demo_state);              \
+    int out1 = lua_fn_name(L);              \
+    fn_end_number_out
+
+#define fn_nothing_in(lua_fn_name)       \
+    fn_start(lua_fn_name);               \
+    fn_end_0_arg(lua_fn_name)
+
+#define fn_nothing_in_int_out(lua_fn_name)     \
+    fn_start(lua_fn_name);                     \
+    fn_end_0_arg_1_out(lua_fn_name)
+
+#define fn_int_in(lua_fn_name)       \
+    fn_start(lua_fn_name);           \
+    int arg1 = luaL_checkint(L, 2);  \
+    fn_end_1_arg(lua_fn_name)
+
+#define fn_string_in(lua_fn_name)                \
+    fn_start(lua_fn_name);                       \
+    const char *arg1 = luaL_checkstring(L, 2);   \
+    fn_end_1_arg(lua_fn_name)
+
+#define fn_int_string_in(lua_fn_name)            \
+    fn_start(lua_fn_name);                       \
+    int arg1 = luaL_checkint(L, 2);              \
+    const char *arg2 = luaL_checkstring(L, 3);   \
+    fn_end_2_arg(lua_fn_name)
+
+#define fn_string_int_in(lua_fn_name)            \
+    fn_start(lua_fn_name);                       \
+    const char *arg1 = luaL_checkstring(L, 2);   \
+    int arg2 = luaL_checkint(L, 3);              \
+    fn_end_2_arg(lua_fn_name)
+
+#define fn_int_int_in(lua_fn_name)               \
+    fn_start(lua_fn_name);                       \
+    int arg1 = luaL_checkint(L, 2);              \
+    int arg2 = luaL_checkint(L, 3);              \
+    fn_end_2_arg(lua_fn_name)
+
+#define fn_number_in(lua_fn_name)                \
+    fn_start(lua_fn_name);                       \
+    lua_Number arg1 = luaL_checknumber(L, 2);    \
     fn_end_1_arg(lua_fn_name)
 
-#define fn_int_string_in(lua_fn_name)            \
-    fn_start(lua_fn_name);                       \
-    int arg1 = luaL_checkint(L, 2);              \
-    const char *arg2 = luaL_checkstring(L, 3);   \
-    fn_end_2_arg(lua_fn_name)
+#define fn_int_in_int_out(lua_fn_name)    \
+    fn_start(lua_fn_name);                \
+    int arg1 = luaL_checkint(L, 2);       \
+    fn_end_1_arg_1_out(lua_fn_name)
+
+#define fn_int_in_double_out(lua_fn_name)   \
+    fn_start(lua_fn_name);                  \
+    int arg1 = luaL_checkint(L, 2);         \
+    fn_end_1_arg_double_out(lua_fn_name)
+
+#define fn_int_string_in_int_out(lua_fn_name)    \
+    fn_start(lua_fn_name);                       \
+    int arg1 = luaL_checkint(L, 2);              \
+    const char *arg2 = luaL_checkstring(L, 3);   \
+    fn_end_2_arg_1_out(lua_fn_name)
+
+#define fn_string_in_int_out(lua_fn_name)        \
+    fn_start(lua_fn_name);                       \
+    const char *arg1 = luaL_checkstring(L, 2);   \
+    fn_end_1_arg_1_out(lua_fn_name)
+
+#define fn_int_in_string_out(lua_fn_name)    \
+    fn_start(lua_fn_name);                   \
+    int arg1 = luaL_checkint(L, 2);          \
+    fn_end_1_arg_str_out(lua_fn_name)
+
+// ### Wrappers around C API functions defined using the above macros.
+
+// Please keep these alphabetized by API function name.
+// Defined below:       lua_call
+// Defined below:       lua_checkstack
+fn_int_in              (lua_concat);
+// Defined below:       lua_createtable
+// Defined below:       lua_getfield
+// Defined below:       lua_getglobal
+fn_int_in_int_out      (lua_getmetatable);
+// Defined below:       lua_gettable
+fn_nothing_in_int_out  (lua_gettop);
+// Defined below:       lua_gc
+// Defined below:       lua_error
+fn_int_in              (lua_insert);
+fn_int_in_int_out      (lua_isboolean);
+fn_int_in_int_out      (lua_isfunction);
+fn_int_in_int_out      (lua_isnil);
+fn_int_in_int_out      (lua_isnone);
+fn_int_in_int_out      (lua_isnoneornil);
+fn_int_in_int_out      (lua_isnumber);
+fn_int_in_int_out      (lua_isstring);
+fn_int_in_int_out      (lua_istable);
+fn_int_in_int_out      (lua_isuserdata);
+// Defined below:       lua_newtable
+// Defined below:       lua_newthread
+// Defined below:       lua_newuserdata
+fn_int_in_int_out      (lua_next);
+fn_int_in              (lua_pop);
+fn_int_in              (lua_pushboolean);
+// Defined below:       lua_pushfstring
+fn_string_int_in       (lua_pushlstring);
+fn_nothing_in          (lua_pushnil);
+fn_number_in           (lua_pushnumber);
+fn_string_in           (lua_pushstring);
+fn_int_in              (lua_pushvalue);
+fn_int_int_in          (lua_rawequal);
+fn_int_in              (lua_rawget);
+fn_int_int_in          (lua_rawgeti);
+// Defined below:       lua_rawset
+// Defined below:       lua_rawseti
+fn_int_in              (lua_remove);
+fn_int_in              (lua_replace);
+// Defined below:       lua_resume
+// Defined below:       lua_setfield
+fn_string_in           (lua_setglobal);
+fn_int_in_int_out      (lua_setmetatable);
+// Defined below:       lua_settable
+// Defined below:       lua_settop
+// Defined below:       lua_status
+fn_int_in_int_out      (lua_toboolean);
+fn_int_in_int_out      (lua_tointeger);
+fn_int_in_double_out   (lua_tonumber);
+fn_int_in_string_out   (lua_tostring);
+// Defined below:       lua_touserdata
+fn_int_in_int_out      (lua_type);
+fn_int_in_string_out   (lua_typename);
+// Defined below:       lua_xmove
+// Defined below:       lua_yield
+
+// Version-specific functions.
+
+#if LUA_VERSION_NUM == 501
+fn_int_int_in          (lua_equal);
+fn_int_int_in          (lua_lessthan);
+fn_int_in_int_out      (lua_objlen);
+#else
+fn_int_in_int_out      (lua_rawlen);
+#endif
+
+fn_int_string_in_int_out  (luaL_argerror);
+fn_int_string_in_int_out  (luaL_callmeta);
+fn_int_in                 (luaL_checkany);
+fn_int_in_int_out         (luaL_checkint);
+fn_int_in_double_out      (luaL_checknumber);
+fn_int_in_string_out      (luaL_checkstring);
+fn_int_int_in             (luaL_checktype);
+// Defined below:          luaL_dofile
+// Defined below:          luaL_dostring
+fn_int_string_in_int_out  (luaL_getmetafield);
+// Defined below:          luaL_loadfile
+// Defined below:          luaL_loadstring
+// Defined below:          luaL_optint
+// Defined below:          luaL_optnumber
+// Defined below:          luaL_optstring
+fn_int_in_string_out      (luaL_typename);
+
+// ### Function wrappers that need special-case code.
+
+// This is a special case function as it doesn't return; yet we'd still like to
+// leave in a valid state as the encompassing Lua environment may continue to
+// run.
+int demo_lua_error(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  load_state(L, demo_state);
+  print_stack(L, 1);  // 1 --> tail values to omit
+  save_state(L, 1);   // 1 --> tail values to omit
+  return lua_error(L);
+}
+
+// lua_close retires a state: its saved stack and history are let go, and any
+// later call on it raises an error. A state from apidemo.pool is replaced in
+// the pool by a new one, reset to how init left it.
+static int demo_lua_close(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  if (demo_state->buffer) {
+    return luaL_error(L, "can't close a state while a luaL_Buffer is in use");
+  }
+  check_not_busy(L, demo_state);
+  return_to_pool(L, demo_state);
+      // stack = [demo_L]
+  load_states_table(L);
+  luaL_unref(L, -1, demo_state->ref);
+  lua_pop(L, 1);
+      // stack = [demo_L]
+  demo_state->ref             = LUA_NOREF;
+  demo_state->pool_generation = 0;
+  return 0;  // Number of values to return that are on the stack.
+}
+
+// A demo state that's collected without being closed lets go of its saved
+// stack and history the same way; its data in the states table is all that's
+// left of it.
+static int demo_state_gc(lua_State *L) {
+  FakeLuaState *demo_state = (FakeLuaState *)lua_touserdata(L, 1);
+  if (demo_state->ref == LUA_NOREF) return 0;
+      // stack = [demo_L]
+  load_states_table(L);
+  luaL_unref(L, -1, demo_state->ref);
+  lua_pop(L, 1);
+      // stack = [demo_L]
+  demo_state->ref = LUA_NOREF;
+  if (unchanged_state == demo_state) {
+    unchanged_state = NULL;
+    unchanged_n     = -1;
+  }
+  return 0;
+}
+
+// In Lua 5.4, lua_gc takes a variable number of int arguments after `what`.
+static int demo_lua_gc(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int arg1 = luaL_checkint(L, 2);
+  int arg2 = luaL_optint(L, 3, 0);
+#if LUA_VERSION_NUM >= 504
+  int arg3 = luaL_optint(L, 4, 0);
+  int arg4 = luaL_optint(L, 5, 0);
+#endif
+  load_state(L, demo_state);
+  clock_t start = clock();
+#if LUA_VERSION_NUM >= 504
+  int out1;
+  switch (arg1) {
+    case LUA_GCGEN: out1 = lua_gc(L, arg1, arg2, arg3);       break;
+    case LUA_GCINC: out1 = lua_gc(L, arg1, arg2, arg3, arg4); break;
+    default:        out1 = lua_gc(L, arg1, arg2);             break;
+  }
+#else
+  int out1 = lua_gc(L, arg1, arg2);
+#endif
+  lua_gc_seconds += (double)(clock() - start) / CLOCKS_PER_SEC;
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  lua_pushnumber(L, out1);
+  return 1;  // Number of values to return that are on the stack.
+}
+
+// The demo stack lives on the host stack only during a call, so what a demo
+// state can grow to is what load_state and save_state can make room for: its
+// items plus LUA_MINSTACK free slots. lua_checkstack(L, n) answers whether
+// the stack could grow by n items and still be loaded again, so that demos
+// which check first see a 0 instead of a "demo stack too big" error, and
+// has later calls keep that room, as C code may count on.
+static int demo_lua_checkstack(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int arg1 = luaL_checkint(L, 2);
+  luaL_argcheck(L, arg1 <= INT_MAX - 2 * LUA_MINSTACK, 2, "too many slots");
+  load_state(L, demo_state);
+  int n = (arg1 > 0 ? arg1 : 0);
+  int out1 = lua_checkstack(L, n + LUA_MINSTACK + 1);
+  int top = lua_gettop(L);
+  if (out1 && top + n > demo_state->checked_top) {
+    demo_state->checked_top = top + n;
+  }
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  lua_pushnumber(L, out1);
+  return 1;  // Number of values to return that are on the stack.
+}
+
+// Growing the stack with lua_settop past the room it has is undefined in C,
+// and would corrupt the host here, so we make the room or raise an error.
+static int demo_lua_settop(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int arg1 = luaL_checkint(L, 2);
+  load_state(L, demo_state);
+  int top = lua_gettop(L);
+  if (arg1 > top && (arg1 - top > INT_MAX - 2 * LUA_MINSTACK ||
+                     !lua_checkstack(L, arg1 - top + LUA_MINSTACK + 1))) {
+    return luaL_error(L, "stack overflow (demo stack too big)");
+  }
+  lua_settop(L, arg1);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  return 0;  // Number of values to return that are on the stack.
+}
+
+// ### Table reads.
+
+// A read that isn't raw may run an __index metamethod; see note_table_read.
+
+static int demo_lua_getfield(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int arg1 = luaL_checkint(L, 2);
+  const char *arg2 = luaL_checkstring(L, 3);
+  load_state(L, demo_state);
+  note_table_read(L, arg1);
+  lua_getfield(L, arg1, arg2);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  return 0;  // Number of values to return that are on the stack.
+}
+
+static int demo_lua_getglobal(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  const char *arg1 = luaL_checkstring(L, 2);
+  load_state(L, demo_state);
+#if LUA_VERSION_NUM == 501
+  note_table_read(L, LUA_GLOBALSINDEX);
+#else
+  lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+  note_table_read(L, -1);
+  lua_pop(L, 1);
+#endif
+  lua_getglobal(L, arg1);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  return 0;  // Number of values to return that are on the stack.
+}
+
+static int demo_lua_gettable(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int arg1 = luaL_checkint(L, 2);
+  load_state(L, demo_state);
+  note_table_read(L, arg1);
+  lua_gettable(L, arg1);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  return 0;  // Number of values to return that are on the stack.
+}
+
+// ### Table writes and new tables.
+
+// These note how each write changes the table's layout; see the section on
+// table internals above.
+
+static int demo_lua_createtable(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int arg1 = luaL_checkint(L, 2);
+  int arg2 = luaL_checkint(L, 3);
+  load_state(L, demo_state);
+  lua_createtable(L, arg1, arg2);
+  track_new_table(L, arg1, arg2);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  return 0;  // Number of values to return that are on the stack.
+}
+
+static int demo_lua_newtable(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  load_state(L, demo_state);
+  lua_newtable(L);
+  track_new_table(L, 0, 0);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  return 0;  // Number of values to return that are on the stack.
+}
+
+static int demo_lua_rawset(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int arg1 = luaL_checkint(L, 2);
+  load_state(L, demo_state);
+  int t = abs_index(L, arg1);
+  size_t before = bytes_allocated(L);
+  lua_rawset(L, arg1);
+  note_table_write(L, t, before, 1);  // 1 --> is_raw
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  return 0;  // Number of values to return that are on the stack.
+}
+
+static int demo_lua_rawseti(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int arg1 = luaL_checkint(L, 2);
+  int arg2 = luaL_checkint(L, 3);
+  load_state(L, demo_state);
+  int t = abs_index(L, arg1);
+  size_t before = bytes_allocated(L);
+  lua_rawseti(L, arg1, arg2);
+  note_table_write(L, t, before, 1);  // 1 --> is_raw
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  return 0;  // Number of values to return that are on the stack.
+}
+
+static int demo_lua_setfield(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int arg1 = luaL_checkint(L, 2);
+  const char *arg2 = luaL_checkstring(L, 3);
+  load_state(L, demo_state);
+  int t = abs_index(L, arg1);
+  // Intern the key first, so that any allocation is from the table alone.
+  lua_pushstring(L, arg2);
+  lua_pop(L, 1);
+  size_t before = bytes_allocated(L);
+  lua_setfield(L, arg1, arg2);
+  note_table_write(L, t, before, 0);  // 0 --> is_raw
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  return 0;  // Number of values to return that are on the stack.
+}
+
+static int demo_lua_settable(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int arg1 = luaL_checkint(L, 2);
+  load_state(L, demo_state);
+  int t = abs_index(L, arg1);
+  size_t before = bytes_allocated(L);
+  lua_settable(L, arg1);
+  note_table_write(L, t, before, 0);  // 0 --> is_raw
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  return 0;  // Number of values to return that are on the stack.
+}
+
+// ### Coroutines.
+
+// lua_newthread pushes a real coroutine onto L's stack, and returns a new demo
+// state L1 for it. The coroutine's body runs Lua code, which can itself make
+// demo API calls on L1.
+static int demo_lua_newthread(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  lua_pushvalue(L, 1);
+  int parent_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  load_state(L, demo_state);
+  lua_State *thread = lua_newthread(L);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+      // stack = [.., thread]
+  FakeLuaState *thread_state = push_new_state(L);
+      // stack = [.., thread, L1]
+  thread_state->thread = thread;
+  thread_state->parent = demo_state;
+
+  // Keep the thread and the parent alive for as long as L1's data is.
+  load_states_table(L);
+      // stack = [.., thread, L1, states_table]
+  lua_rawgeti(L, -1, thread_state->ref);
+      // stack = [.., thread, L1, states_table, L1_data]
+  lua_pushvalue(L, -4);
+  lua_setfield(L, -2, "thread");
+  lua_rawgeti(L, LUA_REGISTRYINDEX, parent_ref);
+  lua_setfield(L, -2, "parent");
+  lua_pop(L, 2);
+      // stack = [.., thread, L1]
+  luaL_unref(L, LUA_REGISTRYINDEX, parent_ref);
+  return 1;  // Number of values to return that are on the stack.
+}
+
+// The first resume hands the function and its arguments to the coroutine;
+// later ones hand over just the arguments, which the body receives as the
+// return values of its lua_yield call. Whatever the coroutine yields, returns,
+// or raises is then pushed back onto L1's stack.
+static int demo_lua_resume(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int arg1 = luaL_checkint(L, 2);
+  lua_State *thread = demo_state->thread;
+  luaL_argcheck(L, thread, 1, "expected a state made by lua_newthread");
+  luaL_argcheck(L, thread != L, 1, "can't resume the running coroutine");
+  load_state(L, demo_state);
+  int num_in = arg1 + !demo_state->is_started;
+  int out1 = LUA_ERRRUN;
+  if (num_in > lua_gettop(L)) {
+    lua_pushliteral(L, "not enough values on the stack to resume with");
+  } else if (demo_state->is_started && lua_status(thread) != LUA_YIELD) {
+    lua_pushliteral(L, "cannot resume dead coroutine");
+  } else {
+    lua_xmove(L, thread, num_in);
+    demo_state->is_started = 1;
+
+    // Save L1 while the body runs, since the body may use it too.
+    save_state(L, 0);   // 0 --> tail values to omit
+#if LUA_VERSION_NUM == 501
+    out1 = lua_resume(thread, arg1);
+    int num_out = lua_gettop(thread);
+#elif LUA_VERSION_NUM <= 503
+    out1 = lua_resume(thread, L, arg1);
+    int num_out = lua_gettop(thread);
+#else
+    int num_out;
+    out1 = lua_resume(thread, L, arg1, &num_out);
+#endif
+    if (out1 != 0 && out1 != LUA_YIELD) num_out = 1;  // The error message.
+    load_state(L, demo_state);
+    luaL_checkstack(L, num_out, "too many results to resume");
+    lua_xmove(thread, L, num_out);
+  }
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  lua_pushnumber(L, out1);
+  return 1;  // Number of values to return that are on the stack.
+}
+
+// This can only be called from the body of L1's coroutine. It doesn't return
+// to the body until L1 is resumed.
+static int demo_lua_yield(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int arg1 = luaL_checkint(L, 2);
+  luaL_argcheck(L, demo_state->thread == L, 1,
+                "only the running coroutine can yield");
+  load_state(L, demo_state);
+  if (arg1 > lua_gettop(L)) arg1 = lua_gettop(L);
+  print_stack(L, arg1);  // arg1 --> tail values to omit
+  save_state(L, arg1);   // arg1 --> tail values to omit
+  return lua_yield(L, arg1);
+}
+
+static int demo_lua_status(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  load_state(L, demo_state);
+  int out1 = lua_status(demo_state->thread ? demo_state->thread : L);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  lua_pushnumber(L, out1);
+  return 1;  // Number of values to return that are on the stack.
+}
+
+// This pops n values from the top of the host stack and pushes them onto the
+// saved stack of demo_state, which must not be loaded.
+static void push_onto_saved_state(lua_State *L, FakeLuaState *demo_state,
+                                  int n) {
+      // stack = [.., v1 .. vn]
+  check_not_busy(L, demo_state);
+  load_states_table(L);
+  lua_rawgeti(L, -1, demo_state->ref);
+  lua_remove(L, -2);
+      // stack = [.., v1 .. vn, demo_state_data]
+  lua_getfield(L, -1, "num_items");
+  int num_items = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  int data = lua_gettop(L);
+  save_items(L, demo_state, data, num_items, data - n, n);
+  lua_pop(L, n + 1);
+      // stack = [..]
+}
+
+// Demo states all live on the host state, so this moves values between their
+// saved stacks; a real lua_xmove would do the same between two real threads.
+static int demo_lua_xmove(lua_State *L) {
+  FakeLuaState *from = check_demo_state(L, 1);
+  FakeLuaState *to = check_demo_state(L, 2);
+  int arg1 = luaL_checkint(L, 3);
+  lua_pushvalue(L, 2);
+  int to_ref = luaL_ref(L, LUA_REGISTRYINDEX);  // Keep `to` alive.
+  load_state(L, from);
+  if (arg1 > lua_gettop(L)) arg1 = lua_gettop(L);
+  if (arg1 < 0) arg1 = 0;
+  print_stack(L, arg1);  // arg1 --> tail values to omit
+  save_state(L, arg1);   // arg1 --> tail values to omit
+      // stack = [<from's stack>, v1 .. vn]
+  push_onto_saved_state(L, to, arg1);
+  load_state(L, to);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  luaL_unref(L, LUA_REGISTRYINDEX, to_ref);
+  return 0;  // Number of values to return that are on the stack.
+}
+
+// Pointers are returned to Lua as light userdata.
+static int demo_lua_newuserdata(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  lua_Number size = luaL_checknumber(L, 2);
+  luaL_argcheck(L, size >= 0 && size < (lua_Number)SIZE_MAX, 2,
+                "userdata size out of range");
+  size_t arg1 = (size_t)size;
+  load_state(L, demo_state);
+  void *out1 = lua_newuserdata(L, arg1);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  lua_pushlightuserdata(L, out1);
+  return 1;  // Number of values to return that are on the stack.
+}
+
+static int demo_lua_touserdata(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int arg1 = luaL_checkint(L, 2);
+  load_state(L, demo_state);
+  void *out1 = lua_touserdata(L, arg1);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  if (out1) {
+    lua_pushlightuserdata(L, out1);
+  } else {
+    lua_pushnumber(L, 0);  // NULL
+  }
+  return 1;  // Number of values to return that are on the stack.
+}
+
+int demo_lua_tolstring(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int arg1 = luaL_checkint(L, 2);
+  load_state(L, demo_state);
+  const char *out1 = lua_tolstring(L, arg1, NULL);  // NULL --> *len
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  lua_pushstring(L, out1);
+  return 1;  // Number of values to return that are on the stack.
+}
+
+int demo_luaL_optint(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int arg1 = luaL_checkint(L, 2);
+  int arg2 = luaL_checkint(L, 3);
+  load_state(L, demo_state);
+  int out1 = luaL_optint(L, arg1, arg2);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  lua_pushnumber(L, out1);
+  return 1;  // Number of values to return that are on the stack.
+}
+
+int demo_luaL_optnumber(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int arg1 = luaL_checkint(L, 2);
+  double arg2 = luaL_checknumber(L, 3);
+  load_state(L, demo_state);
+  double out1 = luaL_optnumber(L, arg1, arg2);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  lua_pushnumber(L, out1);
+  return 1;  // Number of values to return that are on the stack.
+}
+
+int demo_luaL_optstring(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int arg1 = luaL_checkint(L, 2);
+  const char *arg2 = luaL_checkstring(L, 3);
+  load_state(L, demo_state);
+  const char *out1 = luaL_optstring(L, arg1, arg2);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  lua_pushstring(L, out1);
+  return 1;  // Number of values to return that are on the stack.
+}
+
+// The functions that run Lua code may be profiled and given a budget; see
+// apidemo.profile and apidemo.budget.
+
+static int demo_lua_call(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int arg1 = luaL_checkint(L, 2);
+  int arg2 = luaL_checkint(L, 3);
+  load_state(L, demo_state);
+  start_running(L);
+  lua_call(L, arg1, arg2);
+  stop_running(L, 0);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  return 0;  // Number of values to return that are on the stack.
+}
+
+int demo_lua_pcall(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int arg1 = luaL_checkint(L, 2);
+  int arg2 = luaL_checkint(L, 3);
+  int arg3 = luaL_checkint(L, 4);
+  load_state(L, demo_state);
+  start_running(L);
+  int out1 = lua_pcall(L, arg1, arg2, arg3);
+  stop_running(L, out1);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  lua_pushnumber(L, out1);
+  return 1;  // Number of values to return that are on the stack.
+}
+
+static int demo_luaL_dofile(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  const char *arg1 = luaL_checkstring(L, 2);
+  load_state(L, demo_state);
+  start_running(L);
+  int out1 = load_cached_file(L, arg1) || lua_pcall(L, 0, LUA_MULTRET, 0);
+  stop_running(L, out1);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  lua_pushnumber(L, out1);
+  return 1;  // Number of values to return that are on the stack.
+}
+
+static int demo_luaL_dostring(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  const char *arg1 = luaL_checkstring(L, 2);
+  load_state(L, demo_state);
+  start_running(L);
+  int out1 = load_cached_string(L, arg1) ||
+             lua_pcall(L, 0, LUA_MULTRET, 0);
+  stop_running(L, out1);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  lua_pushnumber(L, out1);
+  return 1;  // Number of values to return that are on the stack.
+}
+
+// These go through the compiled-chunk cache when options.cache_chunks is set.
+
+static int demo_luaL_loadfile(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  const char *arg1 = luaL_checkstring(L, 2);
+  load_state(L, demo_state);
+  int out1 = load_cached_file(L, arg1);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  lua_pushnumber(L, out1);
+  return 1;  // Number of values to return that are on the stack.
+}
+
+static int demo_luaL_loadstring(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  const char *arg1 = luaL_checkstring(L, 2);
+  load_state(L, demo_state);
+  int out1 = load_cached_string(L, arg1);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  lua_pushnumber(L, out1);
+  return 1;  // Number of values to return that are on the stack.
+}
+
+// lua_pushfstring is variadic, so we can't forward our arguments to a single
+// call. Instead, we make one real lua_pushfstring call per conversion spec and
+// concatenate the pieces as we go.
+
+typedef union {
+  const char *s;
+  lua_Number f;
+  int d;
+  void *p;
+#if LUA_VERSION_NUM >= 503
+  lua_Integer I;
+#endif
+} FstringArg;
+
+static int demo_lua_pushfstring(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  const char *fmt = luaL_checkstring(L, 2);
+
+  // Check and convert all arguments before touching the demo state, as
+  // argument errors can't be raised after load_state. Everything the pieces
+  // below point into is kept in an anchor table in the registry, because
+  // load_state clears our own stack and with it our only references to the
+  // argument strings.
+  lua_newtable(L);
+  int anchor = lua_gettop(L);
+  const char *c;
+  int num_args = 0;
+  for (c = fmt; *c; ++c) {
+    if (*c == '%' && *++c != '%') ++num_args;
+    if (*c == '\0') break;
+  }
+  FstringArg *args = (FstringArg *)lua_newuserdata(L, sizeof(FstringArg) *
+                                                   (num_args + 1));
+  int arg = 0;
+  for (c = fmt; *c; ++c) {
+    if (*c != '%') continue;
+    int i = arg + 3;  // The Lua-side index of this argument.
+    switch (*++c) {
+      case 's':
+        args[arg].s = luaL_checkstring(L, i);
+        lua_pushvalue(L, i);
+        lua_rawseti(L, anchor, ++arg);
+        break;
+      case 'f': args[arg++].f = luaL_checknumber(L, i);            break;
+      case 'd': args[arg++].d = luaL_checkint(L, i);               break;
+      case 'c': args[arg++].d = luaL_checkint(L, i);               break;
+      case 'p': args[arg++].p = (void *)lua_topointer(L, i);       break;
+#if LUA_VERSION_NUM >= 503
+      case 'I': args[arg++].I = luaL_checkinteger(L, i);           break;
+      case 'U': args[arg++].I = luaL_checkinteger(L, i);           break;
+#endif
+      case '%':                                                    break;
+      default:
+        return luaL_error(L, "invalid conversion '%%%c' to 'lua_pushfstring'",
+                          *c ? *c : ' ');
+    }
+    if (*c == '\0') break;
+  }
+
+  // We need a writable copy of fmt so we can cut it into pieces in place.
+  size_t fmt_len = strlen(fmt);
+  char *piece = (char *)lua_newuserdata(L, fmt_len + 1);
+  memcpy(piece, fmt, fmt_len + 1);
+  lua_setfield(L, anchor, "piece");
+  lua_setfield(L, anchor, "args");
+  int anchor_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  load_state(L, demo_state);
+  lua_pushliteral(L, "");
+  arg = 0;
+  char *end;
+  for (end = piece; *end; ++end) {
+    if (*end != '%') continue;
+    char conv = *++end;
+    if (conv == '%') continue;
+    char saved = end[1];
+    end[1] = '\0';
+    switch (conv) {
+      case 's': lua_pushfstring(L, piece, args[arg++].s); break;
+      case 'f': lua_pushfstring(L, piece, args[arg++].f); break;
+      case 'd': lua_pushfstring(L, piece, args[arg++].d); break;
+      case 'c': lua_pushfstring(L, piece, args[arg++].d); break;
+      case 'p': lua_pushfstring(L, piece, args[arg++].p); break;
+#if LUA_VERSION_NUM >= 503
+      case 'I': lua_pushfstring(L, piece, args[arg++].I); break;
+      case 'U': lua_pushfstring(L, piece, (long)args[arg++].I); break;
+#endif
+    }
+    end[1] = saved;
+    lua_concat(L, 2);
+    piece = end + 1;
+  }
+  lua_pushfstring(L, piece);  // The tail, which may still contain "%%".
+  lua_concat(L, 2);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+
+  luaL_unref(L, LUA_REGISTRYINDEX, anchor_ref);
+  return 0;  // Number of values to return that are on the stack.
+}
+
+// ### String buffers.
+
+// Demo buffers are declared from Lua with `B = luaL_Buffer()`, and can then be
+// used just as they are in C. The C-side luaL_Buffer is stored in the userdata
+// itself; functions that take only B find their demo state through it.
+
+static int demo_luaL_Buffer(lua_State *L) {
+  DemoBuffer *buffer = (DemoBuffer *)lua_newuserdata(L, sizeof(DemoBuffer));
+      // stack = [B]
+  buffer->state_ref  = LUA_NOREF;
+  buffer->buffer_ref = LUA_NOREF;
+  luaL_getmetatable(L, demo_buffer_metatable);
+      // stack = [B, mt]
+  lua_setmetatable(L, -2);
+      // stack = [B]
+  return 1;  // Number of values to return that are on the stack.
+}
+
+// This checks that stack[i] is a buffer that has been through luaL_buffinit,
+// and returns it along with its demo state.
+static DemoBuffer *check_buffer(lua_State *L, int i,
+                                FakeLuaState **demo_state) {
+  DemoBuffer *buffer = (DemoBuffer *)luaL_checkudata(L, i,
+                                                     demo_buffer_metatable);
+  if (buffer->state_ref == LUA_NOREF) {
+    luaL_argerror(L, i, "buffer is not initialized; call luaL_buffinit first");
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, buffer->state_ref);
+  *demo_state = (FakeLuaState *)lua_touserdata(L, -1);
+  lua_pop(L, 1);  // The state is kept alive by state_ref.
+  // The C-side buffer remembers a lua_State; keep it current in case this
+  // call is being made from a different coroutine than the last one.
+  buffer->b.L = L;
+  return buffer;
+}
+
+// This drops the registry refs held while a buffer is in progress.
+static void release_buffer(lua_State *L, DemoBuffer *buffer) {
+  luaL_unref(L, LUA_REGISTRYINDEX, buffer->state_ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, buffer->buffer_ref);
+  buffer->state_ref  = LUA_NOREF;
+  buffer->buffer_ref = LUA_NOREF;
+}
+
+static int demo_luaL_buffinit(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  DemoBuffer *buffer = (DemoBuffer *)luaL_checkudata(L, 2,
+                                                     demo_buffer_metatable);
+  if (buffer->state_ref != LUA_NOREF) release_buffer(L, buffer);
+  lua_pushvalue(L, 1);
+  buffer->state_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_pushvalue(L, 2);
+  buffer->buffer_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  load_state(L, demo_state);
+  buffer->base = lua_gettop(L);
+  luaL_buffinit(L, &buffer->b);
+  demo_state->buffer = buffer;
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  return 0;  // Number of values to return that are on the stack.
+}
+
+static int demo_luaL_addlstring(lua_State *L) {
+  FakeLuaState *demo_state;
+  DemoBuffer *buffer = check_buffer(L, 1, &demo_state);
+  size_t len;
+  const char *arg1 = luaL_checklstring(L, 2, &len);
+  size_t arg2 = (size_t)luaL_checkint(L, 3);
+  if (arg2 > len) arg2 = len;  // Don't read past the end of the Lua string.
+  load_state(L, demo_state);
+  luaL_addlstring(&buffer->b, arg1, arg2);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  return 0;  // Number of values to return that are on the stack.
+}
+
+static int demo_luaL_addvalue(lua_State *L) {
+  FakeLuaState *demo_state;
+  DemoBuffer *buffer = check_buffer(L, 1, &demo_state);
+  load_state(L, demo_state);
+  luaL_addvalue(&buffer->b);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  return 0;  // Number of values to return that are on the stack.
+}
+
+static int demo_luaL_pushresult(lua_State *L) {
+  FakeLuaState *demo_state;
+  DemoBuffer *buffer = check_buffer(L, 1, &demo_state);
+  load_state(L, demo_state);
+  luaL_pushresult(&buffer->b);
+  demo_state->buffer = NULL;
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  release_buffer(L, buffer);
+  return 0;  // Number of values to return that are on the stack.
+}
+
+// ### Running wrappers in protected mode.
+
+// If a wrapper throws between load_state and save_state (say lua_call's
+// function raised an error, or __index did during lua_gettable), the longjmp
+// skips save_state. Since save_state is the only thing that writes a demo
+// state's saved stack, that stack is still exactly what it was before the
+// call: the call only ever changed the copy loaded onto the host stack, which
+// the error throws away. So rolling back is O(1). All that's left to undo is
+// the globals set by load_state and start_running, which run_protected
+// restores before re-raising the error.
+//
+// It restores them after calls that succeed, too, so that code run by one
+// wrapper, as with lua_call, can make calls of its own on other demo states.
+//
+// This records the name and second argument of the call about to be made, for
+// the performance lint.
+static void record_lint_args(lua_State *L) {
+  lint_fn  = lua_tostring(L, lua_upvalueindex(2));
+  lint_arg = lua_tonumber(L, 2);
+  // Don't use lua_tostring on a number, which would convert the argument.
+  const char *s = (lua_type(L, 2) == LUA_TSTRING) ? lua_tostring(L, 2) : NULL;
+  snprintf(lint_arg_str, sizeof(lint_arg_str), "%s", s ? s : "");
+}
+
+// This returns a ref to a record of the call about to be made, with the
+// arguments at stack[1..], for apidemo.export_c.
+static int record_call(lua_State *L) {
+  int n = lua_gettop(L), k;
+  luaL_checkstack(L, 2, "too many arguments to record");
+  lua_createtable(L, n, 2);
+      // stack = [args, record]
+  lua_pushvalue(L, lua_upvalueindex(2));
+  lua_setfield(L, -2, "name");
+  lua_pushinteger(L, n);
+  lua_setfield(L, -2, "n");
+  for (k = 1; k <= n; ++k) {
+    lua_pushvalue(L, k);
+    lua_rawseti(L, -2, k);
+  }
+  return luaL_ref(L, LUA_REGISTRYINDEX);
+      // stack = [args]
+}
+
+// The closure's upvalues are the wrapper to run, its name, its CallKind, and
+// its flight_name_id. The name is needed because luaL_argerror can't find a
+// name for a function called by lua_pcall, and reports it as '?'.
+// Calls that might run Lua code move untracked_epoch on, so the render cache
+// won't reuse any table's text, and the code_runs of the state they load; see
+// load_state. Reads leave both to note_table_read.
+static int run_protected(lua_State *L) {
+  CallKind kind = (CallKind)lua_tointeger(L, lua_upvalueindex(3));
+  if (kind == call_may_run_code) untracked_epoch++;
+  CallKind outer_kind = running_kind;
+  running_kind = kind;
+
+  FakeLuaState *outer_state      = current_state;
+  MemStats      outer_call_start = call_start;
+  int           outer_measuring  = is_measuring;
+  RunState      outer_run        = run;
+  unsigned long outer_run_starts = run_starts;
+  const char   *outer_lint_fn    = lint_fn;
+  lua_Number    outer_lint_arg   = lint_arg;
+  int           outer_record_ref = call_record_ref;
+  uint64_t      outer_call       = flight_call;
+  int           outer_level      = observe_level;
+  int           is_observed      = (has_observer || stream_fd >= 0) &&
+                                   !is_observing;
+  clock_t       start            = 0;
+  // What a call on another demo state adds to the host's live bytes isn't
+  // held against the budget of the code that made it.
+  double        live_before      = 0;
+  if (run.is_running && run.max_bytes) {
+    MemStats now;
+    read_mem_stats(L, &now);
+    live_before = (double)(now.allocated - now.freed);
+  }
+  current_state = NULL;
+  if (options.lint) record_lint_args(L);
+  call_record_ref = options.record_calls ? record_call(L) : LUA_NOREF;
+  if (flight) flight_begin(L, (int)lua_tointeger(L, lua_upvalueindex(4)));
+  if (is_observed) {
+    observe_begin(L, outer_level + 1);
+    start = clock();
+  }
+  observe_level = is_observed ? outer_level + 1 : 0;
+
+      // stack = [args]
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_insert(L, 1);
+      // stack = [wrapper, args]
+  int status = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+      // stack = [results] | [errmsg]
+  if (status && run_starts != outer_run_starts) stop_running(L, status);
+
+  // A call that failed between load_state and save_state leaves its state's
+  // saved stack as it was, so the fields it changed go back too.
+  FakeLuaState *inner_state = current_state;
+  if (status && inner_state) {
+    inner_state->buffer      = inner_state->at_load.buffer;
+    inner_state->is_started  = inner_state->at_load.is_started;
+    inner_state->checked_top = inner_state->at_load.checked_top;
+    inner_state->is_loaded   = 0;
+  }
+  current_state = outer_state;
+  call_start    = outer_call_start;
+  is_measuring  = outer_measuring;
+  is_capturing  = 0;
+  is_rendering  = 0;
+  lint_fn       = outer_lint_fn;
+  running_kind  = outer_kind;
+  lint_arg      = outer_lint_arg;
+  luaL_unref(L, LUA_REGISTRYINDEX, call_record_ref);
+  call_record_ref = outer_record_ref;
+  capture_tables  = 0;
+  flight_call     = outer_call;
+  observe_level   = outer_level;
+  // Only a call that ran code of its own replaced run; otherwise it's still
+  // the outer code's, and may have been updated by counting_alloc.
+  if (run_starts != outer_run_starts) run = outer_run;
+  if (run.is_running && run.max_bytes && inner_state != run.state) {
+    MemStats now;
+    read_mem_stats(L, &now);
+    double added = (double)(now.allocated - now.freed) - live_before;
+    if (added > 0) run.excluded += added;
+  }
+
+  const char *msg = status ? lua_tostring(L, -1) : NULL;
+  if (msg && strncmp(msg, "bad argument #", 14) == 0) {
+    lua_pushfstring(L, "to '%s'", lua_tostring(L, lua_upvalueindex(2)));
+    luaL_gsub(L, msg, "to '?'", lua_tostring(L, -1));
+        // stack = [errmsg, "to 'name'", fixed_errmsg]
+  }
+  if (is_observed) {
+    observe_end(L, outer_level + 1, status,
+                (double)(clock() - start) / CLOCKS_PER_SEC);
+  }
+  if (status == 0) return lua_gettop(L);
+  return lua_error(L);
+}
+
+// These API functions can't change what's inside a table, or run Lua code
+// that might. Please keep these alphabetized.
+static const char *stack_only_fns[] = {
+  "lua_checkstack", "lua_createtable", "lua_gettop", "lua_insert",
+  "lua_isboolean", "lua_iscfunction", "lua_isfunction", "lua_islightuserdata",
+  "lua_isnil", "lua_isnone", "lua_isnoneornil", "lua_isnumber",
+  "lua_isstring", "lua_istable", "lua_isthread", "lua_isuserdata",
+  "lua_newtable", "lua_newuserdata", "lua_next", "lua_objlen", "lua_pop",
+  "lua_pushboolean", "lua_pushinteger", "lua_pushlightuserdata",
+  "lua_pushlstring", "lua_pushnil", "lua_pushnumber", "lua_pushstring",
+  "lua_pushvalue", "lua_rawequal", "lua_rawget", "lua_rawgeti", "lua_rawlen",
+  "lua_remove", "lua_replace",
+  "lua_settop", "lua_toboolean", "lua_tointeger", "lua_tolstring",
+  "lua_tonumber", "lua_tostring", "lua_touserdata", "lua_type",
+  "lua_typename", "luaL_checkstack", "luaL_typename", NULL
+};
+
+// These write to one table, given by index, and call note_table_write after.
+static const char *table_write_fns[] = {
+  "lua_rawset", "lua_rawseti", "lua_setfield", "lua_settable", NULL
+};
+
+// These read from one value, and call note_table_read before.
+static const char *table_read_fns[] = {
+  "lua_getfield", "lua_getglobal", "lua_gettable", NULL
+};
+
+static int is_listed(const char **fns, const char *name) {
+  const char **fn;
+  for (fn = fns; *fn; ++fn) {
+    if (strcmp(*fn, name) == 0) return 1;
+  }
+  return 0;
+}
+
+static CallKind call_kind(const char *name) {
+  if (is_listed(stack_only_fns, name))  return call_stack_only;
+  if (is_listed(table_write_fns, name)) return call_writes_table;
+  if (is_listed(table_read_fns, name))  return call_reads_table;
+  return call_may_run_code;
+}
+
+// This pushes fn as a closure that runs it through run_protected. The name
+// must be a literal, or otherwise last as long as the module; see
+// flight_name_id.
+static void push_protected(lua_State *L, lua_CFunction fn, const char *name) {
+  lua_pushcfunction(L, fn);
+  lua_pushstring(L, name);
+  lua_pushinteger(L, call_kind(name));
+  lua_pushinteger(L, flight_name_id(name));
+  lua_pushcclosure(L, run_protected, 4);
+}
+
+
+// ### Define setup_globals.
+
+// setup_globals is a single Lua-facing function to register all our C-API-like
+// functions in a single go.
+
+#define register_fn(lua_fn_name)                         \
+  push_protected(L, demo_ ## lua_fn_name, #lua_fn_name); \
+  lua_setglobal(L, #lua_fn_name)
+
+// lua_yield can't run under lua_pcall, as Lua 5.1 can't yield across it.
+#define register_unprotected_fn(lua_fn_name) \
+  lua_register(L, #lua_fn_name, demo_ ## lua_fn_name)
+
+#define register_const(const_name)             \
+  lua_pushnumber(L, (lua_Number)const_name);   \
+  lua_setglobal(L, #const_name);
+
+static int setup_globals(lua_State *L) {
+  register_fn(luaL_newstate);
+
+  // Please keep these alphabetized.
+  register_fn(lua_call);
+  register_fn(lua_checkstack);
+  register_fn(lua_close);
+  register_fn(lua_concat);
+  register_fn(lua_createtable);
+  register_fn(lua_getfield);
+  register_fn(lua_getglobal);
+  register_fn(lua_getmetatable);
+  register_fn(lua_gettable);
+  register_fn(lua_gettop);
+  register_fn(lua_gc);
+  register_fn(lua_error);
+  register_fn(lua_insert);
+  register_fn(lua_isboolean);
+  register_fn(lua_isfunction);
+  register_fn(lua_isnil);
+  register_fn(lua_isnone);
+  register_fn(lua_isnoneornil);
+  register_fn(lua_isnumber);
+  register_fn(lua_isstring);
+  register_fn(lua_istable);
+  register_fn(lua_isuserdata);
+  register_fn(lua_newtable);
+  register_fn(lua_newthread);
+  register_fn(lua_newuserdata);
+  register_fn(lua_next);
+  register_fn(lua_pcall);
+  register_fn(lua_pop);
+  register_fn(lua_pushboolean);
+  register_fn(lua_pushfstring);
+  register_fn(lua_pushlstring);
+  register_fn(lua_pushnil);
+  register_fn(lua_pushnumber);
+  register_fn(lua_pushstring);
+  register_fn(lua_pushvalue);
+  register_fn(lua_rawequal);
+  register_fn(lua_rawget);
+  register_fn(lua_rawgeti);
+  register_fn(lua_rawset);
+  register_fn(lua_rawseti);
+  register_fn(lua_remove);
+  register_fn(lua_replace);
+  register_fn(lua_resume);
+  register_fn(lua_setfield);
+  register_fn(lua_setglobal);
+  register_fn(lua_setmetatable);
+  register_fn(lua_settable);
+  register_fn(lua_settop);
+  register_fn(lua_status);
+  register_fn(lua_toboolean);
+  register_fn(lua_tointeger);
+  register_fn(lua_tolstring);
+  register_fn(lua_tonumber);
+  register_fn(lua_tostring);
+  register_fn(lua_touserdata);
+  register_fn(lua_type);
+  register_fn(lua_typename);
+  register_fn(lua_xmove);
+  register_unprotected_fn(lua_yield);
+
+// Version-specific functions.
+
+#if LUA_VERSION_NUM == 501
+  register_fn(lua_equal);
+  register_fn(lua_lessthan);
+  register_fn(lua_objlen);
+#else
+  register_fn(lua_rawlen);
+#endif
+
+  register_fn(luaL_addlstring);
+  register_fn(luaL_addvalue);
+  register_fn(luaL_argerror);
+  register_fn(luaL_buffinit);
+  register_fn(luaL_Buffer);
+  register_fn(luaL_callmeta);
+  register_fn(luaL_checkany);
+  register_fn(luaL_checkint);
+  register_fn(luaL_checknumber);
+  register_fn(luaL_checkstring);
+  register_fn(luaL_checktype);
+  register_fn(luaL_dofile);
+  register_fn(luaL_dostring);
+  register_fn(luaL_getmetafield);
+  register_fn(luaL_loadfile);
+  register_fn(luaL_loadstring);
+  register_fn(luaL_optint);
+  register_fn(luaL_optnumber);
+  register_fn(luaL_optstring);
+  register_fn(luaL_pushresult);
+  register_fn(luaL_typename);
+
+  // Set up C-like constants.
+  lua_pushnumber(L, 0);
+  lua_setglobal(L, "NULL");
+
+  register_const(LUA_YIELD);
+  register_const(LUA_ERRRUN);
+  register_const(LUA_ERRSYNTAX);
+  register_const(LUA_ERRMEM);
+  register_const(LUA_ERRERR);
+  register_const(LUA_ERRFILE);
+
+  register_const(LUA_TNONE);
+  register_const(LUA_TNIL);
+  register_const(LUA_TBOOLEAN);
+  register_const(LUA_TLIGHTUSERDATA);
+  register_const(LUA_TNUMBER);
+  register_const(LUA_TSTRING);
+  register_const(LUA_TTABLE);
+  register_const(LUA_TFUNCTION);
+  register_const(LUA_TUSERDATA);
+  register_const(LUA_TTHREAD);
+
+  register_const(LUA_REGISTRYINDEX);
+#if LUA_VERSION_NUM == 501
+  register_const(LUA_GLOBALSINDEX);
+#endif
+
+  register_const(LUA_MULTRET);
+
+  register_const(LUA_GCSTOP);
+  register_const(LUA_GCRESTART);
+  register_const(LUA_GCCOLLECT);
+  register_const(LUA_GCCOUNT);
+  register_const(LUA_GCCOUNTB);
+  register_const(LUA_GCSTEP);
+  register_const(LUA_GCSETPAUSE);
+  register_const(LUA_GCSETSTEPMUL);
+#ifdef LUA_GCISRUNNING
+  register_const(LUA_GCISRUNNING);
+#endif
+#ifdef LUA_GCGEN
+  register_const(LUA_GCGEN);
+  register_const(LUA_GCINC);
+#endif
+
+  return 0;  // Number of values to return that are on the stack.
+}
+
+int show_help(lua_State *L) {
+  printf("%s", help_string);
+  return 0;
+}
+
+// ## Module-level functions that aren't part of the simulated API.
+
+// This sets *limit to the number at opts[name], where opts is at stack[1].
+// Both false and 0 mean no limit; nil leaves the limit as it was.
+static void set_limit(lua_State *L, const char *name, int *limit) {
+      // stack = [opts]
+  lua_getfield(L, 1, name);
+      // stack = [opts, opts[name]]
+  if (!lua_isnil(L, -1)) *limit = (int)lua_tointeger(L, -1);
+  lua_pop(L, 1);
+      // stack = [opts]
+}
+
+// This sets any options given as fields in the table at stack[1].
+static int set_options(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+      // stack = [opts]
+  lua_getfield(L, 1, "show_memory");
+      // stack = [opts, opts.show_memory]
+  if (!lua_isnil(L, -1)) options.show_memory = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+      // stack = [opts]
+  lua_getfield(L, 1, "show_gc");
+      // stack = [opts, opts.show_gc]
+  if (!lua_isnil(L, -1)) options.show_gc = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+      // stack = [opts]
+  lua_getfield(L, 1, "cache_chunks");
+      // stack = [opts, opts.cache_chunks]
+  if (!lua_isnil(L, -1)) options.cache_chunks = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+      // stack = [opts]
+  lua_getfield(L, 1, "chunk_cache_dir");
+      // stack = [opts, opts.chunk_cache_dir]
+  if (!lua_isnil(L, -1)) {
+    if (!lua_isstring(L, -1)) lua_pushnil(L);  // false turns the disk cache off.
+    const char *dir = lua_tostring(L, -1);
+    if (dir && !is_private_dir(dir)) {
+      luaL_error(L, "chunk_cache_dir '%s' must be a directory owned by this "
+                    "user and not writable by group or others", dir);
+    }
+    lua_setfield(L, LUA_REGISTRYINDEX, chunk_cache_dir_key);
+  } else {
+    lua_pop(L, 1);
+  }
+      // stack = [opts]
+  lua_getfield(L, 1, "lint");
+      // stack = [opts, opts.lint]
+  if (!lua_isnil(L, -1)) options.lint = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+      // stack = [opts]
+  lua_getfield(L, 1, "cache_tables");
+      // stack = [opts, opts.cache_tables]
+  if (!lua_isnil(L, -1)) options.cache_tables = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+      // stack = [opts]
+  lua_getfield(L, 1, "record_calls");
+      // stack = [opts, opts.record_calls]
+  if (!lua_isnil(L, -1)) options.record_calls = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+      // stack = [opts]
+  lua_getfield(L, 1, "quiet");
+      // stack = [opts, opts.quiet]
+  if (!lua_isnil(L, -1)) is_quiet = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+      // stack = [opts]
+  set_limit(L, "max_bytes", &options.max_bytes);
+  set_limit(L, "max_items", &options.max_items);
+  set_limit(L, "max_depth", &options.max_depth);
+  set_limit(L, "max_width", &options.max_width);
+  set_limit(L, "window",    &options.window);
+  set_limit(L, "max_history", &options.max_history);
+  lua_getfield(L, 1, "max_seconds");
+      // stack = [opts, opts.max_seconds]
+  if (!lua_isnil(L, -1)) options.max_seconds = lua_tonumber(L, -1);
+  lua_pop(L, 1);
+      // stack = [opts]
+  // Cached tables may have been printed with other limits.
+  untracked_epoch++;
+  lua_getfield(L, 1, "diff_only");
+      // stack = [opts, opts.diff_only]
+  if (!lua_isnil(L, -1)) options.diff_only = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+      // stack = [opts]
+  lua_getfield(L, 1, "show_tables");
+      // stack = [opts, opts.show_tables]
+  if (!lua_isnil(L, -1)) options.show_tables = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+      // stack = [opts]
+  lua_getfield(L, 1, "flight_recorder");
+  lua_getfield(L, 1, "flight_entries");
+      // stack = [opts, opts.flight_recorder, opts.flight_entries]
+  if (lua_isstring(L, -2)) {
+    int num_entries = lua_isnil(L, -1) ? flight_default_entries
+                                       : (int)lua_tointeger(L, -1);
+    luaL_argcheck(L, num_entries > 0, 1, "flight_entries must be positive");
+    flight_open(L, lua_tostring(L, -2), num_entries);
+  } else if (lua_isboolean(L, -2) && !lua_toboolean(L, -2)) {
+    flight_close();
+  }
+  lua_pop(L, 2);
+      // stack = [opts]
+  lua_getfield(L, 1, "stream");
+      // stack = [opts, opts.stream]
+  if (lua_isstring(L, -1)) {
+    stream_open(L, lua_tostring(L, -1));
+  } else if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+    stream_close();
+  }
+  lua_pop(L, 1);
+      // stack = [opts]
+  return 0;
+}
+
+static void push_mem_stats(lua_State *L, MemStats *mem) {
+      // stack = [..]
+  lua_newtable(L);
+      // stack = [.., t]
+  lua_pushnumber(L, (lua_Number)mem->allocated);
+  lua_setfield(L, -2, "allocated");
+  lua_pushnumber(L, (lua_Number)mem->freed);
+  lua_setfield(L, -2, "freed");
+  lua_pushnumber(L, (lua_Number)mem->allocs);
+  lua_setfield(L, -2, "allocs");
+  lua_pushnumber(L, (lua_Number)mem->frees);
+  lua_setfield(L, -2, "frees");
+  lua_pushnumber(L, (lua_Number)mem->gc_cycles);
+  lua_setfield(L, -2, "gc_cycles");
+  lua_pushnumber(L, mem->lua_gc_seconds);
+  lua_setfield(L, -2, "lua_gc_seconds");
+      // stack = [.., t]
+}
+
+// This reads limits.name, where limits is at stack[2], as a budget: a
+// number below max, or 0, false or nil for no limit.
+static lua_Number get_budget(lua_State *L, const char *name, lua_Number max) {
+  lua_getfield(L, 2, name);
+      // stack = [demo_L, limits, limits.name]
+  lua_Number limit = 0;
+  if (lua_isnumber(L, -1)) {
+    limit = lua_tonumber(L, -1);
+  } else if (lua_toboolean(L, -1)) {
+    luaL_error(L, "budget '%s' must be a number or false", name);
+  }
+  lua_pop(L, 1);
+      // stack = [demo_L, limits]
+  if (limit < 0) luaL_error(L, "budget '%s' can't be negative", name);
+  if (!(limit < max)) luaL_error(L, "budget '%s' is too big", name);
+  return limit;
+}
+
+// apidemo.budget(L, {instructions = n, bytes = n, seconds = t}) limits each
+// lua_call, lua_pcall, luaL_dostring and luaL_dofile made on L. Limits left
+// out have no limit, so apidemo.budget(L, {}) removes them all.
+static int budget(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+      // stack = [demo_L, limits]
+  RunSettings *settings = &demo_state->settings;
+  settings->max_instructions =
+      (long)get_budget(L, "instructions", (lua_Number)LONG_MAX);
+  settings->max_bytes =
+      (size_t)get_budget(L, "bytes", (lua_Number)SIZE_MAX);
+  settings->max_seconds = get_budget(L, "seconds", HUGE_VAL);
+  return 0;
+}
+
+// apidemo.profile(L, period) starts sampling the code that L runs every
+// `period` VM instructions, and clears any earlier samples. A period of 0 (or
+// false) stops sampling and keeps the samples.
+static int profile(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int period = lua_isboolean(L, 2) ? (lua_toboolean(L, 2) ? 1000 : 0)
+                                   : luaL_optint(L, 2, 1000);
+  luaL_argcheck(L, period >= 0, 2, "period can't be negative");
+  demo_state->settings.profile_period = period;
+  if (period == 0) return 0;
+      // stack = [demo_L, period]
+  load_states_table(L);
+  lua_rawgeti(L, -1, demo_state->ref);
+      // stack = [demo_L, period, states_table, demo_state_data]
+  lua_newtable(L);
+  lua_setfield(L, -2, "profile");
+  return 0;
+}
+
+// apidemo.profile_dump(L [, path]) writes L's samples as folded stacks, one
+// "frame;frame;frame count" line per distinct stack. With no path, the lines
+// are returned as a string instead.
+static int profile_dump(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  const char *path = luaL_optstring(L, 2, NULL);
+  lua_settop(L, 2);
+      // stack = [demo_L, path]
+  load_states_table(L);
+  lua_rawgeti(L, -1, demo_state->ref);
+  lua_getfield(L, -1, "profile");
+      // stack = [demo_L, path, states_table, demo_state_data, counts]
+  lua_newtable(L);
+      // stack = [demo_L, path, states_table, demo_state_data, counts, lines]
+  int num_lines = 0;
+  if (lua_istable(L, 5)) {
+    lua_pushnil(L);
+    while (lua_next(L, 5)) {
+      // stack = [.., counts, lines, key, count]
+      lua_pushfstring(L, "%s %d\n", lua_tostring(L, -2),
+                      (int)lua_tonumber(L, -1));
+      lua_rawseti(L, 6, ++num_lines);
+      lua_pop(L, 1);
+      // stack = [.., counts, lines, key]
+    }
+  }
+  int k;
+  if (path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) return luaL_error(L, "can't open %s for writing", path);
+    for (k = 1; k <= num_lines; ++k) {
+      lua_rawgeti(L, 6, k);
+      fputs(lua_tostring(L, -1), f);
+      lua_pop(L, 1);
+    }
+    fclose(f);
+    return 0;
+  }
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  for (k = 1; k <= num_lines; ++k) {
+    lua_rawgeti(L, 6, k);
+    luaL_addvalue(&b);
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+// apidemo.memory(L) returns a table describing the memory attributed to the
+// demo state L. The byte and allocation counts it "owns" are net totals over
+// all of its calls. Since the collector may free other states' garbage during
+// a call, these are estimates rather than exact ownership.
+static int memory(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  MemStats *mem = &demo_state->mem;
+  void *ud;
+      // stack = [demo_L]
+  push_mem_stats(L, mem);
+      // stack = [demo_L, t]
+  lua_pushnumber(L, (lua_Number)mem->allocated - (lua_Number)mem->freed);
+  lua_setfield(L, -2, "bytes");
+  lua_pushnumber(L, (lua_Number)mem->allocs - (lua_Number)mem->frees);
+  lua_setfield(L, -2, "allocations");
+  push_mem_stats(L, &demo_state->last_call);
+  lua_setfield(L, -2, "last_call");
+  lua_pushnumber(L, (lua_Number)lua_gc(L, LUA_GCCOUNT, 0) * 1024 +
+                    lua_gc(L, LUA_GCCOUNTB, 0));
+  lua_setfield(L, -2, "host_bytes");
+  lua_pushboolean(L, lua_getallocf(L, &ud) == counting_alloc);
+  lua_setfield(L, -2, "counts_allocs");
+      // stack = [demo_L, t]
+  return 1;
+}
+
+// apidemo.chunk_cache() returns the compiled-chunk cache's counts: hits and
+// misses in memory, disk_hits, and disk_writes.
+static int chunk_cache(lua_State *L) {
+  lua_createtable(L, 0, 4);
+      // stack = [t]
+  lua_pushnumber(L, chunk_hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, chunk_misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushnumber(L, chunk_disk_hits);
+  lua_setfield(L, -2, "disk_hits");
+  lua_pushnumber(L, chunk_disk_writes);
+  lua_setfield(L, -2, "disk_writes");
+  return 1;
+}
+
+// apidemo.lint(L) returns the list of lint warnings reported for L.
+static int lint(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+      // stack = [demo_L]
+  load_states_table(L);
+  lua_rawgeti(L, -1, demo_state->ref);
+      // stack = [demo_L, states_table, demo_state_data]
+  push_data_table(L, 3, "lint");
+  push_data_table(L, 4, "warnings");
+      // stack = [demo_L, states_table, demo_state_data, lint, warnings]
+  return 1;
+}
+
+// apidemo.undo(L), apidemo.redo(L) and apidemo.goto(L, step) move L through
+// the history of its calls, print its stack, and return the step it's at.
+// Step 0 is the new state, and step k is the state after k calls; undo and
+// redo do nothing when there's no step to move to. Only the stack is restored:
+// tables and other values it refers to are shared, not copied.
+
+static int seek_history(lua_State *L, FakeLuaState *demo_state, int target) {
+  if (demo_state->buffer) {
+    return luaL_error(L, "can't move through history while a luaL_Buffer "
+                         "is in use");
+  }
+  check_not_busy(L, demo_state);
+  if (target < demo_state->first_step) target = demo_state->first_step;
+  if (target > demo_state->num_steps) target = demo_state->num_steps;
+      // stack = [..]
+  load_states_table(L);
+  lua_rawgeti(L, -1, demo_state->ref);
+      // stack = [.., states_table, demo_state_data]
+  seek_step(L, demo_state, lua_gettop(L), target);
+  lua_pop(L, 2);
+      // stack = [..]
+  print_saved_stack(L, demo_state);
+  lua_pushinteger(L, demo_state->step);
+  return 1;
+}
+
+static int undo(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  return seek_history(L, demo_state, demo_state->step - 1);
+}
+
+static int redo(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  return seek_history(L, demo_state, demo_state->step + 1);
+}
+
+static int goto_step(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int step = luaL_checkint(L, 2);
+  luaL_argcheck(L, step >= demo_state->first_step &&
+                   step <= demo_state->num_steps, 2,
+                "no such step in this state's history");
+  return seek_history(L, demo_state, step);
+}
+
+// apidemo.inspect(L, i) returns a table describing how the table at stack[i]
+// of demo state L is laid out: array_size, hash_size, hash_used,
+// int_keys_in_hash, rehashes, exact, which is true when the sizes were read
+// from the table itself, and estimated, which is true when they're only a
+// guess. It doesn't count as a call on L.
+static int inspect(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int i = luaL_checkint(L, 2);
+      // stack = [demo_L, i]
+  load_states_table(L);
+  lua_rawgeti(L, -1, demo_state->ref);
+      // stack = [demo_L, i, states_table, demo_state_data]
+  lua_getfield(L, -1, "num_items");
+  int num_items = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  if (i < 0) i += num_items + 1;
+  luaL_argcheck(L, 1 <= i && i <= num_items, 2, "no such stack index");
+  lua_rawgeti(L, -1, i);
+      // stack = [demo_L, i, states_table, demo_state_data, item]
+  if (!lua_istable(L, -1)) luaL_argerror(L, 2, "not a table");
+  TableShape shape;
+  measure_table(L, -1, &shape);
+  lua_createtable(L, 0, 7);
+      // stack = [demo_L, i, states_table, demo_state_data, item, t]
+  lua_pushinteger(L, shape.array_size);
+  lua_setfield(L, -2, "array_size");
+  lua_pushinteger(L, shape.hash_size);
+  lua_setfield(L, -2, "hash_size");
+  lua_pushinteger(L, shape.hash_used);
+  lua_setfield(L, -2, "hash_used");
+  lua_pushinteger(L, shape.int_keys_in_hash);
+  lua_setfield(L, -2, "int_keys_in_hash");
+  lua_pushinteger(L, shape.rehashes);
+  lua_setfield(L, -2, "rehashes");
+  lua_pushboolean(L, shape.is_exact);
+  lua_setfield(L, -2, "exact");
+  lua_pushboolean(L, shape.is_estimated);
+  lua_setfield(L, -2, "estimated");
+  return 1;
+}
+
+
+// ## Stack fingerprints.
+
+// apidemo.fingerprint(L) returns a 64-bit hash of L's stack as 16 hex digits.
+// Two stacks get the same fingerprint when they hold equal values in the same
+// order, where tables are equal if they have equal keys mapped to equal
+// values, to any depth. A table met again inside itself hashes by how many
+// levels up it was first seen, so cycles are fine. Other values, such as
+// functions and userdata, count only by type, so stacks on separate states
+// can be compared.
+//
+// Each state keeps the hash of every item and the running hash of its stack up
+// to every slot, in the userdata data.fingerprints, and a call that changes
+// the stack only marks the slots above those it kept as stale; see save_items.
+// The next fingerprint hashes just the stale slots. data.fingerprint_reached
+// maps every table hashed to the lowest slot it was reached from, and if a
+// demo call has written to one since, the tables from that slot up are hashed
+// again, and the running hashes chained again from there. After a call on
+// this state that may have run Lua code, all its tables are. Lua code can
+// also change tables outside of demo calls, or through a call on another
+// state, which apidemo doesn't track; apidemo.fingerprint(L, true) rehashes
+// the whole stack.
+//
+// A table reached more than once in one fingerprint, such as a table shared
+// by several others, is hashed only the first time; see hash_value.
+
+// Tables nested deeper than this hash by type, like functions.
+#define max_fingerprint_depth 64
+
+typedef struct {
+  uint64_t item;     // The hash of this slot's value.
+  uint64_t running;  // The hash of the stack up to and including this slot.
+} SlotHash;
+
+// A HashWalk is the state of one update_fingerprint call. Tables whose hash
+// doesn't depend on where they were reached from are memoized in the table at
+// stack[memo], mapped to a string holding a TableHash. If reached isn't 0,
+// each table hashed is also recorded in the table at stack[reached], mapped to
+// the lowest slot it was reached from; slot is the one being hashed.
+typedef struct {
+  const void *path[max_fingerprint_depth];  // The tables being hashed.
+  int         memo;
+  int         deepest;  // The deepest table reached in the current subtree.
+  int         reached;
+  int         slot;
+} HashWalk;
+
+typedef struct {
+  uint64_t hash;
+  int      height;  // How many levels of tables were hashed below this one.
+} TableHash;
+
+// This is the finalizer from splitmix64, which spreads every input bit over
+// every output bit.
+static uint64_t mix64(uint64_t h) {
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
+
+// This returns the hash of stack[i], reached at the given depth of tables.
+// walk->path holds the depth tables currently being hashed, outermost first.
+// A hash that depends on the path above depth lowers *reach to the lowest
+// path index it refers to, or to -1 if it was cut off at the depth limit.
+// A table is only memoized when its own hash depends on neither, and a memo
+// is only used where hashing the table again couldn't reach the limit.
+static uint64_t hash_value(lua_State *L, int i, HashWalk *walk, int depth,
+                           int *reach) {
+  int type = lua_type(L, i);
+  uint64_t h = mix64(type + 1);
+  if (type == LUA_TBOOLEAN) return mix64(h + lua_toboolean(L, i));
+  if (type == LUA_TNUMBER) {
+    double n = (double)lua_tonumber(L, i);
+    if (n == 0) n = 0;  // Treat -0 as 0, as == does.
+    uint64_t bits;
+    memcpy(&bits, &n, sizeof(bits));
+    if (n != n) bits = 0x7ff8000000000000ULL;  // All NaNs are alike.
+    return mix64(h ^ bits);
+  }
+  if (type == LUA_TSTRING) {
+    size_t len, k;
+    const char *s = lua_tolstring(L, i, &len);
+    for (k = 0; k < len; ++k) h = (h ^ (unsigned char)s[k]) * 1099511628211ULL;
+    return mix64(h ^ len);
+  }
+  if (type != LUA_TTABLE) return h;
+  if (depth == max_fingerprint_depth) {
+    *reach = -1;
+    return h;
+  }
+
+  i = abs_index(L, i);
+  luaL_checkstack(L, 3, "tables nested too deeply to fingerprint");
+  TableHash memo;
+  lua_pushvalue(L, i);
+  lua_rawget(L, walk->memo);
+  size_t len = 0;
+  const char *saved = lua_tolstring(L, -1, &len);
+  if (len == sizeof(memo)) memcpy(&memo, saved, sizeof(memo));
+  lua_pop(L, 1);
+  if (len == sizeof(memo) && depth + memo.height < max_fingerprint_depth) {
+    if (walk->deepest < depth + memo.height) {
+      walk->deepest = depth + memo.height;
+    }
+    return memo.hash;
+  }
+
+  const void *t = lua_topointer(L, i);
+  int k;
+  for (k = 0; k < depth; ++k) {
+    if (walk->path[k] == t) {  // A cycle.
+      if (*reach > k) *reach = k;
+      return mix64(h ^ mix64(depth - k));
+    }
+  }
+  walk->path[depth] = t;
+  if (walk->reached) {
+    lua_pushvalue(L, i);
+    lua_rawget(L, walk->reached);
+    if (lua_isnil(L, -1) || lua_tointeger(L, -1) > walk->slot) {
+      lua_pushvalue(L, i);
+      lua_pushinteger(L, walk->slot);
+      lua_rawset(L, walk->reached);
+    }
+    lua_pop(L, 1);
+  }
+  int outer_deepest = walk->deepest;
+  walk->deepest = depth;
+  int table_reach = depth;
+  // Entries are summed, so the order lua_next visits them in doesn't matter.
+  uint64_t sum = 0;
+  lua_pushnil(L);
+  while (lua_next(L, i)) {
+        // stack = [.., key, value]
+    // While printing, each entry counts as an item; see is_over_budget.
+    if (is_rendering) render_items++;
+    if (is_over_budget()) {
+      lua_pop(L, 2);
+      break;
+    }
+    int top = lua_gettop(L);
+    uint64_t key   = hash_value(L, top - 1, walk, depth + 1, &table_reach);
+    uint64_t value = hash_value(L, top, walk, depth + 1, &table_reach);
+    sum += mix64(key * 31 + value);
+    lua_pop(L, 1);
+  }
+  h = mix64(h ^ sum);
+
+  if (table_reach == depth && !render_cut) {
+    memo.hash   = h;
+    memo.height = walk->deepest - depth;
+    lua_pushvalue(L, i);
+    lua_pushlstring(L, (const char *)&memo, sizeof(memo));
+    lua_rawset(L, walk->memo);
+  }
+  if (*reach > table_reach) *reach = table_reach;
+  if (walk->deepest < outer_deepest) walk->deepest = outer_deepest;
+  return h;
+}
+
+// This returns the hash of stack[i] on its own, as it would be hashed in a
+// fingerprint, recording the tables it reaches as from the given slot in the
+// table at stack[reached], if that isn't 0.
+static uint64_t hash_one_value(lua_State *L, int i, int reached, int slot) {
+  i = abs_index(L, i);
+  lua_newtable(L);
+  HashWalk walk;
+  walk.memo    = lua_gettop(L);
+  walk.deepest = 0;
+  walk.reached = reached;
+  walk.slot    = slot;
+  int reach = 0;
+  uint64_t h = hash_value(L, i, &walk, 0, &reach);
+  lua_pop(L, 1);
+  return h;
+}
+
+// This brings demo_state's hashes up to date for its num_items items, saved in
+// the table at stack[data], and returns the running hash of the last one.
+static uint64_t update_fingerprint(lua_State *L, FakeLuaState *demo_state,
+                                   int data, int num_items) {
+  int valid = demo_state->fingerprint_valid;
+  if (valid > num_items) valid = num_items;
+  int table_slot = demo_state->fingerprint_table_slot;
+  if (table_slot > valid) table_slot = 0;
+
+      // stack = [..]
+  push_weak_data_table(L, data, "fingerprint_reached");
+  int reached = lua_gettop(L);
+  int first = valid + 1;  // The lowest slot to hash again.
+  int did_run_code =
+      (demo_state->fingerprint_code_runs != demo_state->code_runs);
+  if (table_slot && did_run_code) {
+    first = table_slot;
+  } else if (table_slot && demo_state->fingerprint_writes != table_writes) {
+    int lowest = lowest_written_slot(L, reached, valid,
+                                     demo_state->fingerprint_writes);
+    if (lowest < first) first = lowest;
+  }
+  lua_getfield(L, data, "fingerprints");
+  SlotHash *hashes = (SlotHash *)lua_touserdata(L, -1);
+#if LUA_VERSION_NUM == 501
+  size_t capacity = hashes ? lua_objlen(L, -1) / sizeof(SlotHash) : 0;
+#else
+  size_t capacity = hashes ? lua_rawlen(L, -1) / sizeof(SlotHash) : 0;
+#endif
+  if (capacity < (size_t)num_items + 1) {
+    size_t new_capacity = capacity ? capacity : 16;
+    while (new_capacity < (size_t)num_items + 1) new_capacity *= 2;
+    SlotHash *new_hashes =
+        (SlotHash *)lua_newuserdata(L, new_capacity * sizeof(SlotHash));
+    if (hashes) memcpy(new_hashes, hashes, (valid + 1) * sizeof(SlotHash));
+    lua_pushvalue(L, -1);
+    lua_setfield(L, data, "fingerprints");
+    lua_remove(L, -2);
+    hashes = new_hashes;
+  }
+  lua_newtable(L);
+      // stack = [.., reached, fingerprints, memo]
+  HashWalk walk;
+  walk.memo = lua_gettop(L);
+  walk.deepest = 0;
+  walk.reached = reached;
+  hashes[0].running = 0x9e3779b97f4a7c15ULL;  // The hash of an empty stack.
+  int k;
+  for (k = first; k <= num_items; ++k) {
+    lua_rawgeti(L, data, k);
+    int is_table = lua_istable(L, -1);
+    if (is_table && !table_slot) table_slot = k;
+    if (is_table || k > valid) {
+      int reach = 0;
+      walk.slot = k;
+      hashes[k].item = hash_value(L, -1, &walk, 0, &reach);
+    }
+    lua_pop(L, 1);
+    hashes[k].running = mix64(hashes[k - 1].running * 31 + hashes[k].item);
+  }
+  lua_pop(L, 3);
+      // stack = [..]
+  demo_state->fingerprint_valid      = num_items;
+  demo_state->fingerprint_table_slot = table_slot;
+  demo_state->fingerprint_writes     = table_writes;
+  demo_state->fingerprint_code_runs  = demo_state->code_runs;
+  return hashes[num_items].running;
+}
+
+static int fingerprint(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  if (lua_toboolean(L, 2)) demo_state->fingerprint_valid = 0;
+  lua_settop(L, 1);
+      // stack = [demo_L]
+  load_states_table(L);
+  lua_rawgeti(L, -1, demo_state->ref);
+      // stack = [demo_L, states_table, demo_state_data]
+  lua_getfield(L, -1, "num_items");
+  int num_items = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  uint64_t h = update_fingerprint(L, demo_state, 3, num_items);
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)h);
+  lua_pushstring(L, hex);
+  return 1;
+}
 
-#define fn_string_int_in(lua_fn_name)            \
-    fn_start(lua_fn_name);                       \
-    const char *arg1 = luaL_checkstring(L, 2);   \
-    int arg2 = luaL_checkint(L, 3);              \
-    fn_end_2_arg(lua_fn_name)
+// ## Exporting a demo session as C.
 
-#define fn_int_int_in(lua_fn_name)               \
-    fn_start(lua_fn_name);                       \
-    int arg1 = luaL_checkint(L, 2);              \
-    int arg2 = luaL_checkint(L, 3);              \
-    fn_end_2_arg(lua_fn_name)
+// apidemo.export_c(L [, path [, partial]]) writes a standalone C program that
+// makes the calls recorded in L's history, up to its current step, on a real
+// lua_State, and times them in a loop. With no path, the program is returned
+// as a string. Calls are only recorded while options.record_calls is on.
+//
+// Arguments that can be written in C are numbers, strings, booleans, nil, L
+// itself and luaL_Buffers. A call with any other argument, such as another
+// demo state or a function, or a step that wasn't recorded, makes the export
+// fail, since the program wouldn't time the same work. If partial is true,
+// such calls are written out as comments instead. The program's globals are
+// those of a new state with the standard libraries open.
 
-#define fn_number_in(lua_fn_name)                \
-    fn_start(lua_fn_name);                       \
-    lua_Number arg1 = luaL_checknumber(L, 2);    \
-    fn_end_1_arg(lua_fn_name)
+// This pushes the C text for the string s as a literal.
+static void push_c_string(lua_State *L, const char *s, size_t len) {
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  luaL_addchar(&b, '"');
+  size_t k;
+  for (k = 0; k < len; ++k) {
+    unsigned char c = (unsigned char)s[k];
+    char escape[8];
+    if (c == '"' || c == '\\' || c == '?') {
+      snprintf(escape, sizeof(escape), "\\%c", c);
+    } else if (c == '\n') {
+      snprintf(escape, sizeof(escape), "\\n");
+    } else if (c < 32 || c >= 127) {
+      snprintf(escape, sizeof(escape), "\\%03o", c);  // Always 3 digits.
+    } else {
+      snprintf(escape, sizeof(escape), "%c", c);
+    }
+    luaL_addstring(&b, escape);
+  }
+  luaL_addchar(&b, '"');
+  luaL_pushresult(&b);
+}
 
-#define fn_int_in_int_out(lua_fn_name)    \
-    fn_start(lua_fn_name);                \
-    int arg1 = luaL_checkint(L, 2);       \
-    fn_end_1_arg_1_out(lua_fn_name)
+// This pushes the C text for the number n, or returns 0 if it has none. The
+// cast is for an argument to lua_pushfstring, whose conversion is given by
+// spec; spec is 0 for other calls.
+static int push_c_number(lua_State *L, lua_Number n, char spec) {
+  char text[64];
+  if (n != n || n - n != 0) return 0;  // NaN or an infinity.
+  if (n == LUA_REGISTRYINDEX) {
+    snprintf(text, sizeof(text), "LUA_REGISTRYINDEX");
+#if LUA_VERSION_NUM == 501
+  } else if (n == LUA_GLOBALSINDEX) {
+    snprintf(text, sizeof(text), "LUA_GLOBALSINDEX");
+#endif
+  } else if (spec == 'f') {
+    snprintf(text, sizeof(text), "(lua_Number)%.17g", (double)n);
+  } else if (n >= INT_MIN && n <= INT_MAX && n == (int)n) {
+    const char *cast = (spec == 'I' ? "(lua_Integer)" : spec ? "(int)" : "");
+    snprintf(text, sizeof(text), "%s%d", cast, (int)n);
+  } else {
+    snprintf(text, sizeof(text), "%.17g", (double)n);
+  }
+  lua_pushstring(L, text);
+  return 1;
+}
 
-#define fn_int_in_double_out(lua_fn_name)   \
-    fn_start(lua_fn_name);                  \
-    int arg1 = luaL_checkint(L, 2);         \
-    fn_end_1_arg_double_out(lua_fn_name)
+// This returns the conversion letter used for the k-th value formatted by fmt,
+// counting from 1, or 0 if there isn't one.
+static char fstring_spec(const char *fmt, int k) {
+  for (; *fmt; ++fmt) {
+    if (*fmt != '%') continue;
+    if (*++fmt == '\0') break;
+    if (*fmt != '%' && --k == 0) return *fmt;
+  }
+  return 0;
+}
 
-#define fn_int_string_in_int_out(lua_fn_name)    \
-    fn_start(lua_fn_name);                       \
-    int arg1 = luaL_checkint(L, 2);              \
-    const char *arg2 = luaL_checkstring(L, 3);   \
-    fn_end_2_arg_1_out(lua_fn_name)
+// This pushes the C text for stack[i], an argument to a call on demo_state,
+// and returns whether it could be written; "?" is pushed if not. The table at
+// stack[buffers] maps each luaL_Buffer to the number in its C name.
+static int push_c_arg(lua_State *L, int i, FakeLuaState *demo_state,
+                      int buffers, char spec) {
+  size_t len;
+  const char *s;
+  switch (lua_type(L, i)) {
+    case LUA_TNIL:
+      lua_pushliteral(L, "NULL");
+      return 1;
+    case LUA_TBOOLEAN:
+      lua_pushstring(L, lua_toboolean(L, i) ? "1" : "0");
+      return 1;
+    case LUA_TNUMBER:
+      if (push_c_number(L, lua_tonumber(L, i), spec)) return 1;
+      break;
+    case LUA_TSTRING:
+      s = lua_tolstring(L, i, &len);
+      push_c_string(L, s, len);
+      return 1;
+    case LUA_TUSERDATA:
+      if (lua_touserdata(L, i) == demo_state) {
+        lua_pushliteral(L, "L");
+        return 1;
+      }
+      lua_pushvalue(L, i);
+      lua_rawget(L, buffers);
+      if (lua_isnumber(L, -1)) {
+        lua_pushfstring(L, "&b%d", (int)lua_tointeger(L, -1));
+        lua_remove(L, -2);
+        return 1;
+      }
+      lua_pop(L, 1);
+      break;
+  }
+  lua_pushliteral(L, "?");
+  return 0;
+}
 
-#define fn_string_in_int_out(lua_fn_name)        \
-    fn_start(lua_fn_name);                       \
-    const char *arg1 = luaL_checkstring(L, 2);   \
-    fn_end_1_arg_1_out(lua_fn_name)
+// This pushes the C statement for the call recorded in the table at
+// stack[record], and returns whether it could be written. If not, the
+// statement is pushed as a comment.
+static int push_c_call(lua_State *L, int record, FakeLuaState *demo_state,
+                       int buffers) {
+  lua_getfield(L, record, "n");
+  int n = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  luaL_checkstack(L, 2 * n + 4, "too many arguments to export");
+      // stack = [..]
+  lua_getfield(L, record, "name");
+  int is_ok = (strncmp(lua_tostring(L, -1), "lua", 3) == 0);
+  int is_fstring = (strcmp(lua_tostring(L, -1), "lua_pushfstring") == 0);
+  lua_pushliteral(L, "(");
+      // stack = [.., name, "("]
+  int k;
+  for (k = 1; k <= n; ++k) {
+    if (k > 1) lua_pushliteral(L, ", ");
+    lua_rawgeti(L, record, k);
+    char spec = 0;
+    if (is_fstring && k > 2) {
+      lua_rawgeti(L, record, 2);
+      if (lua_type(L, -1) == LUA_TSTRING) {
+        spec = fstring_spec(lua_tostring(L, -1), k - 2);
+      }
+      lua_pop(L, 1);
+    }
+    is_ok = push_c_arg(L, lua_gettop(L), demo_state, buffers, spec) && is_ok;
+    lua_remove(L, -2);
+  }
+  lua_pushliteral(L, ");");
+      // stack = [.., name, "(", <args and commas>, ");"]
+  lua_concat(L, 2 * n + 3 - (n > 0));
+  if (!is_ok) {
+    lua_pushliteral(L, "// ");
+    lua_insert(L, -2);
+    lua_pushliteral(L, "  (not exportable)");
+    lua_concat(L, 3);
+  }
+      // stack = [.., statement]
+  return is_ok;
+}
 
-#define fn_int_in_string_out(lua_fn_name)    \
-    fn_start(lua_fn_name);                   \
-    int arg1 = luaL_checkint(L, 2);          \
-    fn_end_1_arg_str_out(lua_fn_name)
+// This adds the text lua_pushfstring would make to the table at stack[lines].
+static void add_line(lua_State *L, int lines, int *num_lines,
+                     const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  lua_pushvfstring(L, fmt, args);
+  va_end(args);
+  lua_rawseti(L, lines, ++*num_lines);
+}
 
-// ### Wrappers around C API functions defined using the above macros.
+static int export_c(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  const char *path = luaL_optstring(L, 2, NULL);
+  int is_partial = lua_toboolean(L, 3);
+  if (demo_state->first_step > 0) {
+    return luaL_error(L, "can't export: the first %d steps were dropped to "
+                         "keep max_history", demo_state->first_step);
+  }
+  lua_settop(L, 2);
+      // stack = [demo_L, path]
+  load_states_table(L);
+  lua_rawgeti(L, -1, demo_state->ref);
+  lua_getfield(L, -1, "calls");
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+  }
+  lua_replace(L, 3);
+  lua_settop(L, 3);
+  lua_newtable(L);
+  lua_newtable(L);
+      // stack = [demo_L, path, calls, buffers, lines]
+  int calls = 3, buffers = 4, lines = 5, record = 6;
+  int num_lines = 0, num_buffers = 0, max_top = 0, step, k;
 
-// Please keep these alphabetized by API function name.
-fn_int_int_in          (lua_call);
-fn_int_in_int_out      (lua_checkstack);
-fn_int_in              (lua_concat);
-fn_int_string_in       (lua_getfield);
-fn_string_in           (lua_getglobal);
-fn_int_in_int_out      (lua_getmetatable);
-fn_int_in              (lua_gettable);
-fn_nothing_in_int_out  (lua_gettop);
-// Defined below:       lua_error
-fn_int_in              (lua_insert);
-fn_int_in_int_out      (lua_isboolean);
-fn_int_in_int_out      (lua_isfunction);
-fn_int_in_int_out      (lua_isnil);
-fn_int_in_int_out      (lua_isnone);
-fn_int_in_int_out      (lua_isnoneornil);
-fn_int_in_int_out      (lua_isnumber);
-fn_int_in_int_out      (lua_isstring);
-fn_int_in_int_out      (lua_istable);
-fn_nothing_in          (lua_newtable);
-fn_int_in_int_out      (lua_next);
-fn_int_in              (lua_pop);
-fn_int_in              (lua_pushboolean);
-fn_string_int_in       (lua_pushlstring);
-fn_nothing_in          (lua_pushnil);
-fn_number_in           (lua_pushnumber);
-fn_string_in           (lua_pushstring);
-fn_int_in              (lua_pushvalue);
-fn_int_int_in          (lua_rawequal);
-fn_int_in              (lua_rawget);
-fn_int_int_in          (lua_rawgeti);
-fn_int_in              (lua_rawset);
-fn_int_int_in          (lua_rawseti);
-fn_int_in              (lua_remove);
-fn_int_in              (lua_replace);
-fn_int_string_in       (lua_setfield);
-fn_string_in           (lua_setglobal);
-fn_int_in_int_out      (lua_setmetatable);
-fn_int_in              (lua_settable);
-fn_int_in              (lua_settop);
-fn_int_in_int_out      (lua_toboolean);
-fn_int_in_int_out      (lua_tointeger);
-fn_int_in_double_out   (lua_tonumber);
-fn_int_in_string_out   (lua_tostring);
-fn_int_in_int_out      (lua_type);
-fn_int_in_string_out   (lua_typename);
+  // Find the stack height needed, and name the buffers that are used.
+  for (step = 1; step <= demo_state->step; ++step) {
+    lua_rawgeti(L, calls, step);
+        // stack = [.., lines, record]
+    if (lua_istable(L, record)) {
+      lua_getfield(L, record, "top");
+      if (lua_tointeger(L, -1) > max_top) max_top = lua_tointeger(L, -1);
+      lua_getfield(L, record, "n");
+      int n = lua_tointeger(L, -1);
+      lua_pop(L, 2);
+      for (k = 1; k <= n; ++k) {
+        lua_rawgeti(L, record, k);
+        lua_pushvalue(L, -1);
+        lua_rawget(L, buffers);
+            // stack = [.., lines, record, arg, buffers[arg]]
+        if (lua_isnil(L, -1) && has_metatable(L, -2, demo_buffer_metatable)) {
+          lua_pushvalue(L, -2);
+          lua_pushinteger(L, ++num_buffers);
+          lua_rawset(L, buffers);
+        }
+        lua_pop(L, 2);
+      }
+    }
+    lua_pop(L, 1);
+        // stack = [.., lines]
+  }
 
-// Version-specific functions.
+  add_line(L, lines, &num_lines,
+           "// Made by apidemo.export_c from a demo session on %s.\n"
+           "// Build it against the same Lua, for example:\n"
+           "//   cc -O2 -o bench bench.c -llua -lm\n"
+           "// and run it as: ./bench [iterations]\n\n"
+           "#include \"lua.h\"\n"
+           "#include \"lauxlib.h\"\n"
+           "#include \"lualib.h\"\n\n"
+           "#include <stdio.h>\n"
+           "#include <stdlib.h>\n"
+           "#include <time.h>\n\n"
+           "static void run_calls(lua_State *L) {\n",
+           LUA_RELEASE);
+  for (k = 1; k <= num_buffers; ++k) {
+    add_line(L, lines, &num_lines, "  luaL_Buffer b%d;\n", k);
+  }
+  add_line(L, lines, &num_lines,
+           "  luaL_checkstack(L, %d, \"recorded calls\");\n",
+           max_top + LUA_MINSTACK);
+  for (step = 1; step <= demo_state->step; ++step) {
+    lua_rawgeti(L, calls, step);
+    lua_rawgeti(L, calls, step - 1);
+        // stack = [.., lines, record, previous_record]
+    // A call such as lua_xmove can make more than one step on a state.
+    int is_repeat = lua_istable(L, record) &&
+                    lua_rawequal(L, record, record + 1);
+    lua_pop(L, 1);
+    if (is_repeat) {
+      // Its first step has already been written.
+    } else if (lua_istable(L, record)) {
+      if (!push_c_call(L, record, demo_state, buffers) && !is_partial) {
+        lua_getfield(L, record, "name");
+        return luaL_error(L, "can't export step %d: an argument to %s can't "
+                             "be written in C", step, lua_tostring(L, -1));
+      }
+      add_line(L, lines, &num_lines, "  %s\n", lua_tostring(L, -1));
+      lua_pop(L, 1);
+    } else if (is_partial) {
+      add_line(L, lines, &num_lines, "  // Step %d wasn't recorded.\n", step);
+    } else {
+      return luaL_error(L, "can't export step %d, which wasn't recorded; "
+                           "turn on the record_calls option first", step);
+    }
+    lua_pop(L, 1);
+        // stack = [.., lines]
+  }
+  add_line(L, lines, &num_lines,
+           "}\n\n"
+           "int main(int argc, char **argv) {\n"
+           "  long iterations = (argc > 1 ? atol(argv[1]) : 100000), k;\n"
+           "  if (iterations < 1) iterations = 1;\n"
+           "  lua_State *L = luaL_newstate();\n"
+           "  luaL_openlibs(L);\n"
+           "  run_calls(L);  // Warm up.\n"
+           "  lua_settop(L, 0);\n"
+           "  clock_t start = clock();\n"
+           "  for (k = 0; k < iterations; ++k) {\n"
+           "    run_calls(L);\n"
+           "    lua_settop(L, 0);\n"
+           "  }\n"
+           "  double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;\n"
+           "  printf(\"%%ld iterations, %%.1f ns each\\n\", iterations,\n"
+           "         seconds * 1e9 / iterations);\n"
+           "  lua_close(L);\n"
+           "  return 0;\n"
+           "}\n");
 
-#if LUA_VERSION_NUM == 501
-fn_int_int_in          (lua_equal);
-fn_int_int_in          (lua_lessthan);
-fn_int_in_int_out      (lua_objlen);
-#else
-fn_int_in_int_out      (lua_rawlen);
-#endif
+  if (path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) return luaL_error(L, "can't open %s for writing", path);
+    for (k = 1; k <= num_lines; ++k) {
+      lua_rawgeti(L, lines, k);
+      fputs(lua_tostring(L, -1), f);
+      lua_pop(L, 1);
+    }
+    fclose(f);
+    return 0;
+  }
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  for (k = 1; k <= num_lines; ++k) {
+    lua_rawgeti(L, lines, k);
+    luaL_addvalue(&b);
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
 
-fn_int_string_in_int_out  (luaL_argerror);
-fn_int_string_in_int_out  (luaL_callmeta);
-fn_int_in                 (luaL_checkany);
-fn_int_in_int_out         (luaL_checkint);
-fn_int_in_double_out      (luaL_checknumber);
-fn_int_in_string_out      (luaL_checkstring);
-fn_int_int_in             (luaL_checktype);
-fn_string_in_int_out      (luaL_dofile);
-fn_string_in_int_out      (luaL_dostring);
-fn_int_string_in_int_out  (luaL_getmetafield);
-fn_string_in_int_out      (luaL_loadfile);
-fn_string_in_int_out      (luaL_loadstring);
-// Defined below:          luaL_optint
-// Defined below:          luaL_optnumber
-// Defined below:          luaL_optstring
-fn_int_in_string_out      (luaL_typename);
+// ## Running chunks on worker threads.
 
-// ### Function wrappers that need special-case code.
+// apidemo.async_dostring(L, code) and apidemo.async_dofile(L, filename) run a
+// chunk on a pool of worker threads, one per core, and return a handle at
+// once. The chunk runs in a new lua_State of its own, with the standard
+// libraries open, so chunks run in parallel with each other and with the
+// host. handle:poll() returns nil while the chunk is running; once it has
+// finished, handle:poll() and handle:await(), which waits for it, push what
+// the chunk returned, or its error message, onto L, print L's stack, and
+// return what luaL_dostring would have. handle:await(seconds) gives up after
+// that long, and handle:cancel() stops the chunk. Chunks are held to the
+// budget L had when they started. L is locked while its chunk runs.
+//
+// Results are copied from the worker's state to L, so they can be nil,
+// booleans, numbers, strings, or tables of those.
 
-// This is a special case function as it doesn't return; yet we'd still like to
-// leave in a valid state as the encompassing Lua environment may continue to
-// run.
-int demo_lua_error(lua_State *L) {
-  FakeLuaState *demo_state =
-      (FakeLuaState *)luaL_checkudata(L, 1, demo_state_metatable);
-  load_state(L, demo_state);
-  print_stack(L, 1);  // 1 --> tail values to omit
-  save_state(L, 1);   // 1 --> tail values to omit
-  return lua_error(L);
+#ifndef _WIN32
+
+// A growable run of bytes, for copying values between states.
+typedef struct {
+  char  *data;
+  size_t len;
+  size_t size;
+} Bytes;
+
+static void add_bytes(Bytes *bytes, const void *p, size_t len) {
+  if (bytes->len + len > bytes->size) {
+    size_t size = bytes->size ? bytes->size : 256;
+    while (size < bytes->len + len) size *= 2;
+    char *new_data = (char *)realloc(bytes->data, size);
+    if (new_data == NULL) abort();  // Like Lua itself, give up on malloc.
+    bytes->data = new_data;
+    bytes->size = size;
+  }
+  memcpy(bytes->data + bytes->len, p, len);
+  bytes->len += len;
+}
+
+// This appends stack[i] of the worker state J to bytes as a one-byte tag and
+// its contents, and returns 0 if it's a value that can't be copied.
+static int write_value(lua_State *J, int i, Bytes *bytes, int depth) {
+  char tag;
+  lua_Number n;
+  size_t len;
+  const char *s;
+  i = abs_index(J, i);
+  switch (lua_type(J, i)) {
+    case LUA_TNIL:
+      add_bytes(bytes, "n", 1);
+      return 1;
+    case LUA_TBOOLEAN:
+      tag = lua_toboolean(J, i) ? 'T' : 'F';
+      add_bytes(bytes, &tag, 1);
+      return 1;
+    case LUA_TNUMBER:
+      n = lua_tonumber(J, i);
+      add_bytes(bytes, "d", 1);
+      add_bytes(bytes, &n, sizeof(n));
+      return 1;
+    case LUA_TSTRING:
+      s = lua_tolstring(J, i, &len);
+      add_bytes(bytes, "s", 1);
+      add_bytes(bytes, &len, sizeof(len));
+      add_bytes(bytes, s, len);
+      return 1;
+    case LUA_TTABLE:
+      if (depth == max_print_depth || !lua_checkstack(J, 3)) return 0;
+      add_bytes(bytes, "t", 1);
+      lua_pushnil(J);
+      while (lua_next(J, i)) {
+        if (!write_value(J, -2, bytes, depth + 1) ||
+            !write_value(J, -1, bytes, depth + 1)) {
+          return 0;
+        }
+        lua_pop(J, 1);
+      }
+      add_bytes(bytes, "e", 1);  // The end of the table.
+      return 1;
+  }
+  return 0;
+}
+
+// This pushes the value written by write_value at *p, and moves *p past it.
+static void read_value(lua_State *L, const char **p) {
+  char tag = *(*p)++;
+  lua_Number n;
+  size_t len;
+  switch (tag) {
+    case 'n':
+      lua_pushnil(L);
+      break;
+    case 'T':
+    case 'F':
+      lua_pushboolean(L, tag == 'T');
+      break;
+    case 'd':
+      memcpy(&n, *p, sizeof(n));
+      *p += sizeof(n);
+      lua_pushnumber(L, n);
+      break;
+    case 's':
+      memcpy(&len, *p, sizeof(len));
+      *p += sizeof(len);
+      lua_pushlstring(L, *p, len);
+      *p += len;
+      break;
+    case 't':
+      luaL_checkstack(L, 3, "async result nested too deeply");
+      lua_newtable(L);
+      while (**p != 'e') {
+        read_value(L, p);
+        read_value(L, p);
+        lua_rawset(L, -3);
+      }
+      (*p)++;
+      break;
+  }
+}
+
+// A chunk waiting for, or given to, a worker. The worker fills in status and
+// results; is_done, is_abandoned and is_cancelled are only used with
+// async_lock held.
+struct AsyncJob {
+  AsyncJob *next;         // The next job in the queue.
+  int       is_file;      // Whether text is a file name rather than code.
+  char     *text;
+  int       status;       // What luaL_dostring or luaL_dofile returned.
+  int       num_results;  // The values written to results.
+  Bytes     results;      // Those values, or the error message.
+  int       is_done;
+  int       is_abandoned; // Set if the handle is collected before is_done.
+  int       is_cancelled; // Set by handle:cancel(), or with is_abandoned.
+
+  // The budget of the demo state when the job was started, and the worker's
+  // progress against it; see job_hook.
+  RunSettings limits;
+  lua_State  *J;
+  int         period;        // The current hook count.
+  long        instructions;
+  double      deadline;
+  size_t      live_bytes;    // What J has allocated and not yet freed.
+  size_t      base_bytes;    // live_bytes once the libraries were opened.
+  size_t      known_live;    // What the chunk held at the last collection.
+  int         gc_due;
+  const char *over_msg;
+  lua_Number  over_limit;
+};
+
+// The Lua-side handle for a job. After it's finished, job is NULL and status
+// is kept for any later polls.
+typedef struct {
+  AsyncJob *job;
+  int       state_ref;  // Registry ref to the demo state, held until then.
+  int       status;
+} AsyncHandle;
+
+// The queue and the workers are shared by all threads. The workers are joined
+// once the last host state using the module is closed, as that may unload
+// the module's code from under them; see async_host_gc.
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  async_work = PTHREAD_COND_INITIALIZER;  // Queued.
+static pthread_cond_t  async_done = PTHREAD_COND_INITIALIZER;  // Finished.
+static AsyncJob       *async_head;
+static AsyncJob       *async_tail;
+static pthread_t       async_workers[max_async_workers];
+static int             num_async_workers;
+static int             num_async_hosts;
+static int             is_async_stopping;
+
+static void free_job(AsyncJob *job) {
+  free(job->text);
+  free(job->results.data);
+  free(job);
+}
+
+static void job_hook(lua_State *J, lua_Debug *ar);
+
+// A job's state allocates through this, so its memory budget counts only what
+// the job's own state holds. As with counting_alloc, a request is only
+// refused if it wouldn't fit even if everything allocated since the last
+// full collection were garbage; past the budget, job_hook collects and
+// checks.
+static void *job_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+  AsyncJob *job = (AsyncJob *)ud;
+  size_t old_size = (ptr ? osize : 0);  // See counting_alloc.
+  if (nsize == 0) {
+    free(ptr);
+    job->live_bytes -= old_size;
+    return NULL;
+  }
+  size_t max_bytes = job->limits.max_bytes;
+  if (max_bytes && job->J && nsize > old_size &&
+      (double)job->known_live + (double)(nsize - old_size) > max_bytes) {
+    job->over_msg   = "memory budget of %f bytes exceeded";
+    job->over_limit = (lua_Number)max_bytes;
+    return NULL;
+  }
+  void *new_ptr = realloc(ptr, nsize);
+  if (new_ptr == NULL) return NULL;
+  job->live_bytes += nsize - old_size;
+  if (max_bytes && job->J && !job->gc_due &&
+      job->live_bytes > job->base_bytes &&
+      job->live_bytes - job->base_bytes > max_bytes) {
+    job->gc_due = 1;
+    job->period = 1;
+    lua_sethook(job->J, job_hook, LUA_MASKCOUNT, 1);
+  }
+  return new_ptr;
+}
+
+// This checks a running job against its budget, and whether it's been
+// cancelled, every job->period instructions. As with run_hook, once either
+// happens the error is raised again at every instruction, so a pcall in the
+// chunk can't keep it going.
+static void job_hook(lua_State *J, lua_Debug *ar) {
+  (void)ar;
+  void *ud;
+  lua_getallocf(J, &ud);
+  AsyncJob *job = (AsyncJob *)ud;
+  if (job->over_msg == NULL) {
+    job->instructions += job->period;
+    pthread_mutex_lock(&async_lock);
+    int is_cancelled = job->is_cancelled;
+    pthread_mutex_unlock(&async_lock);
+    if (job->gc_due) {
+      lua_gc(J, LUA_GCCOLLECT, 0);
+      job->gc_due = 0;
+      job->known_live = (job->live_bytes > job->base_bytes ?
+                         job->live_bytes - job->base_bytes : 0);
+    }
+    size_t max_bytes = job->limits.max_bytes;
+    long   max_instructions = job->limits.max_instructions;
+    if (is_cancelled) {
+      job->over_msg = "async chunk was cancelled";
+    } else if (max_bytes && job->known_live > max_bytes) {
+      job->over_msg   = "memory budget of %f bytes exceeded";
+      job->over_limit = (lua_Number)max_bytes;
+    } else if (max_instructions && job->instructions >= max_instructions) {
+      job->over_msg   = "instruction budget of %f exceeded";
+      job->over_limit = (lua_Number)max_instructions;
+    } else if (job->deadline && wall_seconds() > job->deadline) {
+      job->over_msg   = "time budget of %f seconds exceeded";
+      job->over_limit = job->limits.max_seconds;
+    }
+    if (job->over_msg == NULL) {
+      if (job->period == 1) {
+        job->period = budget_period;
+        if (max_instructions && max_instructions < job->period) {
+          job->period = (int)max_instructions;
+        }
+        lua_sethook(J, job_hook, LUA_MASKCOUNT, job->period);
+      }
+      return;
+    }
+    job->period = 1;
+    lua_sethook(J, job_hook, LUA_MASKCOUNT, 1);
+  }
+  lua_pushfstring(J, job->over_msg, job->over_limit);
+  lua_error(J);
+}
+
+static void run_job(AsyncJob *job) {
+  pthread_mutex_lock(&async_lock);
+  int is_cancelled = job->is_cancelled;
+  pthread_mutex_unlock(&async_lock);
+  lua_State *J = is_cancelled ? NULL : lua_newstate(job_alloc, job);
+  if (J == NULL) {
+    const char *msg = is_cancelled ? "async chunk was cancelled"
+                                   : "not enough memory";
+    size_t len = strlen(msg);
+    add_bytes(&job->results, "s", 1);
+    add_bytes(&job->results, &len, sizeof(len));
+    add_bytes(&job->results, msg, len);
+    job->status = is_cancelled ? LUA_ERRRUN : LUA_ERRMEM;
+    job->num_results = 1;
+    return;
+  }
+  luaL_openlibs(J);
+  job->J          = J;
+  job->base_bytes = job->live_bytes;
+  job->period     = 1;  // job_hook sets the usual period on its first run.
+  if (job->limits.max_seconds) {
+    job->deadline = wall_seconds() + job->limits.max_seconds;
+  }
+  lua_sethook(J, job_hook, LUA_MASKCOUNT, 1);
+  job->status = job->is_file ? luaL_dofile(J, job->text)
+                             : luaL_dostring(J, job->text);
+  lua_sethook(J, NULL, 0, 0);
+  job->J = NULL;  // Copying the results isn't budgeted.
+  if (job->status && job->over_msg) {  // job_alloc may have refused memory.
+    lua_settop(J, 0);
+    lua_pushfstring(J, job->over_msg, job->over_limit);
+  }
+  int n = lua_gettop(J), k;
+  for (k = 1; k <= n; ++k) {
+    if (!write_value(J, k, &job->results, 0)) {
+      job->status = LUA_ERRRUN;
+      job->results.len = 0;
+      lua_pushfstring(J, "async chunk returned a %s, which can't be copied; "
+                         "only nil, booleans, numbers, strings and tables of "
+                         "those can", luaL_typename(J, k));
+      write_value(J, -1, &job->results, 0);
+      n = 1;
+      break;
+    }
+  }
+  job->num_results = n;
+  lua_close(J);
+}
+
+// Workers run queued jobs until is_async_stopping is set and the queue is
+// empty.
+static void *async_worker(void *arg) {
+  (void)arg;
+  for (;;) {
+    pthread_mutex_lock(&async_lock);
+    while (async_head == NULL && !is_async_stopping) {
+      pthread_cond_wait(&async_work, &async_lock);
+    }
+    AsyncJob *job = async_head;
+    if (job == NULL) {
+      pthread_mutex_unlock(&async_lock);
+      return NULL;
+    }
+    async_head = job->next;
+    if (async_head == NULL) async_tail = NULL;
+    pthread_mutex_unlock(&async_lock);
+
+    run_job(job);
+
+    pthread_mutex_lock(&async_lock);
+    job->is_done = 1;
+    int is_abandoned = job->is_abandoned;
+    pthread_cond_broadcast(&async_done);
+    pthread_mutex_unlock(&async_lock);
+    if (is_abandoned) free_job(job);
+  }
+}
+
+// This queues job, starting the workers if they aren't running yet, and
+// returns 0 if there are none to run it.
+static int queue_job(AsyncJob *job) {
+  pthread_mutex_lock(&async_lock);
+  if (num_async_workers == 0) {
+    long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_workers = (num_cores < 1 ? 1 : num_cores > max_async_workers ?
+                       max_async_workers : (int)num_cores);
+    while (num_async_workers < num_workers) {
+      pthread_t *thread = &async_workers[num_async_workers];
+      if (pthread_create(thread, NULL, async_worker, NULL)) break;
+      num_async_workers++;
+    }
+  }
+  int is_queued = (num_async_workers > 0);
+  if (is_queued) {
+    if (async_tail) {
+      async_tail->next = job;
+    } else {
+      async_head = job;
+    }
+    async_tail = job;
+    pthread_cond_signal(&async_work);
+  }
+  pthread_mutex_unlock(&async_lock);
+  return is_queued;
+}
+
+// Each host state holds a sentinel, made by luaopen_apidemo, whose __gc runs
+// when the state is closed, after the handles made since, and before Lua
+// unloads the module. When the last one goes, this cancels any jobs still
+// running and joins the workers, so no worker is left in unloaded code.
+static int async_host_gc(lua_State *L) {
+  (void)L;
+  pthread_mutex_lock(&async_lock);
+  int is_last = (--num_async_hosts == 0 && num_async_workers > 0);
+  if (is_last) {
+    is_async_stopping = 1;
+    pthread_cond_broadcast(&async_work);
+  }
+  pthread_mutex_unlock(&async_lock);
+  if (!is_last) return 0;
+  int k;
+  for (k = 0; k < num_async_workers; ++k) {
+    pthread_join(async_workers[k], NULL);
+  }
+  // The module may be kept loaded, and used by a new host state.
+  num_async_workers = 0;
+  is_async_stopping = 0;
+  return 0;
+}
+
+// This counts L as a host state using async chunks; see async_host_gc.
+static void add_async_host(lua_State *L) {
+      // stack = [..]
+  lua_getfield(L, LUA_REGISTRYINDEX, async_host_key);
+  int has_sentinel = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+  if (has_sentinel) return;  // The module was opened again on this state.
+  lua_newuserdata(L, 1);
+  lua_newtable(L);
+  lua_pushcfunction(L, async_host_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_setmetatable(L, -2);
+      // stack = [.., sentinel]
+  lua_setfield(L, LUA_REGISTRYINDEX, async_host_key);
+      // stack = [..]
+  pthread_mutex_lock(&async_lock);
+  num_async_hosts++;
+  pthread_mutex_unlock(&async_lock);
+}
+
+static int start_job(lua_State *L, int is_file) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  const char *text = luaL_checkstring(L, 2);
+  check_not_busy(L, demo_state);
+  AsyncHandle *handle = (AsyncHandle *)lua_newuserdata(L, sizeof(*handle));
+  handle->job       = NULL;
+  handle->state_ref = LUA_NOREF;
+  luaL_getmetatable(L, async_job_metatable);
+  lua_setmetatable(L, -2);
+      // stack = [demo_L, text, handle]
+  AsyncJob *job = (AsyncJob *)calloc(1, sizeof(AsyncJob));
+  if (job) job->text = strdup(text);
+  if (job == NULL || job->text == NULL) {
+    free(job);
+    return luaL_error(L, "not enough memory");
+  }
+  job->is_file = is_file;
+  job->limits  = demo_state->settings;
+  if (!queue_job(job)) {
+    free_job(job);
+    return luaL_error(L, "can't start any worker threads");
+  }
+  handle->job = job;
+  lua_pushvalue(L, 1);
+  handle->state_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  demo_state->job = job;
+  return 1;  // Number of values to return that are on the stack.
 }
 
-int demo_lua_tolstring(lua_State *L) {
-  FakeLuaState *demo_state =
-      (FakeLuaState *)luaL_checkudata(L, 1, demo_state_metatable);
-  int arg1 = luaL_checkint(L, 2);
-  load_state(L, demo_state);
-  const char *out1 = lua_tolstring(L, arg1, NULL);  // NULL --> *len
-  print_stack(L, 0);  // 0 --> tail values to omit
-  save_state(L, 0);   // 0 --> tail values to omit
-  lua_pushstring(L, out1);
-  return 1;  // Number of values to return that are on the stack.
+static int async_dostring(lua_State *L) {
+  return start_job(L, 0);
 }
 
-int demo_luaL_optint(lua_State *L) {
-  FakeLuaState *demo_state =
-      (FakeLuaState *)luaL_checkudata(L, 1, demo_state_metatable);
-  int arg1 = luaL_checkint(L, 2);
-  int arg2 = luaL_checkint(L, 3);
-  load_state(L, demo_state);
-  int out1 = luaL_optint(L, arg1, arg2);
-  print_stack(L, 0);  // 0 --> tail values to omit
-  save_state(L, 0);   // 0 --> tail values to omit
-  lua_pushnumber(L, out1);
-  return 1;  // Number of values to return that are on the stack.
+static int async_dofile(lua_State *L) {
+  return start_job(L, 1);
 }
 
-int demo_luaL_optnumber(lua_State *L) {
-  FakeLuaState *demo_state =
-      (FakeLuaState *)luaL_checkudata(L, 1, demo_state_metatable);
-  int arg1 = luaL_checkint(L, 2);
-  double arg2 = luaL_checknumber(L, 3);
+// This pushes a finished job's results onto its demo state, prints the
+// state's stack, and returns the job's status.
+static int finish_job(lua_State *L, AsyncHandle *handle) {
+  AsyncJob *job = handle->job;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, handle->state_ref);
+  FakeLuaState *demo_state = (FakeLuaState *)lua_touserdata(L, -1);
+  lua_pop(L, 1);  // The state is kept alive by state_ref until we're done.
+  demo_state->job = NULL;
+  handle->job     = NULL;
+  handle->status  = job->status;
   load_state(L, demo_state);
-  double out1 = luaL_optnumber(L, arg1, arg2);
+  luaL_checkstack(L, job->num_results, "too many async results");
+  const char *p = job->results.data;
+  int k;
+  for (k = 0; k < job->num_results; ++k) read_value(L, &p);
+  free_job(job);
   print_stack(L, 0);  // 0 --> tail values to omit
   save_state(L, 0);   // 0 --> tail values to omit
-  lua_pushnumber(L, out1);
-  return 1;  // Number of values to return that are on the stack.
+  luaL_unref(L, LUA_REGISTRYINDEX, handle->state_ref);
+  handle->state_ref = LUA_NOREF;
+  return handle->status;
 }
 
-int demo_luaL_optstring(lua_State *L) {
-  FakeLuaState *demo_state =
-      (FakeLuaState *)luaL_checkudata(L, 1, demo_state_metatable);
-  int arg1 = luaL_checkint(L, 2);
-  const char *arg2 = luaL_checkstring(L, 3);
-  load_state(L, demo_state);
-  const char *out1 = luaL_optstring(L, arg1, arg2);
-  print_stack(L, 0);  // 0 --> tail values to omit
-  save_state(L, 0);   // 0 --> tail values to omit
-  lua_pushstring(L, out1);
+// handle:poll() returns nil while the chunk is running, and its status once
+// it has finished.
+static int job_poll(lua_State *L) {
+  AsyncHandle *handle =
+      (AsyncHandle *)luaL_checkudata(L, 1, async_job_metatable);
+  if (handle->job) {
+    pthread_mutex_lock(&async_lock);
+    int is_done = handle->job->is_done;
+    pthread_mutex_unlock(&async_lock);
+    if (!is_done) return 0;
+    finish_job(L, handle);
+  }
+  lua_pushnumber(L, handle->status);
   return 1;  // Number of values to return that are on the stack.
 }
 
-int demo_lua_pcall(lua_State *L) {
-  FakeLuaState *demo_state =
-      (FakeLuaState *)luaL_checkudata(L, 1, demo_state_metatable);
-  int arg1 = luaL_checkint(L, 2);
-  int arg2 = luaL_checkint(L, 3);
-  int arg3 = luaL_checkint(L, 4);
-  load_state(L, demo_state);
-  int out1 = lua_pcall(L, arg1, arg2, arg3);
-  print_stack(L, 0);  // 0 --> tail values to omit
-  save_state(L, 0);   // 0 --> tail values to omit
-  lua_pushnumber(L, out1);
+// handle:await([seconds]) waits for the chunk to finish, and returns its
+// status. If it's still running after the given number of seconds, this
+// returns nil instead, as poll does.
+static int job_await(lua_State *L) {
+  AsyncHandle *handle =
+      (AsyncHandle *)luaL_checkudata(L, 1, async_job_metatable);
+  int has_timeout = !lua_isnoneornil(L, 2);
+  lua_Number seconds = has_timeout ? luaL_checknumber(L, 2) : 0;
+  luaL_argcheck(L, seconds >= 0, 2, "can't wait a negative time");
+  if (handle->job) {
+    struct timespec deadline;
+    if (has_timeout) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      double whole = floor(seconds);
+      if (whole > (double)INT_MAX) whole = (double)INT_MAX;  // Over 68 years.
+      deadline.tv_sec  += (time_t)whole;
+      deadline.tv_nsec += (long)((seconds - floor(seconds)) * 1e9);
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+    }
+    int is_timed_out = 0;
+    pthread_mutex_lock(&async_lock);
+    while (!handle->job->is_done && !is_timed_out) {
+      if (has_timeout) {
+        is_timed_out = (pthread_cond_timedwait(&async_done, &async_lock,
+                                               &deadline) == ETIMEDOUT);
+      } else {
+        pthread_cond_wait(&async_done, &async_lock);
+      }
+    }
+    int is_done = handle->job->is_done;
+    pthread_mutex_unlock(&async_lock);
+    if (!is_done) return 0;
+    finish_job(L, handle);
+  }
+  lua_pushnumber(L, handle->status);
   return 1;  // Number of values to return that are on the stack.
 }
 
-// ### Define setup_globals.
+// handle:cancel() stops the chunk at its next check, within budget_period
+// instructions, after which it finishes with an error. Calls into C, such as
+// a blocking read, aren't interrupted.
+static int job_cancel(lua_State *L) {
+  AsyncHandle *handle =
+      (AsyncHandle *)luaL_checkudata(L, 1, async_job_metatable);
+  if (handle->job) {
+    pthread_mutex_lock(&async_lock);
+    handle->job->is_cancelled = 1;
+    pthread_mutex_unlock(&async_lock);
+  }
+  return 0;
+}
 
-// setup_globals is a single Lua-facing function to register all our C-API-like
-// functions in a single go.
+// A handle that's collected before its job is finished cancels the job and
+// leaves it to be freed by its worker, and unlocks the demo state if that's
+// still around.
+static int job_gc(lua_State *L) {
+  AsyncHandle *handle = (AsyncHandle *)lua_touserdata(L, 1);
+  AsyncJob *job = handle->job;
+  if (job == NULL) return 0;
+  pthread_mutex_lock(&async_lock);
+  int is_done = job->is_done;
+  job->is_abandoned = !is_done;
+  job->is_cancelled = 1;
+  pthread_mutex_unlock(&async_lock);
+  if (is_done) free_job(job);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, handle->state_ref);
+  FakeLuaState *demo_state = (FakeLuaState *)lua_touserdata(L, -1);
+  if (demo_state && demo_state->job == job) demo_state->job = NULL;
+  luaL_unref(L, LUA_REGISTRYINDEX, handle->state_ref);
+  handle->job = NULL;
+  return 0;
+}
 
-#define register_fn(lua_fn_name) \
-  lua_register(L, #lua_fn_name, demo_ ## lua_fn_name)
+#else
 
-#define register_const(const_name)             \
-  lua_pushnumber(L, (lua_Number)const_name);   \
-  lua_setglobal(L, #const_name);
+static int async_dostring(lua_State *L) {
+  return luaL_error(L, "async chunks need pthreads, which aren't available "
+                       "here");
+}
 
-static int setup_globals(lua_State *L) {
-  register_fn(luaL_newstate);
+static int async_dofile(lua_State *L) {
+  return async_dostring(L);
+}
 
-  // Please keep these alphabetized.
-  register_fn(lua_call);
-  register_fn(lua_checkstack);
-  register_fn(lua_concat);
-  register_fn(lua_getfield);
-  register_fn(lua_getglobal);
-  register_fn(lua_getmetatable);
-  register_fn(lua_gettable);
-  register_fn(lua_gettop);
-  register_fn(lua_error);
-  register_fn(lua_insert);
-  register_fn(lua_isboolean);
-  register_fn(lua_isfunction);
-  register_fn(lua_isnil);
-  register_fn(lua_isnone);
-  register_fn(lua_isnoneornil);
-  register_fn(lua_isnumber);
-  register_fn(lua_isstring);
-  register_fn(lua_istable);
-  register_fn(lua_newtable);
-  register_fn(lua_next);
-  register_fn(lua_pcall);
-  register_fn(lua_pop);
-  register_fn(lua_pushboolean);
-  register_fn(lua_pushlstring);
-  register_fn(lua_pushnil);
-  register_fn(lua_pushnumber);
-  register_fn(lua_pushstring);
-  register_fn(lua_pushvalue);
-  register_fn(lua_rawequal);
-  register_fn(lua_rawget);
-  register_fn(lua_rawgeti);
-  register_fn(lua_rawset);
-  register_fn(lua_rawseti);
-  register_fn(lua_remove);
-  register_fn(lua_replace);
-  register_fn(lua_setfield);
-  register_fn(lua_setglobal);
-  register_fn(lua_setmetatable);
-  register_fn(lua_settable);
-  register_fn(lua_settop);
-  register_fn(lua_toboolean);
-  register_fn(lua_tointeger);
-  register_fn(lua_tolstring);
-  register_fn(lua_tonumber);
-  register_fn(lua_tostring);
-  register_fn(lua_type);
-  register_fn(lua_typename);
+static void add_async_host(lua_State *L) { (void)L; }
 
-// Version-specific functions.
+static int job_poll(lua_State *L)   { (void)L; return 0; }
+static int job_await(lua_State *L)  { (void)L; return 0; }
+static int job_cancel(lua_State *L) { (void)L; return 0; }
+static int job_gc(lua_State *L)     { (void)L; return 0; }
 
-#if LUA_VERSION_NUM == 501
-  register_fn(lua_equal);
-  register_fn(lua_lessthan);
-  register_fn(lua_objlen);
-#else
-  register_fn(lua_rawlen);
 #endif
 
-  register_fn(luaL_argerror);
-  register_fn(luaL_callmeta);
-  register_fn(luaL_checkany);
-  register_fn(luaL_checkint);
-  register_fn(luaL_checknumber);
-  register_fn(luaL_checkstring);
-  register_fn(luaL_checktype);
-  register_fn(luaL_dofile);
-  register_fn(luaL_dostring);
-  register_fn(luaL_getmetafield);
-  register_fn(luaL_loadfile);
-  register_fn(luaL_loadstring);
-  register_fn(luaL_optint);
-  register_fn(luaL_optnumber);
-  register_fn(luaL_optstring);
-  register_fn(luaL_typename);
+// ## Typed arrays.
 
-  // Set up C-like constants.
-  lua_pushnumber(L, 0);
-  lua_setglobal(L, "NULL");
+// ### Kernels.
 
-  register_const(LUA_ERRRUN);
-  register_const(LUA_ERRSYNTAX);
-  register_const(LUA_ERRMEM);
-  register_const(LUA_ERRERR);
-  register_const(LUA_ERRFILE);
+// These loops use several independent accumulators. That breaks the serial
+// dependency on a single running total, which is what lets compilers keep
+// multiple SIMD lanes busy; they won't reorder floating-point sums otherwise.
 
-  register_const(LUA_TNONE);
-  register_const(LUA_TNIL);
-  register_const(LUA_TBOOLEAN);
-  register_const(LUA_TLIGHTUSERDATA);
-  register_const(LUA_TNUMBER);
-  register_const(LUA_TSTRING);
-  register_const(LUA_TTABLE);
-  register_const(LUA_TFUNCTION);
-  register_const(LUA_TUSERDATA);
-  register_const(LUA_TTHREAD);
+static double array_sum(TypedArray *a) {
+  size_t i, n = a->len;
+  if (a->kind == array_f64) {
+    const double *x = (const double *)a->data;
+    double acc[4] = {0, 0, 0, 0};
+    for (i = 0; i + 4 <= n; i += 4) {
+      acc[0] += x[i];     acc[1] += x[i + 1];
+      acc[2] += x[i + 2]; acc[3] += x[i + 3];
+    }
+    for (; i < n; ++i) acc[0] += x[i];
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+  } else {
+    const int32_t *x = (const int32_t *)a->data;
+    int64_t acc[4] = {0, 0, 0, 0};
+    for (i = 0; i + 4 <= n; i += 4) {
+      acc[0] += x[i];     acc[1] += x[i + 1];
+      acc[2] += x[i + 2]; acc[3] += x[i + 3];
+    }
+    for (; i < n; ++i) acc[0] += x[i];
+    return (double)((acc[0] + acc[1]) + (acc[2] + acc[3]));
+  }
+}
 
-  register_const(LUA_REGISTRYINDEX);
-#if LUA_VERSION_NUM == 501
-  register_const(LUA_GLOBALSINDEX);
-#endif
+// This expects a and b to have the same kind and length.
+static double array_dot(TypedArray *a, TypedArray *b) {
+  size_t i, n = a->len;
+  if (a->kind == array_f64) {
+    const double *x = (const double *)a->data;
+    const double *y = (const double *)b->data;
+    double acc[4] = {0, 0, 0, 0};
+    for (i = 0; i + 4 <= n; i += 4) {
+      acc[0] += x[i] * y[i];         acc[1] += x[i + 1] * y[i + 1];
+      acc[2] += x[i + 2] * y[i + 2]; acc[3] += x[i + 3] * y[i + 3];
+    }
+    for (; i < n; ++i) acc[0] += x[i] * y[i];
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+  } else {
+    const int32_t *x = (const int32_t *)a->data;
+    const int32_t *y = (const int32_t *)b->data;
+    int64_t acc[4] = {0, 0, 0, 0};
+    for (i = 0; i + 4 <= n; i += 4) {
+      acc[0] += (int64_t)x[i] * y[i];
+      acc[1] += (int64_t)x[i + 1] * y[i + 1];
+      acc[2] += (int64_t)x[i + 2] * y[i + 2];
+      acc[3] += (int64_t)x[i + 3] * y[i + 3];
+    }
+    for (; i < n; ++i) acc[0] += (int64_t)x[i] * y[i];
+    return (double)((acc[0] + acc[1]) + (acc[2] + acc[3]));
+  }
+}
 
-  register_const(LUA_MULTRET);
+// Element-wise loops have no cross-iteration dependency, so they can be
+// vectorized as written: clang does so at -O2, and GCC at -O3.
+
+// This converts v for an i32 array, saturating at the type's limits and
+// storing NaN as 0, since a plain cast of any of those is undefined.
+static int32_t to_i32(double v) {
+  if (v != v) return 0;
+  if (v <= INT32_MIN) return INT32_MIN;
+  if (v >= INT32_MAX) return INT32_MAX;
+  return (int32_t)v;
+}
+
+static void array_scale(TypedArray *a, double k) {
+  size_t i, n = a->len;
+  if (a->kind == array_f64) {
+    double *x = (double *)a->data;
+    for (i = 0; i < n; ++i) x[i] *= k;
+  } else {
+    int32_t *x = (int32_t *)a->data;
+    for (i = 0; i < n; ++i) x[i] = to_i32(x[i] * k);
+  }
+}
+
+static void array_fill(TypedArray *a, double v) {
+  size_t i, n = a->len;
+  if (a->kind == array_f64) {
+    double *x = (double *)a->data;
+    for (i = 0; i < n; ++i) x[i] = v;
+  } else {
+    int32_t *x = (int32_t *)a->data;
+    int32_t iv = to_i32(v);
+    for (i = 0; i < n; ++i) x[i] = iv;
+  }
+}
+
+// ### Creating and checking arrays.
+
+// This returns the typed array at stack[i], or NULL if it isn't one. It never
+// throws, so it's safe to use while a demo state is loaded.
+static TypedArray *to_array(lua_State *L, int i) {
+  void *p = lua_touserdata(L, i);
+      // stack = [..]
+  if (p == NULL || !lua_getmetatable(L, i)) return NULL;
+      // stack = [.., mt]
+  luaL_getmetatable(L, typed_array_metatable);
+      // stack = [.., mt, typed_array_mt]
+  int is_array = lua_rawequal(L, -1, -2);
+  lua_pop(L, 2);
+      // stack = [..]
+  return is_array ? (TypedArray *)p : NULL;
+}
+
+static TypedArray *check_array(lua_State *L, int i) {
+  return (TypedArray *)luaL_checkudata(L, i, typed_array_metatable);
+}
 
+#define array_elt_size(kind) \
+  ((kind) == array_f64 ? sizeof(double) : sizeof(int32_t))
+#define array_header_size ((sizeof(TypedArray) + 15) & ~(size_t)15)
+
+// This checks that the length at stack[i] is a whole number small enough for
+// an array of the given kind to have a size_t size, and returns it.
+static size_t check_array_len(lua_State *L, int i, ArrayKind kind) {
+  lua_Number len = luaL_checknumber(L, i);
+  size_t max_len = (SIZE_MAX - array_header_size) / array_elt_size(kind);
+  // Compare with < since max_len may round up when converted.
+  luaL_argcheck(L, len >= 0 && len < (lua_Number)max_len, i,
+                "array length out of range");
+  luaL_argcheck(L, len == (lua_Number)(size_t)len, i,
+                "array length must be a whole number");
+  return (size_t)len;
+}
+
+// This pushes a new zero-filled array; check_array_len must allow len.
+static TypedArray *push_array(lua_State *L, ArrayKind kind, size_t len) {
+  size_t elt_size = array_elt_size(kind);
+  size_t header   = array_header_size;
+  TypedArray *array = (TypedArray *)lua_newuserdata(L, header + len * elt_size);
+  array->kind = kind;
+  array->len  = len;
+  array->data = (char *)array + header;
+  memset(array->data, 0, len * elt_size);
+  luaL_getmetatable(L, typed_array_metatable);
+  lua_setmetatable(L, -2);
+  return array;
+}
+
+// ### Metamethods, so Lua code can use arrays directly.
+
+// This returns the 0-based offset for the 1-based index at stack[i].
+static size_t check_array_index(lua_State *L, TypedArray *array, int i) {
+  lua_Number k = luaL_checknumber(L, i);
+  if (k < 1 || k > array->len || k != (lua_Number)(size_t)k) {
+    luaL_argerror(L, i, "array index out of range");
+  }
+  return (size_t)k - 1;
+}
+
+static int array_index(lua_State *L) {
+  TypedArray *array = check_array(L, 1);
+  size_t k = check_array_index(L, array, 2);
+  if (array->kind == array_f64) {
+    lua_pushnumber(L, ((double *)array->data)[k]);
+  } else {
+    lua_pushnumber(L, ((int32_t *)array->data)[k]);
+  }
+  return 1;
+}
+
+static int array_newindex(lua_State *L) {
+  TypedArray *array = check_array(L, 1);
+  size_t k = check_array_index(L, array, 2);
+  lua_Number v = luaL_checknumber(L, 3);
+  if (array->kind == array_f64) {
+    ((double *)array->data)[k] = v;
+  } else {
+    ((int32_t *)array->data)[k] = to_i32(v);
+  }
+  return 0;
+}
+
+static int array_len(lua_State *L) {
+  lua_pushnumber(L, check_array(L, 1)->len);
+  return 1;
+}
+
+// ### Demo-state functions.
+
+// These act on arrays in a demo state's stack. Their kernels never throw, so
+// we can report a bad index after the state has been saved.
+
+static int demo_newarray(lua_State *L) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  static const char *kinds[] = {"f64", "i32", NULL};
+  ArrayKind kind = (ArrayKind)luaL_checkoption(L, 2, NULL, kinds);
+  size_t len = check_array_len(L, 3, kind);
+  load_state(L, demo_state);
+  push_array(L, kind, len);
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
   return 0;  // Number of values to return that are on the stack.
 }
 
-int show_help(lua_State *L) {
-  printf("%s", help_string);
+// This runs one kernel on stack[i] (and stack[j] for dot) of a demo state.
+// Returns the number of values pushed on the (restored) Lua-facing stack.
+static int run_array_kernel(lua_State *L, const char *kernel) {
+  FakeLuaState *demo_state = check_demo_state(L, 1);
+  int i = luaL_checkint(L, 2);
+  int is_dot = (strcmp(kernel, "dot") == 0);
+  int j = is_dot ? luaL_checkint(L, 3) : 0;
+  lua_Number x = is_dot ? 0 : luaL_optnumber(L, 3, 0);
+  load_state(L, demo_state);
+  TypedArray *a = to_array(L, i);
+  TypedArray *b = is_dot ? to_array(L, j) : a;
+  const char *err = NULL;
+  double out1 = 0;
+  if (a == NULL || b == NULL) {
+    err = "expected a typed array at the given stack index";
+  } else if (a->kind != b->kind || a->len != b->len) {
+    err = "arrays must have the same kind and length";
+  } else if (is_dot) {
+    out1 = array_dot(a, b);
+  } else if (strcmp(kernel, "sum") == 0) {
+    out1 = array_sum(a);
+  } else if (strcmp(kernel, "scale") == 0) {
+    array_scale(a, x);
+  } else {
+    array_fill(a, x);
+  }
+  print_stack(L, 0);  // 0 --> tail values to omit
+  save_state(L, 0);   // 0 --> tail values to omit
+  if (err) return luaL_error(L, "%s: %s", kernel, err);
+  if (is_dot || strcmp(kernel, "sum") == 0) {
+    lua_pushnumber(L, out1);
+    return 1;
+  }
   return 0;
 }
 
+static int demo_array_sum(lua_State *L)   { return run_array_kernel(L, "sum"); }
+static int demo_array_dot(lua_State *L)   { return run_array_kernel(L, "dot"); }
+static int demo_array_scale(lua_State *L) {
+  luaL_checknumber(L, 3);
+  return run_array_kernel(L, "scale");
+}
+static int demo_array_fill(lua_State *L) {
+  luaL_checknumber(L, 3);
+  return run_array_kernel(L, "fill");
+}
+
 // ## The main entry point, and only directly public-facing function.
 
 int luaopen_apidemo(lua_State *L) {
 
   // Set up the unique metatable for our userdata instances.
-  // This table is empty and only used to verify that the userdata instances we
-  // receive are valid.
+  // This table is used to verify that the userdata instances we receive are
+  // valid, and lets go of the saved data of demo states that are collected.
       // stack = []
   luaL_newmetatable(L, demo_state_metatable);
       // stack = [mt = demo_state_metatable]
+  lua_pushcfunction(L, demo_state_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+      // stack = []
+  luaL_newmetatable(L, demo_buffer_metatable);
+      // stack = [mt = demo_buffer_metatable]
+  lua_pop(L, 1);
+      // stack = []
+
+  // Start counting allocations and collector cycles on the host state.
+  install_alloc(L);
+  if (luaL_newmetatable(L, gc_sentinel_metatable)) {
+      // stack = [mt = gc_sentinel_metatable]
+    lua_pushcfunction(L, on_gc_cycle);
+    lua_setfield(L, -2, "__gc");
+    arm_gc_sentinel(L);
+  }
+  lua_pop(L, 1);
+      // stack = []
+
+  // See whether table sizes can be read from the host's tables.
+  check_table_layout(L);
+
+  luaL_newmetatable(L, async_job_metatable);
+      // stack = [mt = async_job_metatable]
+  lua_pushcfunction(L, job_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_newtable(L);
+  push_protected(L, job_await, "await");
+  lua_setfield(L, -2, "await");
+  push_protected(L, job_cancel, "cancel");
+  lua_setfield(L, -2, "cancel");
+  push_protected(L, job_poll, "poll");
+  lua_setfield(L, -2, "poll");
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+  add_async_host(L);
+      // stack = []
+
+  luaL_newmetatable(L, typed_array_metatable);
+      // stack = [mt = typed_array_metatable]
+  lua_pushcfunction(L, array_index);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, array_newindex);
+  lua_setfield(L, -2, "__newindex");
+  lua_pushcfunction(L, array_len);
+  lua_setfield(L, -2, "__len");
   lua_pop(L, 1);
       // stack = []
 
+  // Record calls from the start if asked to by the environment, so a host
+  // doesn't need to change to leave a trail behind when it crashes.
+  const char *flight_path = getenv("APIDEMO_FLIGHT_RECORDER");
+  if (flight_path && *flight_path && flight == NULL) {
+    flight_open(L, flight_path, flight_default_entries);
+  }
+
   // Register the public-facing Lua methods of our module.
   luaL_Reg fns[] = {
     {"setup_globals", setup_globals},
+    {"budget",        budget},
+    {"chunk_cache",   chunk_cache},
+    {"export_c",      export_c},
+    {"fingerprint",   fingerprint},
+    {"goto",          goto_step},
     {"help",          show_help},
+    {"inspect",       inspect},
+    {"lint",          lint},
+    {"memory",        memory},
+    {"observe",       observe},
+    {"pool",          pool},
+    {"profile",       profile},
+    {"profile_dump",  profile_dump},
+    {"redo",          redo},
+    {"set_options",   set_options},
+    {"stream_stats",  stream_stats},
+    {"undo",          undo},
     {NULL, NULL}
   };
 #if LUA_VERSION_NUM == 501
@@ -984,5 +7678,36 @@ int luaopen_apidemo(lua_State *L) {
 #endif
       // stack = [apidemo]
 
+  // These load demo states, so they run in protected mode like setup_globals'
+  // functions do.
+  luaL_Reg demo_fns[] = {
+    {"newarray",      demo_newarray},
+    {"array_dot",     demo_array_dot},
+    {"array_fill",    demo_array_fill},
+    {"array_scale",   demo_array_scale},
+    {"array_sum",     demo_array_sum},
+    {"async_dofile",   async_dofile},
+    {"async_dostring", async_dostring},
+    {NULL, NULL}
+  };
+  luaL_Reg *fn;
+  for (fn = demo_fns; fn->name; ++fn) {
+    push_protected(L, fn->func, fn->name);
+    lua_setfield(L, -2, fn->name);
+  }
+      // stack = [apidemo]
+
+  // How many slots the host stack can have, and so how deep a demo stack can
+  // go once LUA_MINSTACK free slots are left for each call.
+#if LUA_VERSION_NUM == 501
+  lua_pushnumber(L, LUAI_MAXCSTACK);
+#else
+  lua_pushnumber(L, LUAI_MAXSTACK);
+#endif
+  lua_setfield(L, -2, "max_stack");
+  lua_pushnumber(L, LUA_MINSTACK);
+  lua_setfield(L, -2, "min_stack");
+      // stack = [apidemo]
+
   return 1;  // Number of Lua-facing return values on the Lua stack in L.
 }
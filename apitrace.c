@@ -0,0 +1,460 @@
+// apitrace.c
+//
+// This is a tracing shim for programs that embed Lua. It's built as a shared
+// library and loaded with LD_PRELOAD, so that it sits between an unmodified
+// host program and its Lua library:
+//
+//   $ LD_PRELOAD=./apitrace.so APITRACE_SAMPLE=100 ./host_program
+//
+// Each traced lua_* or luaL_* function records the call and then forwards it
+// to the real function, found with dlsym(RTLD_NEXT, ..). When the program
+// exits, a summary of each thread's hot functions, hot call pairs, possible
+// stack misuse, and most recent calls is written out.
+//
+// Settings come from the environment:
+//
+//   APITRACE_OUT     Write output to this file instead of stderr.
+//   APITRACE_SAMPLE  Print the stack after every Nth call on each thread, in
+//                    the same style as apidemo. 0, the default, turns it off.
+//
+// Implementation notes:
+//
+// Each thread records into its own ThreadTrace, so recording never takes a
+// lock. ThreadTraces are pushed onto a global list with a compare-and-swap so
+// the exit summary can find them, and they're never freed, so that threads
+// that have already exited are still summarized.
+//
+// Stacks are printed with apidemo's own print_item, which is why this file
+// includes apidemo.c. Those print functions call the Lua API themselves; a
+// per-thread flag makes the shim pass such calls straight through.
+//
+// Only calls that go through the dynamic linker can be seen. The host must use
+// Lua as a shared library, or export the API from its executable (-rdynamic).
+// A Lua library that binds its internal calls directly is fine: those calls
+// just aren't traced.
+//
+// This file is written against the Lua 5.1 API, as found in lua_src.
+//
+
+#define _GNU_SOURCE  // For RTLD_NEXT.
+
+#include "apidemo.c"
+
+#include <dlfcn.h>
+#include <stdlib.h>
+
+#if LUA_VERSION_NUM != 501
+#error "apitrace.c interposes the Lua 5.1 API; other versions differ in types."
+#endif
+
+// Each thread keeps its last ring_size calls.
+#define ring_size 256
+
+// The number of entries in each top-N list of the exit summary.
+#define summary_len 10
+
+// The number of most recent calls listed in the exit summary.
+#define last_calls_len 16
+
+
+// # The traced functions.
+
+// Each entry is (return type, name, parameters, arguments). The first
+// parameter is always the lua_State that's traced.
+
+#define traced_fns(X)                                                        \
+  X(int,          lua_cpcall,       (lua_State *L, lua_CFunction func,       \
+                                     void *ud), (L, func, ud))               \
+  X(int,          lua_equal,        (lua_State *L, int i, int j), (L, i, j)) \
+  X(int,          lua_error,        (lua_State *L), (L))                     \
+  X(int,          lua_gc,           (lua_State *L, int what, int data),      \
+                                    (L, what, data))                         \
+  X(int,          lua_getmetatable, (lua_State *L, int idx), (L, idx))       \
+  X(int,          lua_gettop,       (lua_State *L), (L))                     \
+  X(int,          lua_isnumber,     (lua_State *L, int idx), (L, idx))       \
+  X(int,          lua_isstring,     (lua_State *L, int idx), (L, idx))       \
+  X(int,          lua_isuserdata,   (lua_State *L, int idx), (L, idx))       \
+  X(int,          lua_lessthan,     (lua_State *L, int i, int j), (L, i, j)) \
+  X(int,          lua_load,         (lua_State *L, lua_Reader reader,        \
+                                     void *dt, const char *chunkname),       \
+                                    (L, reader, dt, chunkname))              \
+  X(lua_State *,  lua_newthread,    (lua_State *L), (L))                     \
+  X(void *,       lua_newuserdata,  (lua_State *L, size_t sz), (L, sz))      \
+  X(int,          lua_next,         (lua_State *L, int idx), (L, idx))       \
+  X(size_t,       lua_objlen,       (lua_State *L, int idx), (L, idx))       \
+  X(int,          lua_pcall,        (lua_State *L, int nargs, int nresults,  \
+                                     int errfunc),                           \
+                                    (L, nargs, nresults, errfunc))           \
+  X(const char *, lua_pushvfstring, (lua_State *L, const char *fmt,          \
+                                     va_list argp), (L, fmt, argp))          \
+  X(int,          lua_rawequal,     (lua_State *L, int i, int j), (L, i, j)) \
+  X(int,          lua_resume,       (lua_State *L, int narg), (L, narg))     \
+  X(int,          lua_setmetatable, (lua_State *L, int idx), (L, idx))       \
+  X(int,          lua_status,       (lua_State *L), (L))                     \
+  X(int,          lua_toboolean,    (lua_State *L, int idx), (L, idx))       \
+  X(lua_Integer,  lua_tointeger,    (lua_State *L, int idx), (L, idx))       \
+  X(const char *, lua_tolstring,    (lua_State *L, int idx, size_t *len),    \
+                                    (L, idx, len))                           \
+  X(lua_Number,   lua_tonumber,     (lua_State *L, int idx), (L, idx))       \
+  X(const void *, lua_topointer,    (lua_State *L, int idx), (L, idx))       \
+  X(void *,       lua_touserdata,   (lua_State *L, int idx), (L, idx))       \
+  X(int,          lua_type,         (lua_State *L, int idx), (L, idx))       \
+  X(const char *, lua_typename,     (lua_State *L, int tp), (L, tp))         \
+  X(int,          lua_yield,        (lua_State *L, int nresults),            \
+                                    (L, nresults))                           \
+  X(lua_Integer,  luaL_checkinteger, (lua_State *L, int narg), (L, narg))    \
+  X(const char *, luaL_checklstring, (lua_State *L, int narg, size_t *len),  \
+                                     (L, narg, len))                         \
+  X(lua_Number,   luaL_checknumber, (lua_State *L, int narg), (L, narg))     \
+  X(void *,       luaL_checkudata,  (lua_State *L, int ud, const char *name),\
+                                    (L, ud, name))                           \
+  X(int,          luaL_loadbuffer,  (lua_State *L, const char *buff,         \
+                                     size_t sz, const char *name),           \
+                                    (L, buff, sz, name))                     \
+  X(int,          luaL_loadfile,    (lua_State *L, const char *filename),    \
+                                    (L, filename))                           \
+  X(int,          luaL_loadstring,  (lua_State *L, const char *s), (L, s))   \
+  X(int,          luaL_newmetatable, (lua_State *L, const char *name),       \
+                                     (L, name))                              \
+  X(int,          luaL_ref,         (lua_State *L, int t), (L, t))
+
+// These are the same, except that they return nothing.
+
+#define traced_void_fns(X)                                                   \
+  X(void, lua_call,         (lua_State *L, int nargs, int nresults),         \
+                            (L, nargs, nresults))                            \
+  X(void, lua_concat,       (lua_State *L, int n), (L, n))                   \
+  X(void, lua_createtable,  (lua_State *L, int narr, int nrec),              \
+                            (L, narr, nrec))                                 \
+  X(void, lua_getfield,     (lua_State *L, int idx, const char *k),          \
+                            (L, idx, k))                                     \
+  X(void, lua_gettable,     (lua_State *L, int idx), (L, idx))               \
+  X(void, lua_insert,       (lua_State *L, int idx), (L, idx))               \
+  X(void, lua_pushboolean,  (lua_State *L, int b), (L, b))                   \
+  X(void, lua_pushcclosure, (lua_State *L, lua_CFunction fn, int n),         \
+                            (L, fn, n))                                      \
+  X(void, lua_pushinteger,  (lua_State *L, lua_Integer n), (L, n))           \
+  X(void, lua_pushlightuserdata, (lua_State *L, void *p), (L, p))            \
+  X(void, lua_pushlstring,  (lua_State *L, const char *s, size_t l),         \
+                            (L, s, l))                                       \
+  X(void, lua_pushnil,      (lua_State *L), (L))                             \
+  X(void, lua_pushnumber,   (lua_State *L, lua_Number n), (L, n))            \
+  X(void, lua_pushstring,   (lua_State *L, const char *s), (L, s))           \
+  X(void, lua_pushvalue,    (lua_State *L, int idx), (L, idx))               \
+  X(void, lua_rawget,       (lua_State *L, int idx), (L, idx))               \
+  X(void, lua_rawgeti,      (lua_State *L, int idx, int n), (L, idx, n))     \
+  X(void, lua_rawset,       (lua_State *L, int idx), (L, idx))               \
+  X(void, lua_rawseti,      (lua_State *L, int idx, int n), (L, idx, n))     \
+  X(void, lua_remove,       (lua_State *L, int idx), (L, idx))               \
+  X(void, lua_replace,      (lua_State *L, int idx), (L, idx))               \
+  X(void, lua_setfield,     (lua_State *L, int idx, const char *k),          \
+                            (L, idx, k))                                     \
+  X(void, lua_settable,     (lua_State *L, int idx), (L, idx))               \
+  X(void, lua_settop,       (lua_State *L, int idx), (L, idx))               \
+  X(void, lua_xmove,        (lua_State *L, lua_State *to, int n),            \
+                            (L, to, n))                                      \
+  X(void, luaL_checktype,   (lua_State *L, int narg, int t), (L, narg, t))   \
+  X(void, luaL_unref,       (lua_State *L, int t, int ref), (L, t, ref))
+
+#define fn_id(ret, name, params, args)   fn_ ## name,
+#define fn_name(ret, name, params, args) #name,
+
+// These functions are traced, but are written out by hand below.
+#define special_fns(X)                   \
+  X(void, lua_checkstack,  (), ())       \
+  X(void, lua_close,       (), ())       \
+  X(void, lua_pushfstring, (), ())       \
+  X(void, luaL_checkstack, (), ())
+
+enum {
+  traced_fns(fn_id)
+  traced_void_fns(fn_id)
+  special_fns(fn_id)
+  num_traced
+};
+
+static const char *traced_names[] = {
+  traced_fns(fn_name)
+  traced_void_fns(fn_name)
+  special_fns(fn_name)
+};
+
+
+// # Internal typedefs.
+
+typedef struct {
+  int        fn;
+  lua_State *L;
+  int        top_before;
+  int        top_after;   // -1 if the call threw an error instead of returning.
+} TraceRecord;
+
+typedef struct ThreadTrace {
+  TraceRecord         ring[ring_size];  // ring[num_calls % ring_size] is next.
+  unsigned long       num_calls;
+  unsigned long       counts[num_traced];
+  unsigned long       pairs[num_traced][num_traced];  // [previous fn][fn]
+  unsigned long       unchecked[num_traced];  // See check_stack_use.
+  int                 checked_top;
+  int                 prev_fn;
+  int                 is_printing;
+  int                 thread_num;
+  struct ThreadTrace *next;
+} ThreadTrace;
+
+
+// # Internal globals.
+
+static FILE *trace_out;
+static long  sample_period;
+
+static ThreadTrace *all_traces;
+static int          num_threads;
+
+static __thread ThreadTrace *my_trace;
+
+static int (*real_gettop)(lua_State *L);
+
+
+// # Internal functions.
+
+static void *find_real(const char *name) {
+  void *fn = dlsym(RTLD_NEXT, name);
+  if (fn == NULL) {
+    fprintf(stderr, "apitrace: can't find the real %s\n", name);
+    abort();
+  }
+  return fn;
+}
+
+static ThreadTrace *get_trace(void) {
+  if (my_trace) return my_trace;
+  ThreadTrace *trace = calloc(1, sizeof(ThreadTrace));
+  if (trace == NULL) return NULL;
+  trace->checked_top = LUA_MINSTACK;
+  trace->prev_fn     = -1;
+  trace->thread_num  = __sync_add_and_fetch(&num_threads, 1);
+  do {
+    trace->next = all_traces;
+  } while (!__sync_bool_compare_and_swap(&all_traces, trace->next, trace));
+  return my_trace = trace;
+}
+
+// C code may only use LUA_MINSTACK slots, counted from the bottom of its
+// frame, without calling lua_checkstack first. The shim can't see frame
+// boundaries, so this is a heuristic: it counts calls that leave the stack
+// taller than anything lua_checkstack has been asked for on this thread.
+static void check_stack_use(ThreadTrace *trace, TraceRecord *r, int sz) {
+  if (r->fn == fn_lua_checkstack || r->fn == fn_luaL_checkstack) {
+    if (r->top_before + sz > trace->checked_top) {
+      trace->checked_top = r->top_before + sz;
+    }
+  } else if (r->top_after > trace->checked_top) {
+    trace->unchecked[r->fn]++;
+  }
+}
+
+// This prints L's whole stack the way apidemo does, tagged with the call that
+// left it that way.
+// is_printing is set first so that the calls made here, lua_checkstack
+// included, go straight to the real functions without being traced.
+static void print_host_stack(ThreadTrace *trace, TraceRecord *r) {
+  trace->is_printing = 1;
+  if (!lua_checkstack(r->L, LUA_MINSTACK)) {
+    trace->is_printing = 0;
+    return;
+  }
+  output = trace_out;  // apidemo's print functions write here.
+  flockfile(trace_out);
+  out("[thread %d call %lu] %s\n  stack:",
+      trace->thread_num, trace->num_calls, traced_names[r->fn]);
+  int i;
+  for (i = 1; i <= r->top_after; ++i) {
+    out(" ");
+    print_item(r->L, i, 0);  // 0 --> as_key
+  }
+  if (r->top_after == 0) out(" <empty>");
+  out("\n");
+  funlockfile(trace_out);
+  trace->is_printing = 0;
+}
+
+// This records the start of a call, or returns NULL if it isn't traced.
+static TraceRecord *begin_call(int fn, lua_State *L) {
+  ThreadTrace *trace = get_trace();
+  if (trace == NULL || trace->is_printing) return NULL;
+  if (!real_gettop) real_gettop = (int (*)(lua_State *))find_real("lua_gettop");
+  TraceRecord *r = &trace->ring[trace->num_calls++ % ring_size];
+  r->fn         = fn;
+  r->L          = L;
+  r->top_before = L ? real_gettop(L) : 0;
+  r->top_after  = -1;
+  trace->counts[fn]++;
+  if (trace->prev_fn >= 0) trace->pairs[trace->prev_fn][fn]++;
+  trace->prev_fn = fn;
+  return r;
+}
+
+// This records the end of a call that returned normally. Any errors thrown
+// skip this, leaving the record's top_after at -1.
+static void end_call(TraceRecord *r, int sz) {
+  if (r == NULL) return;
+  ThreadTrace *trace = my_trace;
+  r->top_after = r->L ? real_gettop(r->L) : 0;
+  check_stack_use(trace, r, sz);
+  if (sample_period > 0 && r->L && trace->num_calls % sample_period == 0) {
+    print_host_stack(trace, r);
+  }
+}
+
+// This sorts (count, index) pairs by descending count.
+static int by_count(const void *a, const void *b) {
+  unsigned long x = ((const unsigned long *)a)[0];
+  unsigned long y = ((const unsigned long *)b)[0];
+  return (x < y) - (x > y);
+}
+
+// This prints the largest entries of counts, labeled by name_fn.
+static void print_top(const char *title, unsigned long *counts, int n,
+                      void (*name_fn)(int)) {
+  unsigned long (*sorted)[2] = malloc(n * sizeof(*sorted));
+  if (sorted == NULL) return;
+  int i, num_used = 0;
+  for (i = 0; i < n; ++i) {
+    if (counts[i] == 0) continue;
+    sorted[num_used][0] = counts[i];
+    sorted[num_used][1] = i;
+    num_used++;
+  }
+  qsort(sorted, num_used, sizeof(*sorted), by_count);
+  if (num_used) out("  %s:\n", title);
+  for (i = 0; i < num_used && i < summary_len; ++i) {
+    out("    %10lu  ", sorted[i][0]);
+    name_fn((int)sorted[i][1]);
+    out("\n");
+  }
+  free(sorted);
+}
+
+static void print_fn_name(int i) {
+  out("%s", traced_names[i]);
+}
+
+static void print_pair_name(int i) {
+  out("%s -> %s", traced_names[i / num_traced], traced_names[i % num_traced]);
+}
+
+static void print_summary(ThreadTrace *trace) {
+  out("apitrace: thread %d made %lu traced call%s\n",
+      trace->thread_num, trace->num_calls, trace->num_calls == 1 ? "" : "s");
+  print_top("hot functions", trace->counts, num_traced, print_fn_name);
+  print_top("hot call pairs", &trace->pairs[0][0], num_traced * num_traced,
+            print_pair_name);
+  print_top("calls that went past LUA_MINSTACK without lua_checkstack",
+            trace->unchecked, num_traced, print_fn_name);
+
+  unsigned long n = trace->num_calls;
+  if (n > last_calls_len) n = last_calls_len;
+  if (n) out("  last %lu call%s:\n", n, n == 1 ? "" : "s");
+  unsigned long k;
+  for (k = trace->num_calls - n; k < trace->num_calls; ++k) {
+    TraceRecord *r = &trace->ring[k % ring_size];
+    out("    %-22s L=%p top %d -> ", traced_names[r->fn], (void *)r->L,
+        r->top_before);
+    if (r->top_after < 0) {
+      out("(error thrown)\n");
+    } else {
+      out("%d\n", r->top_after);
+    }
+  }
+}
+
+
+// # Setup and shutdown.
+
+__attribute__((constructor))
+static void start_tracing(void) {
+  const char *path   = getenv("APITRACE_OUT");
+  const char *sample = getenv("APITRACE_SAMPLE");
+  trace_out = path ? fopen(path, "w") : NULL;
+  if (trace_out == NULL) trace_out = stderr;
+  if (sample) sample_period = strtol(sample, NULL, 10);
+}
+
+// Other threads may still be running; their summaries are best-effort.
+__attribute__((destructor))
+static void finish_tracing(void) {
+  if (my_trace) my_trace->is_printing = 1;
+  output = trace_out;
+  ThreadTrace *trace;
+  for (trace = all_traces; trace; trace = trace->next) print_summary(trace);
+  fflush(trace_out);
+}
+
+
+// # The interposed functions.
+
+#define define_traced(ret, name, params, args)                \
+  ret name params {                                           \
+    static ret (*real) params;                                \
+    if (!real) real = (ret (*) params)find_real(#name);       \
+    TraceRecord *r = begin_call(fn_ ## name, L);              \
+    ret result = real args;                                   \
+    end_call(r, 0);                                           \
+    return result;                                            \
+  }
+
+#define define_traced_void(ret, name, params, args)           \
+  ret name params {                                           \
+    static ret (*real) params;                                \
+    if (!real) real = (ret (*) params)find_real(#name);       \
+    TraceRecord *r = begin_call(fn_ ## name, L);              \
+    real args;                                                \
+    end_call(r, 0);                                           \
+  }
+
+traced_fns(define_traced)
+traced_void_fns(define_traced_void)
+
+const char *lua_pushfstring(lua_State *L, const char *fmt, ...) {
+  static const char *(*real)(lua_State *, const char *, va_list);
+  if (!real) real = (const char *(*)(lua_State *, const char *, va_list))
+                        find_real("lua_pushvfstring");
+  TraceRecord *r = begin_call(fn_lua_pushfstring, L);
+  va_list args;
+  va_start(args, fmt);
+  const char *result = real(L, fmt, args);
+  va_end(args);
+  end_call(r, 0);
+  return result;
+}
+
+// The stack sizes requested here feed check_stack_use.
+
+int lua_checkstack(lua_State *L, int sz) {
+  static int (*real)(lua_State *, int);
+  if (!real) real = (int (*)(lua_State *, int))find_real("lua_checkstack");
+  TraceRecord *r = begin_call(fn_lua_checkstack, L);
+  int result = real(L, sz);
+  end_call(r, result ? sz : 0);
+  return result;
+}
+
+void luaL_checkstack(lua_State *L, int sz, const char *msg) {
+  static void (*real)(lua_State *, int, const char *);
+  if (!real) real = (void (*)(lua_State *, int, const char *))
+                        find_real("luaL_checkstack");
+  TraceRecord *r = begin_call(fn_luaL_checkstack, L);
+  real(L, sz, msg);
+  end_call(r, sz);
+}
+
+// L is gone once the real lua_close returns, so the end of the call is
+// recorded by hand.
+void lua_close(lua_State *L) {
+  static void (*real)(lua_State *);
+  if (!real) real = (void (*)(lua_State *))find_real("lua_close");
+  TraceRecord *r = begin_call(fn_lua_close, L);
+  real(L);
+  if (r) r->top_after = 0;
+}
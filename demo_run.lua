@@ -51,6 +51,16 @@ lua_pushstring(L, "b");
 lua_pushstring(L, "c");
 lua_concat(L, 3);
 
+-- Building a string with a buffer.
+B = luaL_Buffer();  -- Like declaring `luaL_Buffer B;` in C.
+luaL_buffinit(L, B);
+luaL_addlstring(B, "built in ", 9);
+lua_pushnumber(L, 3);
+luaL_addvalue(B);
+luaL_addlstring(B, " steps", 6);
+luaL_pushresult(B);
+lua_pushfstring(L, "%s and %d more", "formatted", 1);
+
 -- Function call.
 lua_getglobal(L, "print");
 lua_pushstring(L, "I am a string to be printed!");
@@ -59,3 +69,73 @@ lua_call(L, 1, 0);  -- 1 input, 0 outputs
 -- Compile and run some code.
 luaL_loadstring(L, "print('I am printed from runtime-compiled code!')");
 lua_call(L, 0, 0);  -- 0 inputs, 0 outputs
+
+-- Typed arrays keep numbers in one contiguous C buffer.
+lua_settop(L, 0);
+apidemo.newarray(L, "f64", 1000000);
+apidemo.array_fill(L, 1, 0.5);
+apidemo.array_scale(L, 1, 4);
+print("Sum of the array:", apidemo.array_sum(L, 1));
+
+-- Coroutines. The body makes API calls on its own thread's stack.
+function body(n)
+  lua_pushnumber(L1, n * 2);
+  lua_yield(L1, 1);  -- Yield the top value back to whoever resumed L1.
+  return "finished";
+end
+L1 = lua_newthread(L);
+lua_getglobal(L1, "body");
+lua_pushnumber(L1, 21);
+print("lua_resume returned", lua_resume(L1, 1));  -- LUA_YIELD
+print("lua_resume returned", lua_resume(L1, 0));  -- 0, for success
+lua_xmove(L1, L, 2);  -- Move both results over to L.
+
+-- History. Each call is a step that can be undone and redone.
+L2 = luaL_newstate();
+lua_pushstring(L2, "a");
+lua_pushstring(L2, "b");
+lua_remove(L2, 1);
+apidemo.undo(L2);     -- Back to step 2: 'a' 'b'.
+apidemo.undo(L2);     -- Back to step 1: 'a'.
+apidemo.redo(L2);     -- Forward to step 2 again.
+apidemo["goto"](L2, 3);  -- Any step; goto is a keyword in Lua 5.2+.
+
+-- Deep stacks. Each call copies the demo stack onto the host stack and back,
+-- so its cost grows with the stack's depth: about linearly, if load_state and
+-- save_state are doing their job. The host stack can hold apidemo.max_stack
+-- slots (LUAI_MAXCSTACK in Lua 5.1, LUAI_MAXSTACK later), and each call needs
+-- apidemo.min_stack (LUA_MINSTACK) of them free, which leaves the rest for the
+-- demo stack, less slack: one slot for the table the demo stack is loaded
+-- from, and, as Lua 5.2+ counts the whole host stack, the frames below the
+-- call. lua_checkstack says whether there's room.
+apidemo.set_options{quiet = true};  -- Don't print thousands of items.
+L3 = luaL_newstate();
+function seconds_per_call(depth)
+  lua_settop(L3, depth);
+  local calls = math.max(10, math.floor(200000 / depth));
+  local start = os.clock();
+  for i = 1, calls do
+    lua_pushnumber(L3, i);
+    lua_pop(L3, 1);
+  end
+  return (os.clock() - start) / (2 * calls);
+end
+slack = (_VERSION == "Lua 5.1") and 1 or 100;
+limit = apidemo.max_stack - apidemo.min_stack;
+room = limit - slack;
+depth = room - 100;
+shallow = seconds_per_call(1000);
+deep = seconds_per_call(depth);
+if lua_checkstack(L3, room - depth) ~= 1 then
+  error("no room for " .. room .. " items on the demo stack");
+end
+if lua_checkstack(L3, limit - depth) ~= 0 then
+  error("room for " .. limit .. " items on the demo stack");
+end
+lua_settop(L3, 0);
+apidemo.set_options{quiet = false};
+print("Room for " .. room .. " items on the demo stack, but not " ..
+      limit .. ".");
+print(string.format("Calls at depth %d cost %.1f times those at 1000; " ..
+                    "linear would be %.1f.", depth, deep / shallow,
+                    depth / 1000));
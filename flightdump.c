@@ -0,0 +1,179 @@
+// flightdump.c
+//
+// This prints the calls kept by apidemo's flight recorder, oldest first:
+//
+//   $ APIDEMO_FLIGHT_RECORDER=calls.rec lua my_demo.lua
+//   $ ./flightdump calls.rec
+//
+// Each line shows a call's number, name and arguments, then the stack size
+// before and after the call and the value left on top. apidemo records values
+// without formatting them, keeping the first four arguments and the first 16
+// bytes of strings, so this is where they're turned into text. A call that
+// never saved a stack either raised an error, doesn't act on a stack (as with
+// luaL_newstate), or was running when the process died; if it's the last one
+// listed, it's usually the last.
+//
+// The file only needs to be readable, so this can be run while a recording
+// is still going on, although the newest entries may then show as being
+// written.
+//
+// This program doesn't use Lua, so it's built on its own:
+//
+//   $ cc -o flightdump flightdump.c
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// These must match the definitions in apidemo.c.
+
+#define flight_magic      "apidemo2"
+#define flight_max_names  512
+#define flight_max_args   4
+#define flight_text_len   16
+
+typedef struct {
+  char     magic[8];
+  uint32_t entry_size;
+  uint32_t num_entries;
+  uint64_t num_calls;
+  uint32_t num_names;
+  uint32_t unused;
+  char     names[flight_max_names][32];
+} FlightHeader;
+
+typedef struct {
+  int32_t  type;
+  uint32_t len;
+  union {
+    double   number;
+    uint64_t address;
+    char     text[flight_text_len];
+  } as;
+} FlightValue;
+
+typedef struct {
+  uint64_t    call;
+  int32_t     depth_before;
+  int32_t     depth_after;
+  uint32_t    name;
+  uint32_t    num_args;
+  FlightValue args[flight_max_args];
+  FlightValue top;
+} FlightEntry;
+
+// Lua's type names, by their LUA_T* numbers, which are the same in every
+// version from 5.1 on.
+static const char *type_names[] = {
+  "nil", "boolean", "userdata", "number", "string", "table", "function",
+  "userdata", "thread"
+};
+
+
+// This prints a fixed-size text field, which may lack a terminating zero if
+// it was being written when the process died.
+static void print_field(const char *field, size_t size) {
+  printf("%.*s", (int)strnlen(field, size), field);
+}
+
+// This prints a short form of a recorded value, as apidemo's printed stacks
+// would show it, with a string cut short after flight_text_len bytes.
+static void print_value(FlightValue *value) {
+  switch (value->type) {
+    case 1:  // LUA_TBOOLEAN
+      printf("%s", value->as.number ? "true" : "false");
+      break;
+    case 3:  // LUA_TNUMBER
+      printf("%.14g", value->as.number);
+      break;
+    case 4: {  // LUA_TSTRING
+      int len = (value->len < flight_text_len ? (int)value->len
+                                              : flight_text_len);
+      printf("'%.*s%s'", len, value->as.text,
+             value->len > flight_text_len ? "..." : "");
+      break;
+    }
+    default:
+      if (value->type >= 0 && value->type <= 8) {
+        printf("%s", type_names[value->type]);
+      } else {
+        printf("?");
+      }
+  }
+}
+
+static void print_entry(FlightHeader *header, FlightEntry *entry) {
+  printf("%8llu  ", (unsigned long long)entry->call);
+  if (entry->name > 0 && entry->name < header->num_names &&
+      entry->name < flight_max_names) {
+    print_field(header->names[entry->name], sizeof(header->names[0]));
+  } else {
+    printf("?");
+  }
+  printf("(");
+  uint32_t k;
+  for (k = 0; k < entry->num_args && k < flight_max_args; ++k) {
+    if (k > 0) printf(", ");
+    print_value(&entry->args[k]);
+  }
+  if (entry->num_args > flight_max_args) printf(", ...");
+  printf(")");
+  if (entry->depth_after < 0) {
+    printf("  -- no stack saved\n");
+    return;
+  }
+  printf("  -- depth %d -> %d", entry->depth_before, entry->depth_after);
+  if (entry->top.type >= 0) {
+    printf(", top ");
+    print_value(&entry->top);
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <flight recorder file>\n", argv[0]);
+    return 2;
+  }
+  FILE *f = fopen(argv[1], "rb");
+  if (f == NULL) {
+    fprintf(stderr, "can't open %s\n", argv[1]);
+    return 1;
+  }
+  FlightHeader header;
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      memcmp(header.magic, flight_magic, sizeof(header.magic)) != 0 ||
+      header.entry_size != sizeof(FlightEntry)) {
+    fprintf(stderr, "%s isn't a flight recorder file from this version of "
+                    "apidemo\n", argv[1]);
+    return 1;
+  }
+  FlightEntry *entries = calloc(header.num_entries, sizeof(FlightEntry));
+  size_t num_read = entries ? fread(entries, sizeof(FlightEntry),
+                                    header.num_entries, f) : 0;
+  fclose(f);
+
+  // The oldest call still kept is the one after the newest, in ring order.
+  uint64_t num_calls = header.num_calls;
+  uint64_t first = (num_calls > header.num_entries ?
+                    num_calls - header.num_entries + 1 : 1);
+  printf("%llu calls recorded; showing the last %llu.\n",
+         (unsigned long long)num_calls,
+         (unsigned long long)(num_calls - first + 1));
+  uint64_t call;
+  for (call = first; call <= num_calls; ++call) {
+    size_t slot = (call - 1) % header.num_entries;
+    if (slot >= num_read) break;  // The file was cut short.
+    FlightEntry *entry = &entries[slot];
+    if (entry->call != call) {
+      printf("%8llu  (entry being written, or overwritten by another "
+             "thread)\n", (unsigned long long)call);
+      continue;
+    }
+    print_entry(&header, entry);
+  }
+  free(entries);
+  return 0;
+}
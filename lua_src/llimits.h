@@ -0,0 +1,31 @@
+/*
+** Limits, basic types, and some other `installation-dependent' definitions
+** See Copyright Notice in lua.h
+**
+** From Lua 5.1.5: only the basic types that lobject.h's table structs use.
+*/
+
+#ifndef llimits_h
+#define llimits_h
+
+
+#include <limits.h>
+#include <stddef.h>
+
+
+#include "lua.h"
+
+
+typedef LUAI_UINT32 lu_int32;
+
+typedef LUAI_UMEM lu_mem;
+
+typedef LUAI_MEM l_mem;
+
+
+
+/* chars used as small naturals (so that `char' is reserved for characters) */
+typedef unsigned char lu_byte;
+
+
+#endif
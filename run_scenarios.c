@@ -0,0 +1,447 @@
+// run_scenarios.c
+//
+// This runs a directory of apidemo scenario scripts, such as demo_run.lua, on
+// a pool of threads, and compares each script's output to a golden file.
+//
+// Usage:
+//
+//   run_scenarios [-j num_threads] [-t seconds] [-u] dir
+//
+// For each dir/name.lua, the expected output is in dir/name.out. When they
+// differ, the actual output is written to dir/name.out.actual. With -u, the
+// golden files are written instead of checked. A scenario that runs for longer
+// than -t seconds, 60 by default, is stopped with an error. The exit status is
+// 0 when all scenarios pass.
+//
+// Implementation notes:
+//
+// Each worker thread owns one host lua_State, with apidemo in
+// package.preload, and runs scenarios from a shared list until none are left.
+// After each scenario, _G is reset to a copy saved when the worker started, so
+// globals set by one scenario don't leak into the next one on that worker.
+// apidemo's own per-thread settings, stats and pool are reset too, and the
+// demo states the scenario made are collected.
+//
+// apidemo keeps its globals per thread, and prints through its output global,
+// which this file can set because it includes apidemo.c. Scenario calls to
+// print and io.write are captured too. Pointers, such as the ones printed for
+// functions and threads, differ between runs, so each distinct pointer is
+// replaced by <1>, <2>, .. in order of first appearance before comparing.
+//
+
+#define _POSIX_C_SOURCE 200809L  // For open_memstream.
+
+#include "apidemo.c"
+
+#include <lualib.h>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define baseline_key "RunScenarios.BaselineGlobals"
+
+
+// # Internal typedefs.
+
+typedef enum { result_pass, result_fail, result_missing, result_updated } Result;
+
+typedef struct {
+  char   *path;  // The .lua file.
+  Result  result;
+} Scenario;
+
+
+// # Internal globals.
+
+static Scenario *scenarios;
+static int       num_scenarios;
+static int       next_scenario;  // Claimed by workers with an atomic add.
+static int       do_update;
+static double    time_limit = 60;  // In seconds, for each scenario.
+
+// When the scenario being run by this thread has to stop; see scenario_hook.
+static per_thread double scenario_deadline;
+
+
+// # Internal functions.
+
+// ## Capturing output.
+
+// This replaces print; it writes the same text to apidemo's output stream.
+static int capture_print(lua_State *L) {
+  int n = lua_gettop(L);
+  lua_getglobal(L, "tostring");
+  int i;
+  for (i = 1; i <= n; ++i) {
+    lua_pushvalue(L, -1);
+    lua_pushvalue(L, i);
+    lua_call(L, 1, 1);
+        // stack = [.., tostring, str]
+    const char *s = lua_tostring(L, -1);
+    if (s == NULL) return luaL_error(L, "'tostring' must return a string");
+    if (i > 1) out("\t");
+    out("%s", s);
+    lua_pop(L, 1);
+  }
+  out("\n");
+  return 0;
+}
+
+// This replaces io.write for strings and numbers.
+static int capture_write(lua_State *L) {
+  int n = lua_gettop(L);
+  int i;
+  for (i = 1; i <= n; ++i) {
+    size_t len;
+    const char *s = luaL_checklstring(L, i, &len);
+    out_bytes(s, len);
+  }
+  return 0;
+}
+
+// This replaces each distinct "0x<hex>" in buf with "<n>", in place, and
+// returns the new length.
+static size_t normalize_pointers(char *buf, size_t len) {
+  char   **seen     = NULL;
+  size_t  *seen_len = NULL;
+  int      num_seen = 0;
+  size_t   from, to = 0;
+  for (from = 0; from < len;) {
+    size_t n = 0;
+    if (buf[from] == '0' && from + 2 < len && buf[from + 1] == 'x') {
+      while (from + 2 + n < len && isxdigit((unsigned char)buf[from + 2 + n])) {
+        n++;
+      }
+    }
+    if (n == 0) {
+      buf[to++] = buf[from++];
+      continue;
+    }
+    n += 2;
+    int id;
+    for (id = 0; id < num_seen; ++id) {
+      if (seen_len[id] == n && memcmp(seen[id], buf + from, n) == 0) break;
+    }
+    if (id == num_seen) {
+      seen     = realloc(seen,     (num_seen + 1) * sizeof(*seen));
+      seen_len = realloc(seen_len, (num_seen + 1) * sizeof(*seen_len));
+      seen[num_seen] = malloc(n);
+      memcpy(seen[num_seen], buf + from, n);
+      seen_len[num_seen++] = n;
+    }
+    // A label longer than the hex it replaces, as can happen for short
+    // numbers like 0x1, would overrun the input; those are left as they are.
+    char label[32];
+    int label_len = snprintf(label, sizeof(label), "<%d>", id + 1);
+    if ((size_t)label_len > n) {
+      memmove(buf + to, buf + from, n);
+      label_len = (int)n;
+    } else {
+      memcpy(buf + to, label, label_len);
+    }
+    to   += label_len;
+    from += n;
+  }
+  int i;
+  for (i = 0; i < num_seen; ++i) free(seen[i]);
+  free(seen);
+  free(seen_len);
+  return to;
+}
+
+// ## Golden files.
+
+// This returns the contents of path, or NULL if it can't be read.
+static char *read_file(const char *path, size_t *len) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) return NULL;
+  char  *buf = NULL;
+  size_t size = 0, cap = 0, n;
+  do {
+    if (size == cap) {
+      cap = cap ? cap * 2 : 4096;
+      buf = realloc(buf, cap);
+    }
+    n = fread(buf + size, 1, cap - size, f);
+    size += n;
+  } while (n > 0);
+  fclose(f);
+  *len = size;
+  return buf;
+}
+
+static int write_file(const char *path, const char *buf, size_t len) {
+  FILE *f = fopen(path, "wb");
+  if (f == NULL) return 0;
+  int ok = (fwrite(buf, 1, len, f) == len);
+  return fclose(f) == 0 && ok;
+}
+
+static Result check_output(const char *lua_path, const char *buf, size_t len) {
+  size_t path_len = strlen(lua_path) - strlen(".lua");
+  char *golden = malloc(path_len + strlen(".out.actual") + 1);
+  memcpy(golden, lua_path, path_len);
+  strcpy(golden + path_len, ".out");
+
+  Result result;
+  if (do_update) {
+    result = write_file(golden, buf, len) ? result_updated : result_fail;
+  } else {
+    size_t golden_len;
+    char *expected = read_file(golden, &golden_len);
+    if (expected == NULL) {
+      result = result_missing;
+    } else {
+      int matches = (golden_len == len && memcmp(expected, buf, len) == 0);
+      result = matches ? result_pass : result_fail;
+      strcat(golden, ".actual");
+      if (matches) {
+        remove(golden);  // Clear out any output from an earlier failure.
+      } else {
+        write_file(golden, buf, len);
+      }
+    }
+    free(expected);
+  }
+  free(golden);
+  return result;
+}
+
+// ## Workers.
+
+// This sets up a host state for running scenarios.
+static lua_State *new_worker_state(void) {
+  lua_State *L = luaL_newstate();
+  luaL_openlibs(L);
+      // stack = []
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "preload");
+  lua_pushcfunction(L, luaopen_apidemo);
+  lua_setfield(L, -2, "apidemo");
+  lua_pop(L, 2);
+  lua_pushcfunction(L, capture_print);
+  lua_setglobal(L, "print");
+  lua_getglobal(L, "io");
+  lua_pushcfunction(L, capture_write);
+  lua_setfield(L, -2, "write");
+  lua_pop(L, 1);
+      // stack = []
+  lua_newtable(L);
+  lua_getglobal(L, "_G");
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+      // stack = [baseline, _G, key, value]
+    lua_pushvalue(L, -2);
+    lua_insert(L, -2);
+    lua_rawset(L, 1);
+  }
+  lua_pop(L, 1);
+  lua_setfield(L, LUA_REGISTRYINDEX, baseline_key);
+      // stack = []
+  return L;
+}
+
+// This returns _G to how it was when the worker started, so that globals set
+// by one scenario don't leak into the next. It's a shallow reset: tables that
+// were there to begin with, such as string, keep any changes.
+static void reset_globals(lua_State *L) {
+      // stack = []
+  lua_getfield(L, LUA_REGISTRYINDEX, baseline_key);
+  lua_getglobal(L, "_G");
+      // stack = [baseline, _G]
+  lua_pushnil(L);
+  while (lua_next(L, 2)) {
+      // stack = [baseline, _G, key, value]
+    lua_pushvalue(L, 3);
+    lua_rawget(L, 1);
+    if (!lua_rawequal(L, -1, -2)) {
+      lua_pushvalue(L, 3);
+      lua_insert(L, -2);
+      lua_rawset(L, 2);  // _G[key] = baseline[key], which may be nil.
+    } else {
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+      // stack = [baseline, _G, key]
+  }
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {
+      // stack = [baseline, _G, key, value]
+    lua_pushvalue(L, 3);
+    lua_insert(L, -2);
+    lua_rawset(L, 2);
+  }
+  lua_settop(L, 0);
+      // stack = []
+}
+
+// This puts apidemo's per-thread state back to how a new thread has it, so a
+// scenario's output doesn't depend on which scenarios ran before it on the
+// same worker. The flight recorder is left running, as it's set up by the
+// environment for the whole run.
+static void reset_apidemo(lua_State *L) {
+  memset(&options, 0, sizeof(options));
+  is_quiet = 0;
+  stream_close();
+  stream_events     = 0;
+  stream_bytes_sent = 0;
+  stream_dropped    = 0;
+  stream_unsent     = 0;
+  unchanged_state   = NULL;
+  unchanged_n       = -1;
+  has_observer      = 0;
+  gc_cycles         = 0;
+  lua_gc_seconds    = 0;
+  chunk_hits        = 0;
+  chunk_misses      = 0;
+  chunk_disk_hits   = 0;
+  chunk_disk_writes = 0;
+  chunk_note        = NULL;
+  pool_size         = 0;
+  pool_ready        = 0;
+  pool_hits         = 0;
+  pool_misses       = 0;
+  pool_generation++;  // States still out from the old pool aren't taken back.
+      // stack = []
+  const char *keys[] = {
+    pool_key, observer_key, observer_events_key, chunk_cache_key,
+    chunk_cache_dir_key
+  };
+  size_t k;
+  for (k = 0; k < sizeof(keys) / sizeof(keys[0]); ++k) {
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, keys[k]);
+  }
+      // stack = []
+}
+
+// This stops a scenario that's run past time_limit. As with apidemo's
+// budgets, the error is raised again at every instruction from then on, so the
+// scenario can't catch it and keep going.
+static void scenario_hook(lua_State *L, lua_Debug *ar) {
+  (void)ar;
+  if (wall_seconds() < scenario_deadline) return;
+  lua_sethook(L, scenario_hook, LUA_MASKCOUNT, 1);
+  luaL_error(L, "scenario ran for more than %f seconds", time_limit);
+}
+
+// This runs a scenario with its output going to apidemo's output stream.
+static void run_scenario(lua_State *L, const char *path) {
+  reset_apidemo(L);
+  scenario_deadline = wall_seconds() + time_limit;
+  lua_sethook(L, scenario_hook, LUA_MASKCOUNT, budget_period);
+      // stack = []
+  if (luaL_loadfile(L, path) == 0) lua_pcall(L, 0, 0, 0);
+      // stack = [] | [errmsg]
+  lua_sethook(L, NULL, 0, 0);
+  is_quiet = 0;  // The error is printed even if the scenario went quiet.
+  if (lua_gettop(L) > 0) out("error: %s\n", lua_tostring(L, -1));
+  lua_settop(L, 0);
+  reset_globals(L);
+  lua_gc(L, LUA_GCCOLLECT, 0);
+}
+
+static void *worker(void *arg) {
+  (void)arg;
+  lua_State *L = new_worker_state();
+  for (;;) {
+    int i = __sync_fetch_and_add(&next_scenario, 1);
+    if (i >= num_scenarios) break;
+    char  *buf = NULL;
+    size_t len = 0;
+    output = open_memstream(&buf, &len);
+    run_scenario(L, scenarios[i].path);
+    fclose(output);
+    output = NULL;
+    len = normalize_pointers(buf, len);
+    scenarios[i].result = check_output(scenarios[i].path, buf, len);
+    free(buf);
+  }
+  lua_close(L);
+  return NULL;
+}
+
+// ## Finding scenarios.
+
+static int by_path(const void *a, const void *b) {
+  return strcmp(((const Scenario *)a)->path, ((const Scenario *)b)->path);
+}
+
+static int find_scenarios(const char *dir_path) {
+  DIR *dir = opendir(dir_path);
+  if (dir == NULL) return 0;
+  struct dirent *entry;
+  int cap = 0;
+  while ((entry = readdir(dir))) {
+    size_t name_len = strlen(entry->d_name);
+    if (name_len <= 4 || strcmp(entry->d_name + name_len - 4, ".lua")) continue;
+    if (num_scenarios == cap) {
+      cap = cap ? cap * 2 : 64;
+      scenarios = realloc(scenarios, cap * sizeof(Scenario));
+    }
+    char *path = malloc(strlen(dir_path) + name_len + 2);
+    sprintf(path, "%s/%s", dir_path, entry->d_name);
+    scenarios[num_scenarios].path   = path;
+    scenarios[num_scenarios].result = result_fail;
+    num_scenarios++;
+  }
+  closedir(dir);
+  qsort(scenarios, num_scenarios, sizeof(Scenario), by_path);
+  return 1;
+}
+
+
+// # Main.
+
+int main(int argc, char **argv) {
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+  while ((opt = getopt(argc, argv, "j:t:u")) != -1) {
+    if (opt == 'j') {
+      num_threads = strtol(optarg, NULL, 10);
+    } else if (opt == 't') {
+      time_limit = strtod(optarg, NULL);
+    } else if (opt == 'u') {
+      do_update = 1;
+    } else {
+      optind = argc + 1;  // Force the usage message.
+    }
+  }
+  if (optind != argc - 1 || !(time_limit > 0)) {
+    fprintf(stderr, "usage: %s [-j num_threads] [-t seconds] [-u] dir\n",
+            argv[0]);
+    return 2;
+  }
+  if (!find_scenarios(argv[optind])) {
+    fprintf(stderr, "%s: can't open %s\n", argv[0], argv[optind]);
+    return 2;
+  }
+  if (num_threads < 1) num_threads = 1;
+  if (num_threads > num_scenarios) num_threads = num_scenarios;
+
+  pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+  long i;
+  for (i = 0; i < num_threads; ++i) {
+    pthread_create(&threads[i], NULL, worker, NULL);
+  }
+  for (i = 0; i < num_threads; ++i) pthread_join(threads[i], NULL);
+  free(threads);
+
+  static const char *labels[] = {"", "FAIL", "MISSING GOLDEN FILE", ""};
+  int counts[4] = {0, 0, 0, 0};
+  for (i = 0; i < num_scenarios; ++i) {
+    Result result = scenarios[i].result;
+    counts[result]++;
+    if (*labels[result]) printf("%s: %s\n", labels[result], scenarios[i].path);
+  }
+  if (do_update) {
+    printf("%d golden file(s) written, %d failed\n",
+           counts[result_updated], counts[result_fail]);
+  } else {
+    printf("%d passed, %d failed, %d missing golden files\n",
+           counts[result_pass], counts[result_fail], counts[result_missing]);
+  }
+  return counts[result_fail] + counts[result_missing] > 0;
+}
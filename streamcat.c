@@ -0,0 +1,76 @@
+// streamcat.c
+//
+// This is a small client for apidemo's socket stream, for testing. It
+// connects to the socket and copies each line it reads to stdout:
+//
+//   $ ./streamcat /tmp/apidemo.sock
+//
+// and, in another terminal, runs Lua with
+//
+//   apidemo.set_options{stream = '/tmp/apidemo.sock'}
+//
+// With -d ms, it waits ms milliseconds after each read, to act as a slow
+// viewer; apidemo should then drop events rather than slow down, and say how
+// many with {"dropped":k} lines. It exits when apidemo closes the stream.
+//
+// This program doesn't use Lua, so it's built on its own:
+//
+//   $ cc -o streamcat streamcat.c
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-d ms] <socket path>\n", name);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  int delay_ms = 0;
+  const char *path = NULL;
+  int k;
+  for (k = 1; k < argc; ++k) {
+    if (strcmp(argv[k], "-d") == 0 && k + 1 < argc) {
+      delay_ms = atoi(argv[++k]);
+    } else if (path == NULL) {
+      path = argv[k];
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (path == NULL) usage(argv[0]);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path %s is too long\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "can't connect to %s\n", path);
+    return 1;
+  }
+
+  // Small reads make the delay bite sooner.
+  char buffer[delay_ms ? 512 : 64 * 1024];
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+    fwrite(buffer, 1, n, stdout);
+    fflush(stdout);
+    if (delay_ms) {
+      struct timespec pause = {delay_ms / 1000, (delay_ms % 1000) * 1000000L};
+      nanosleep(&pause, NULL);
+    }
+  }
+  close(fd);
+  return 0;
+}